@@ -9,11 +9,203 @@
 #include <zephyr/device.h>
 #include <zephyr/drivers/sensor.h>
 #include <zephyr/kernel.h>
-#include <math.h>
+
+#include "orientation.h"
+
+#if defined(CONFIG_APP_IMU_FIFO)
+#include "imu_fifo.h"
+#endif
+#if defined(CONFIG_APP_IMU_FUSION)
+#include "fusion.h"
+#endif
+#if defined(CONFIG_APP_ZUPT)
+#include "zupt.h"
+#endif
+#if defined(CONFIG_APP_IMU_FEATURES)
+#include "imu_features.h"
+#endif
+#if defined(CONFIG_APP_IMU_POWER)
+#include "imu_power.h"
+#endif
+
+#if defined(CONFIG_APP_IMU_FIFO)
+#define ACC_ODR_HZ CONFIG_APP_IMU_ACC_ODR_HZ
+#define GYR_ODR_HZ CONFIG_APP_IMU_GYR_ODR_HZ
+#else
+#define ACC_ODR_HZ 100
+#define GYR_ODR_HZ 100
+#endif
+
+#if defined(CONFIG_APP_ZUPT)
+// The foot swing saturates 2 g and 500 deg/s
+#define ACC_RANGE_G   16
+#define GYR_RANGE_DPS 2000
+#else
+#define ACC_RANGE_G   2
+#define GYR_RANGE_DPS 500
+#endif
+
+#define RAD_TO_DEG (180.0f / 3.14159265f)
+
+#if defined(CONFIG_APP_IMU_FIFO)
+// Raw counts to m/s^2 and deg/s for the ranges set in main()
+#define ACC_LSB_TO_MS2(raw) ((raw) * (ACC_RANGE_G * 9.80665f / 32768.0f))
+#define GYR_LSB_TO_DPS(raw) ((raw) * (GYR_RANGE_DPS / 32768.0f))
+
+// Print about every 2 seconds, like the polled loop
+#define REPORT_INTERVAL_MS 2000
+
+#if defined(CONFIG_APP_IMU_FUSION)
+static struct fusion foot_fusion;
+static struct fusion_output foot_orientation;
+
+// Called from fusion_update() at CONFIG_APP_IMU_FUSION_OUTPUT_HZ
+static void fusion_output_handler(const struct fusion_output *out) {
+    foot_orientation = *out;
+}
+
+static const struct fusion_config foot_fusion_config = {
+    .gyr_scale     = GYR_RANGE_DPS / 32768.0f / RAD_TO_DEG,
+    .acc_lsb_per_g = 32768.0f / ACC_RANGE_G,
+    .odr_hz        = MAX(ACC_ODR_HZ, GYR_ODR_HZ),
+    .output_hz     = CONFIG_APP_IMU_FUSION_OUTPUT_HZ,
+    .output        = fusion_output_handler,
+};
+#endif
+
+#if defined(CONFIG_APP_ZUPT)
+static struct zupt foot_zupt;
+
+// Called from zupt_update() at every foot-flat phase
+static void stride_handler(const struct zupt_stride *stride) {
+    printk("Stride: %u mm in %u ms, %u mm/s, clearance %u mm\n", stride->length_mm,
+           stride->duration_ms, stride->speed_mm_s, stride->clearance_mm);
+}
+#endif
+
+#if defined(CONFIG_APP_IMU_POWER)
+static atomic_t imu_woken;
+
+// Called from the IMU work queue after every mode change
+static void imu_power_handler(enum imu_power_mode mode) {
+    if (mode == IMU_POWER_PERF) {
+        atomic_set(&imu_woken, 1);
+    }
+}
+
+static const struct imu_power_config imu_power_config = {
+    .acc_lsb_per_g = 32768.0f / ACC_RANGE_G,
+    .gyr_scale     = GYR_RANGE_DPS / 32768.0f / RAD_TO_DEG,
+    .changed       = imu_power_handler,
+};
+#endif
+
+#if defined(CONFIG_APP_IMU_FEATURES)
+static const char *const activity_names[] = {"still", "walking", "running", "unknown"};
+
+// Called from the IMU work queue on the feature interrupts
+static void imu_features_handler(const struct imu_features_event *evt) {
+#if defined(CONFIG_APP_IMU_POWER)
+    if ((evt->status & IMU_FEATURES_ANY_MOTION) ||
+        ((evt->status & IMU_FEATURES_ACTIVITY) && evt->activity != IMU_ACTIVITY_STILL)) {
+        imu_power_activity_report();
+    }
+#endif
+
+    if (evt->status & IMU_FEATURES_ACTIVITY) {
+        printk("Activity: %s, %u steps\n", activity_names[evt->activity], evt->steps);
+    }
+}
+#endif
+
+static void imu_batch_handler(const struct imu_fifo_batch *batch) {
+    static int64_t last_report;
+    const struct imu_fifo_frame *last = &batch->frames[batch->count - 1];
+
+#if defined(CONFIG_APP_IMU_POWER)
+    imu_power_batch(batch);
+
+    // Without the gyroscope there is nothing to fuse
+    if (imu_power_mode_get() == IMU_POWER_LOW) {
+        goto report;
+    }
+
+    // The orientation went stale while the gyroscope was off
+    if (atomic_clear(&imu_woken)) {
+#if defined(CONFIG_APP_IMU_FUSION)
+        fusion_init(&foot_fusion, &foot_fusion_config);
+#endif
+#if defined(CONFIG_APP_ZUPT)
+        zupt_init(&foot_zupt, stride_handler);
+#endif
+    }
+#endif
+
+#if defined(CONFIG_APP_ZUPT)
+    // The dead reckoning needs the orientation of every frame
+    zupt_update(&foot_zupt, &foot_fusion, batch->frames, batch->count);
+#elif defined(CONFIG_APP_IMU_FUSION)
+    // Every frame goes through the filter, only the report is sparse
+    fusion_update(&foot_fusion, batch->frames, batch->count);
+#endif
+
+#if defined(CONFIG_APP_IMU_POWER)
+report:
+#endif
+    if (batch->irq_us - last_report < REPORT_INTERVAL_MS * USEC_PER_MSEC) {
+        return;
+    }
+    last_report = batch->irq_us;
+
+    // The tilt works on the raw counts, no unit conversion needed
+    struct orientation_tilt tilt;
+    struct imu_fifo_stats stats;
+
+    orientation_tilt_get(last->acc, &tilt);
+
+    imu_fifo_stats_get(&stats);
+    printk("FIFO burst of %zu frames at sensortime %u (bursts %u, skipped %u)\n",
+           batch->count, last->sensortime, stats.bursts, stats.skipped);
+    printk(
+        "Acceleration (m/s^2): AX: %.6f; AY: %.6f; AZ: %.6f; \n"
+        "Rotational velocity (deg/s): GX: %.6f; GY: %.6f; GZ: %.6f\n",
+        (double)ACC_LSB_TO_MS2(last->acc[0]), (double)ACC_LSB_TO_MS2(last->acc[1]),
+        (double)ACC_LSB_TO_MS2(last->acc[2]), (double)GYR_LSB_TO_DPS(last->gyr[0]),
+        (double)GYR_LSB_TO_DPS(last->gyr[1]), (double)GYR_LSB_TO_DPS(last->gyr[2]));
+    printk("Pitch (Angle X): %.2f degrees\n", tilt.pitch / 100.0);
+    printk("Roll (Angle Y): %.2f degrees\n", tilt.roll / 100.0);
+
+#if defined(CONFIG_APP_IMU_FUSION)
+    struct fusion_euler euler;
+
+    fusion_euler_get(&foot_orientation.q, &euler);
+    printk("Fused roll %.2f, pitch %.2f, yaw %.2f degrees (%u accelerometer samples rejected)\n",
+           euler.roll / 100.0, euler.pitch / 100.0, euler.yaw / 100.0,
+           foot_orientation.rejected);
+#endif
+
+#if defined(CONFIG_APP_IMU_FEATURES)
+    struct imu_features_event features;
+
+    imu_features_get(&features);
+    printk("Sensor step count %u, activity %s\n", features.steps,
+           activity_names[features.activity]);
+#endif
+
+#if defined(CONFIG_APP_IMU_POWER)
+    struct imu_power_stats power;
+
+    imu_power_stats_get(&power);
+    printk("IMU %s mode, %u ms low power, %u ms performance, wakeup latency %u us (max %u us)\n",
+           imu_power_mode_get() == IMU_POWER_LOW ? "low power" : "performance",
+           power.time_in_mode_ms[IMU_POWER_LOW], power.time_in_mode_ms[IMU_POWER_PERF],
+           power.wake_latency_us, power.wake_latency_max_us);
+#endif
+}
+#endif
 
 int main(void) {
     const struct device *const dev = DEVICE_DT_GET_ONE(bosch_bmi270);
-    struct sensor_value acc[3], gyr[3];
     struct sensor_value full_scale, sampling_freq, oversampling;
 
     if (!device_is_ready(dev)) {
@@ -23,12 +215,16 @@ int main(void) {
 
     printk("Device %p name is %s\n", dev, dev->name);
 
+#if defined(CONFIG_APP_IMU_ORIENTATION_BENCH)
+    orientation_bench_run();
+#endif
+
     /* Setting scale in G, due to loss of precision if the SI unit m/s^2
 	 * is used
 	 */
-    full_scale.val1 = 2; /* G */
+    full_scale.val1 = ACC_RANGE_G; /* G */
     full_scale.val2 = 0;
-    sampling_freq.val1 = 100; /* Hz. Performance mode */
+    sampling_freq.val1 = ACC_ODR_HZ; /* Hz. Performance mode */
     sampling_freq.val2 = 0;
     oversampling.val1 = 1; /* Normal mode */
     oversampling.val2 = 0;
@@ -42,9 +238,9 @@ int main(void) {
     sensor_attr_set(dev, SENSOR_CHAN_ACCEL_XYZ, SENSOR_ATTR_SAMPLING_FREQUENCY, &sampling_freq);
 
     /* Setting scale in degrees/s to match the sensor scale */
-    full_scale.val1 = 500; /* dps */
+    full_scale.val1 = GYR_RANGE_DPS; /* dps */
     full_scale.val2 = 0;
-    sampling_freq.val1 = 100; /* Hz. Performance mode */
+    sampling_freq.val1 = GYR_ODR_HZ; /* Hz. Performance mode */
     sampling_freq.val2 = 0;
     oversampling.val1 = 1; /* Normal mode */
     oversampling.val2 = 0;
@@ -57,6 +253,38 @@ int main(void) {
 	 */
     sensor_attr_set(dev, SENSOR_CHAN_GYRO_XYZ, SENSOR_ATTR_SAMPLING_FREQUENCY, &sampling_freq);
 
+#if defined(CONFIG_APP_IMU_FIFO)
+#if defined(CONFIG_APP_IMU_FUSION)
+    fusion_init(&foot_fusion, &foot_fusion_config);
+#endif
+#if defined(CONFIG_APP_ZUPT)
+    zupt_init(&foot_zupt, stride_handler);
+#endif
+
+    // The FIFO processing thread does the work, main has nothing left to do
+    int err = imu_fifo_start(dev, imu_batch_handler);
+    if (err) {
+        printk("Failed to start the IMU FIFO (err %d)\n", err);
+    }
+
+#if defined(CONFIG_APP_IMU_FEATURES)
+    err = imu_features_start(imu_features_handler);
+    if (err) {
+        printk("Failed to start the IMU features (err %d)\n", err);
+    }
+#endif
+
+#if defined(CONFIG_APP_IMU_POWER)
+    // Starts in performance mode, as configured above
+    err = imu_power_init(dev, &imu_power_config);
+    if (err) {
+        printk("Failed to start the IMU power control (err %d)\n", err);
+    }
+#endif
+
+    return 0;
+#else
+    struct sensor_value acc[3], gyr[3];
     uint32_t iteration = 0;  // Declare a counter
 
     while (1) {
@@ -69,37 +297,38 @@ int main(void) {
             sensor_channel_get(dev, SENSOR_CHAN_ACCEL_XYZ, acc);  // m/s^2
             sensor_channel_get(dev, SENSOR_CHAN_GYRO_XYZ, gyr);   // rad/s
 
-            float acc_x = acc[0].val1 + acc[0].val2 / 1000000.0;
-            float acc_y = acc[1].val1 + acc[1].val2 / 1000000.0;
-            float acc_z = acc[2].val1 + acc[2].val2 / 1000000.0;
+            float acc_x = sensor_value_to_float(&acc[0]);
+            float acc_y = sensor_value_to_float(&acc[1]);
+            float acc_z = sensor_value_to_float(&acc[2]);
 
-            float gyr_x = gyr[0].val1 + gyr[0].val2 / 1000000.0;
-            float gyr_y = gyr[1].val1 + gyr[1].val2 / 1000000.0;
-            float gyr_z = gyr[2].val1 + gyr[2].val2 / 1000000.0;
+            float gyr_x_dps = sensor_value_to_float(&gyr[0]) * RAD_TO_DEG;
+            float gyr_y_dps = sensor_value_to_float(&gyr[1]) * RAD_TO_DEG;
+            float gyr_z_dps = sensor_value_to_float(&gyr[2]) * RAD_TO_DEG;
 
-            float gyr_x_dps = gyr_x * (180.0 / 3.14159265359);
-            float gyr_y_dps = gyr_y * (180.0 / 3.14159265359);
-            float gyr_z_dps = gyr_z * (180.0 / 3.14159265359);
+            // Calculate pitch and roll, mm/s^2 fits in 16 bits at 2 g
+            int16_t acc_mm[3];
+            struct orientation_tilt tilt;
 
-            // Calculate pitch and roll 
-            float pitch = atan2(acc_y, sqrt(acc_x * acc_x + acc_z * acc_z)) * (180.0 / 3.14159265359);
-            float roll = atan2(-acc_x, sqrt(acc_y * acc_y + acc_z * acc_z)) * (180.0 / 3.14159265359);
+            for (int i = 0; i < 3; i++) {
+                acc_mm[i] = CLAMP(sensor_value_to_milli(&acc[i]), INT16_MIN, INT16_MAX);
+            }
+            orientation_tilt_get(acc_mm, &tilt);
 
             printk(
                 "Acceleration (m/s^2): AX: %.6f; AY: %.6f; AZ: %.6f; \n"
                 "Rotational velocity (deg/s): GX: %.6f; GY: %.6f; GZ: %.6f\n",
-                acc_x, acc_y, acc_z, gyr_x_dps, gyr_y_dps, gyr_z_dps);
+                (double)acc_x, (double)acc_y, (double)acc_z,
+                (double)gyr_x_dps, (double)gyr_y_dps, (double)gyr_z_dps);
 
             // Print the calculated angles
-            printk("Pitch (Angle X): %.2f degrees\n", pitch);
-            printk("Roll (Angle Y): %.2f degrees\n", roll);
+            printk("Pitch (Angle X): %.2f degrees\n", tilt.pitch / 100.0);
+            printk("Roll (Angle Y): %.2f degrees\n", tilt.roll / 100.0);
 
             printf("\n");
         }
-        // Increment and reset the counter to avoid overflow
-        iteration = (iteration + 1) % 200;
-
-        k_sleep(K_MSEC(10));  // 10 ms sleep
+        // Reset the counter to avoid overflow
+        iteration %= 200;
     }
     return 0;
-}
\ No newline at end of file
+#endif
+}
@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <math.h>
+#include <stdlib.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/drivers/sensor.h>
+#include <zephyr/timing/timing.h>
+
+#include "orientation.h"
+#if defined(CONFIG_APP_IMU_FUSION)
+#include "fusion.h"
+#endif
+
+#define BENCH_SAMPLES 64
+#define BENCH_ROUNDS  16
+
+/* Counts per g at the +-2 g range. */
+#define BENCH_LSB_PER_G 16384
+
+static struct imu_fifo_frame frames[BENCH_SAMPLES];
+static struct sensor_value values[BENCH_SAMPLES][3];
+static struct orientation_tilt tilt[BENCH_SAMPLES];
+static float legacy_pitch[BENCH_SAMPLES];
+static float legacy_roll[BENCH_SAMPLES];
+
+static void samples_generate(void)
+{
+	for (size_t i = 0; i < BENCH_SAMPLES; i++) {
+		/* Sweep both angles over the full circle, with some noise
+		 * on the magnitude.
+		 */
+		float pitch = (float)i * (2.0f * 3.14159265f / BENCH_SAMPLES);
+		float roll = (float)(i * 7) * (2.0f * 3.14159265f / BENCH_SAMPLES);
+		float g = BENCH_LSB_PER_G * (0.9f + 0.2f * (float)(i % 5) / 4.0f);
+
+		frames[i].acc[0] = (int16_t)(-g * sinf(roll) * cosf(pitch));
+		frames[i].acc[1] = (int16_t)(g * sinf(pitch));
+		frames[i].acc[2] = (int16_t)(g * cosf(roll) * cosf(pitch));
+		frames[i].gyr[0] = (int16_t)(i * 97);
+		frames[i].gyr[1] = (int16_t)(i * -53);
+		frames[i].gyr[2] = (int16_t)(i * 31);
+		frames[i].sensortime = i * 16;
+
+		/* What the driver hands out in m/s^2. */
+		for (size_t axis = 0; axis < 3; axis++) {
+			int64_t micro = (int64_t)frames[i].acc[axis] * SENSOR_G / BENCH_LSB_PER_G;
+
+			values[i][axis].val1 = micro / 1000000;
+			values[i][axis].val2 = micro % 1000000;
+		}
+	}
+}
+
+/* The per-sample path of the original polled loop. */
+static void legacy_run(void)
+{
+	for (size_t i = 0; i < BENCH_SAMPLES; i++) {
+		float acc_x = values[i][0].val1 + values[i][0].val2 / 1000000.0;
+		float acc_y = values[i][1].val1 + values[i][1].val2 / 1000000.0;
+		float acc_z = values[i][2].val1 + values[i][2].val2 / 1000000.0;
+
+		legacy_pitch[i] = atan2(acc_y, sqrt(acc_x * acc_x + acc_z * acc_z)) *
+				  (180.0 / 3.14159265359);
+		legacy_roll[i] = atan2(-acc_x, sqrt(acc_y * acc_y + acc_z * acc_z)) *
+				 (180.0 / 3.14159265359);
+	}
+}
+
+static void kernel_run(void)
+{
+	orientation_tilt_batch(frames, BENCH_SAMPLES, tilt);
+}
+
+#if defined(CONFIG_APP_IMU_FUSION)
+#define BENCH_ODR_HZ MAX(CONFIG_APP_IMU_ACC_ODR_HZ, CONFIG_APP_IMU_GYR_ODR_HZ)
+
+static struct fusion fusion;
+
+static void fusion_run(void)
+{
+	fusion_update(&fusion, frames, BENCH_SAMPLES);
+}
+#endif
+
+static uint32_t cycles_per_sample(void (*run)(void))
+{
+	timing_t start;
+	timing_t end;
+
+	start = timing_counter_get();
+	for (size_t r = 0; r < BENCH_ROUNDS; r++) {
+		run();
+	}
+	end = timing_counter_get();
+
+	return (uint32_t)(timing_cycles_get(&start, &end) / (BENCH_SAMPLES * BENCH_ROUNDS));
+}
+
+void orientation_bench_run(void)
+{
+	uint32_t legacy_cycles;
+	uint32_t kernel_cycles;
+	int max_err = 0;
+
+	samples_generate();
+
+	timing_init();
+	timing_start();
+
+	legacy_cycles = cycles_per_sample(legacy_run);
+	kernel_cycles = cycles_per_sample(kernel_run);
+
+#if defined(CONFIG_APP_IMU_FUSION)
+	const struct fusion_config cfg = {
+		.gyr_scale = 500.0f / 32768.0f * (3.14159265f / 180.0f),
+		.acc_lsb_per_g = BENCH_LSB_PER_G,
+		.odr_hz = BENCH_ODR_HZ,
+		.output_hz = CONFIG_APP_IMU_FUSION_OUTPUT_HZ,
+	};
+
+	fusion_init(&fusion, &cfg);
+
+	uint32_t fusion_cycles = cycles_per_sample(fusion_run);
+	uint64_t permille = (uint64_t)fusion_cycles * BENCH_ODR_HZ * 1000 / timing_freq_get();
+#endif
+
+	timing_stop();
+
+	for (size_t i = 0; i < BENCH_SAMPLES; i++) {
+		int err_pitch = abs(tilt[i].pitch - (int)lroundf(legacy_pitch[i] * 100.0f));
+		int err_roll = abs(tilt[i].roll - (int)lroundf(legacy_roll[i] * 100.0f));
+
+		max_err = MAX(max_err, MAX(err_pitch, err_roll));
+	}
+
+	printk("Tilt per sample: %u cycles with double atan2/sqrt, %u cycles with the "
+	       "kernel, max difference %d.%02d degrees\n",
+	       legacy_cycles, kernel_cycles, max_err / 100, max_err % 100);
+#if defined(CONFIG_APP_IMU_FUSION)
+	printk("Fusion per frame: %u cycles, %u.%u %% of the CPU at %u Hz\n", fusion_cycles,
+	       (uint32_t)(permille / 10), (uint32_t)(permille % 10), BENCH_ODR_HZ);
+#endif
+}
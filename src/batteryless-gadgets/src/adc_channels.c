@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#include <zephyr/kernel.h>
+
+#include "adc_channels.h"
+
+BUILD_ASSERT(DT_NODE_HAS_PROP(ADC_CHANNELS_USER_NODE, io_channels) &&
+	     DT_NODE_HAS_PROP(ADC_CHANNELS_USER_NODE, io_channel_names),
+	     "zephyr,user needs io-channels and io-channel-names");
+
+/* The SAADC writes scan results in ascending channel order. */
+#define ADC_CHANNELS_CHECK_ORDER(node_id, prop, idx)                                   \
+	COND_CODE_0(idx, (),                                                           \
+		    (BUILD_ASSERT(DT_IO_CHANNELS_INPUT_BY_IDX(node_id, idx) >          \
+				  DT_IO_CHANNELS_INPUT_BY_IDX(node_id, UTIL_DEC(idx)), \
+				  "io-channels must be in ascending channel order");))
+
+#define ADC_CHANNELS_CHECK_SCAN(node_id, prop, idx)                                      \
+	BUILD_ASSERT(DT_PROP(ADC_CHANNELS_NODE(idx), zephyr_resolution) ==               \
+		     ADC_CHANNELS_RESOLUTION &&                                          \
+		     DT_PROP_OR(ADC_CHANNELS_NODE(idx), zephyr_oversampling, 0) ==       \
+		     ADC_CHANNELS_OVERSAMPLING,                                          \
+		     "all io-channels must use the same resolution and oversampling");
+
+DT_FOREACH_PROP_ELEM(ADC_CHANNELS_USER_NODE, io_channels, ADC_CHANNELS_CHECK_ORDER)
+DT_FOREACH_PROP_ELEM(ADC_CHANNELS_USER_NODE, io_channels, ADC_CHANNELS_CHECK_SCAN)
+
+#define ADC_CHANNELS_DESC(node_id, prop, idx)                                           \
+	{                                                                               \
+		.name = DT_PROP_BY_IDX(node_id, io_channel_names, idx),                 \
+		.channel_id = DT_IO_CHANNELS_INPUT_BY_IDX(node_id, idx),                \
+		.input_positive = DT_PROP(ADC_CHANNELS_NODE(idx), zephyr_input_positive), \
+		.input_negative =                                                       \
+			DT_PROP_OR(ADC_CHANNELS_NODE(idx), zephyr_input_negative, 0),   \
+		.gain = DT_STRING_TOKEN(ADC_CHANNELS_NODE(idx), zephyr_gain),           \
+		.reference = DT_STRING_TOKEN(ADC_CHANNELS_NODE(idx), zephyr_reference), \
+		.acquisition_time =                                                     \
+			DT_PROP(ADC_CHANNELS_NODE(idx), zephyr_acquisition_time),       \
+	},
+
+const struct adc_channel_desc adc_channels[ADC_CHANNELS_COUNT] = {
+	DT_FOREACH_PROP_ELEM(ADC_CHANNELS_USER_NODE, io_channels, ADC_CHANNELS_DESC)
+};
+
+uint32_t adc_channels_mask(void)
+{
+	uint32_t mask = 0;
+
+	for (size_t i = 0; i < ARRAY_SIZE(adc_channels); i++) {
+		mask |= BIT(adc_channels[i].channel_id);
+	}
+
+	return mask;
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#ifndef ADC_CHANNELS_H_
+#define ADC_CHANNELS_H_
+
+#include <stdint.h>
+
+#include <zephyr/devicetree.h>
+#include <zephyr/drivers/adc.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Every io-channels entry of the zephyr,user node is sampled in a single
+ * SAADC scan. The results of one scan are stored next to each other in the
+ * order given by io-channels, so one scan is one "frame" of
+ * ADC_CHANNELS_COUNT samples.
+ */
+#define ADC_CHANNELS_USER_NODE DT_PATH(zephyr_user)
+#define ADC_CHANNELS_CTLR_NODE DT_IO_CHANNELS_CTLR(ADC_CHANNELS_USER_NODE)
+#define ADC_CHANNELS_COUNT     DT_PROP_LEN(ADC_CHANNELS_USER_NODE, io_channels)
+
+#define ADC_CHANNELS_NODE_IF_INPUT(child, input) \
+	IF_ENABLED(IS_EQ(DT_REG_ADDR(child), input), (child))
+
+/** Channel node of the controller referenced by io-channels entry @p idx. */
+#define ADC_CHANNELS_NODE(idx)                                                  \
+	DT_FOREACH_CHILD_VARGS(ADC_CHANNELS_CTLR_NODE, ADC_CHANNELS_NODE_IF_INPUT, \
+			       DT_IO_CHANNELS_INPUT_BY_IDX(ADC_CHANNELS_USER_NODE, idx))
+
+/* Internal SAADC reference, used when a channel has no zephyr,vref-mv. */
+#define ADC_CHANNELS_VREF_INTERNAL_MV 600
+
+/* Resolution and oversampling are shared by all channels of a scan. */
+#define ADC_CHANNELS_RESOLUTION   DT_PROP(ADC_CHANNELS_NODE(0), zephyr_resolution)
+#define ADC_CHANNELS_OVERSAMPLING DT_PROP_OR(ADC_CHANNELS_NODE(0), zephyr_oversampling, 0)
+
+#define ADC_CHANNELS_ENUM_ENTRY(node_id, prop, idx) \
+	UTIL_CAT(ADC_CHANNEL_, DT_STRING_UPPER_TOKEN_BY_IDX(node_id, prop, idx)),
+
+/** Position of each named channel within a frame, from io-channel-names. */
+enum adc_channel_slot {
+	DT_FOREACH_PROP_ELEM(ADC_CHANNELS_USER_NODE, io_channel_names, ADC_CHANNELS_ENUM_ENTRY)
+};
+
+/** Devicetree settings of one channel. */
+struct adc_channel_desc {
+	const char *name;
+	uint8_t channel_id;
+	/** Positive input, NRF_SAADC_AINx or NRF_SAADC_VDD. */
+	uint8_t input_positive;
+	/** Negative input, 0 for single-ended channels. */
+	uint8_t input_negative;
+	enum adc_gain gain;
+	enum adc_reference reference;
+	uint16_t acquisition_time;
+};
+
+/** Channels in scan order, ADC_CHANNELS_COUNT entries. */
+extern const struct adc_channel_desc adc_channels[ADC_CHANNELS_COUNT];
+
+/** Bit mask of all channel IDs used in the scan. */
+uint32_t adc_channels_mask(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ADC_CHANNELS_H_ */
@@ -0,0 +1,166 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/dt-bindings/adc/nrf-adc.h>
+#include <zephyr/settings/settings.h>
+#include <zephyr/shell/shell.h>
+
+#include "adc_conv.h"
+
+#define ADC_CONV_TRIM_KEY "adc/trim"
+
+/* Input range of a channel is vref / gain, so it scales with the
+ * denominator and shrinks with the numerator of the gain.
+ */
+#define ADC_CONV_GAIN_DEN(g)                                                            \
+	((g) == ADC_GAIN_1_6 ? 6 : (g) == ADC_GAIN_1_5 ? 5 : (g) == ADC_GAIN_1_4 ? 4 :  \
+	 (g) == ADC_GAIN_1_3 ? 3 : (g) == ADC_GAIN_1_2 ? 2 : 1)
+#define ADC_CONV_GAIN_NUM(g) ((g) == ADC_GAIN_4 ? 4 : (g) == ADC_GAIN_2 ? 2 : 1)
+
+/* VDDHDIV5 is VDDH divided by five inside the SAADC. */
+#define ADC_CONV_INPUT_DIV(node)                                                        \
+	(DT_PROP(node, zephyr_input_positive) == NRF_SAADC_VDDHDIV5 ? 5 : 1)
+
+#define ADC_CONV_VREF_MV(node)                                                          \
+	DT_PROP_OR(node, zephyr_vref_mv, ADC_CHANNELS_VREF_INTERNAL_MV)
+
+/* Differential channels are signed and lose one bit of range. */
+#define ADC_CONV_BITS(node)                                                             \
+	(ADC_CHANNELS_RESOLUTION - (DT_NODE_HAS_PROP(node, zephyr_input_negative) ? 1 : 0))
+
+#define ADC_CONV_SCALE_Q16(node)                                                        \
+	(int32_t)(((uint64_t)ADC_CONV_VREF_MV(node) * ADC_CONV_INPUT_DIV(node) *        \
+		   ADC_CONV_GAIN_DEN(DT_STRING_TOKEN(node, zephyr_gain)) << 16) /       \
+		  ((uint64_t)ADC_CONV_GAIN_NUM(DT_STRING_TOKEN(node, zephyr_gain)) <<   \
+		   ADC_CONV_BITS(node)))
+
+#define ADC_CONV_NOMINAL(node_id, prop, idx) ADC_CONV_SCALE_Q16(ADC_CHANNELS_NODE(idx)),
+
+static const int32_t nominal_scale_q16[ADC_CHANNELS_COUNT] = {
+	DT_FOREACH_PROP_ELEM(ADC_CHANNELS_USER_NODE, io_channels, ADC_CONV_NOMINAL)
+};
+
+#define ADC_CONV_COEFF_INIT(node_id, prop, idx)                                         \
+	{ .scale_q16 = ADC_CONV_SCALE_Q16(ADC_CHANNELS_NODE(idx)), .offset = 0 },
+
+struct adc_conv_coeff adc_conv_coeffs[ADC_CHANNELS_COUNT] = {
+	DT_FOREACH_PROP_ELEM(ADC_CHANNELS_USER_NODE, io_channels, ADC_CONV_COEFF_INIT)
+};
+
+static struct adc_conv_trim trims[ADC_CHANNELS_COUNT];
+
+static void coeffs_apply(void)
+{
+	for (size_t i = 0; i < ADC_CHANNELS_COUNT; i++) {
+		int64_t scale = (int64_t)nominal_scale_q16[i] * (1000000 + trims[i].gain_ppm);
+
+		adc_conv_coeffs[i].scale_q16 = (int32_t)(scale / 1000000);
+		adc_conv_coeffs[i].offset = trims[i].offset_lsb;
+	}
+}
+
+void adc_conv_frames_to_mv(const int16_t *raw, int32_t *mv, size_t count)
+{
+	for (size_t i = 0; i < count; i += ADC_CHANNELS_COUNT) {
+		for (size_t ch = 0; ch < ADC_CHANNELS_COUNT; ch++) {
+			mv[i + ch] = adc_conv_to_mv(ch, raw[i + ch]);
+		}
+	}
+}
+
+void adc_conv_trim_get(enum adc_channel_slot slot, struct adc_conv_trim *trim)
+{
+	*trim = trims[slot];
+}
+
+int adc_conv_trim_save(enum adc_channel_slot slot, const struct adc_conv_trim *trim)
+{
+	trims[slot] = *trim;
+	coeffs_apply();
+
+	return settings_save_one(ADC_CONV_TRIM_KEY, trims, sizeof(trims));
+}
+
+static int adc_trim_set(const char *name, size_t len, settings_read_cb read_cb, void *cb_arg)
+{
+	const char *next;
+	ssize_t rc;
+
+	if (!settings_name_steq(name, "trim", &next) || next) {
+		return -ENOENT;
+	}
+
+	/* A channel was added or removed since the trim was written. */
+	if (len != sizeof(trims)) {
+		printk("Ignoring ADC trim of %zu bytes\n", len);
+		return 0;
+	}
+
+	rc = read_cb(cb_arg, trims, sizeof(trims));
+	if (rc < 0) {
+		return rc;
+	}
+
+	coeffs_apply();
+
+	return 0;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(adc_conv, "adc", NULL, adc_trim_set, NULL, NULL);
+
+#if defined(CONFIG_SHELL)
+static int cmd_trim_show(const struct shell *sh, size_t argc, char **argv)
+{
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	for (size_t i = 0; i < ADC_CHANNELS_COUNT; i++) {
+		shell_print(sh, "%s: gain %d ppm, offset %d LSB, scale %d/65536 mV",
+			    adc_channels[i].name, trims[i].gain_ppm, trims[i].offset_lsb,
+			    adc_conv_coeffs[i].scale_q16);
+	}
+
+	return 0;
+}
+
+static int cmd_trim_set(const struct shell *sh, size_t argc, char **argv)
+{
+	struct adc_conv_trim trim;
+	int err;
+
+	for (size_t i = 0; i < ADC_CHANNELS_COUNT; i++) {
+		if (strcmp(argv[1], adc_channels[i].name)) {
+			continue;
+		}
+
+		trim.gain_ppm = strtol(argv[2], NULL, 10);
+		trim.offset_lsb = strtol(argv[3], NULL, 10);
+
+		err = adc_conv_trim_save(i, &trim);
+		if (err) {
+			shell_error(sh, "Failed to store trim (err %d)", err);
+		}
+
+		return err;
+	}
+
+	shell_error(sh, "Unknown channel %s", argv[1]);
+
+	return -EINVAL;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_adc_trim,
+	SHELL_CMD_ARG(show, NULL, "Show the factory trim", cmd_trim_show, 1, 0),
+	SHELL_CMD_ARG(set, NULL, "<channel> <gain_ppm> <offset_lsb>", cmd_trim_set, 4, 0),
+	SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(adc_trim, &sub_adc_trim, "ADC factory trim", NULL);
+#endif /* CONFIG_SHELL */
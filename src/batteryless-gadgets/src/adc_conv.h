@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#ifndef ADC_CONV_H_
+#define ADC_CONV_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <zephyr/sys/util.h>
+
+#include "adc_channels.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Integer conversion coefficients of one channel.
+ *
+ * mV = ((raw - offset) * scale_q16) >> 16
+ *
+ * The nominal scale is derived at compile time from the devicetree gain,
+ * reference and resolution, then corrected at boot with the factory trim.
+ * raw * scale_q16 is bounded by the full-scale voltage times 2^16, so the
+ * product always fits in 32 bits.
+ */
+struct adc_conv_coeff {
+	int32_t scale_q16;
+	int16_t offset;
+};
+
+/** Factory trim of one channel, stored in settings under "adc/trim". */
+struct adc_conv_trim {
+	/** Gain error in parts per million, added to the nominal scale. */
+	int32_t gain_ppm;
+	/** Offset in LSB, subtracted from every raw sample. */
+	int16_t offset_lsb;
+};
+
+extern struct adc_conv_coeff adc_conv_coeffs[ADC_CHANNELS_COUNT];
+
+/**
+ * @brief Convert one raw sample of channel @p slot to millivolts.
+ */
+static inline int32_t adc_conv_to_mv(enum adc_channel_slot slot, int16_t raw)
+{
+	const struct adc_conv_coeff *c = &adc_conv_coeffs[slot];
+
+	return ((raw - c->offset) * c->scale_q16 + (1 << 15)) >> 16;
+}
+
+/**
+ * @brief Convert millivolts to the raw code of channel @p slot.
+ *
+ * Used to program hardware thresholds such as the SAADC limits.
+ */
+static inline int16_t adc_conv_from_mv(enum adc_channel_slot slot, int32_t mv)
+{
+	const struct adc_conv_coeff *c = &adc_conv_coeffs[slot];
+	int32_t raw = (int32_t)(((int64_t)mv << 16) / c->scale_q16) + c->offset;
+
+	return CLAMP(raw, INT16_MIN, INT16_MAX);
+}
+
+/**
+ * @brief Convert interleaved frames of raw samples to millivolts.
+ *
+ * @param raw    Interleaved samples, ADC_CHANNELS_COUNT per frame.
+ * @param mv     Output, same layout as @p raw.
+ * @param count  Number of samples, a multiple of ADC_CHANNELS_COUNT.
+ */
+void adc_conv_frames_to_mv(const int16_t *raw, int32_t *mv, size_t count);
+
+/**
+ * @brief Store a new factory trim for channel @p slot and apply it.
+ *
+ * @retval 0 on success, negative errno from the settings subsystem otherwise.
+ */
+int adc_conv_trim_save(enum adc_channel_slot slot, const struct adc_conv_trim *trim);
+
+/**
+ * @brief Get the trim currently applied to channel @p slot.
+ */
+void adc_conv_trim_get(enum adc_channel_slot slot, struct adc_conv_trim *trim);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ADC_CONV_H_ */
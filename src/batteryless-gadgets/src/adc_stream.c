@@ -0,0 +1,669 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/rtio/rtio.h>
+#include <zephyr/sys/atomic.h>
+
+#include <nrfx_saadc.h>
+#include <nrfx_timer.h>
+#include <helpers/nrfx_gppi.h>
+
+#include "adc_channels.h"
+#include "adc_stream.h"
+#include "timebase.h"
+
+#define SAADC_NODE ADC_CHANNELS_CTLR_NODE
+
+/* Each timer tick triggers one scan of all channels into the buffer. */
+#define STREAM_BUF_SAMPLES (CONFIG_APP_ADC_STREAM_BLOCK_SAMPLES * ADC_CHANNELS_COUNT)
+
+/* Every pool buffer starts with the block header, the SAADC writes the
+ * samples right behind it.
+ */
+struct adc_stream_header {
+	uint32_t seq;
+	/* Common time of the END event of the block. */
+	int64_t timestamp_us;
+};
+
+#define STREAM_HDR_SIZE ROUND_UP(sizeof(struct adc_stream_header), 8)
+#define STREAM_BUF_SIZE (STREAM_HDR_SIZE + STREAM_BUF_SAMPLES * sizeof(nrf_saadc_value_t))
+
+/* Reads queued by the pipeline, at most as deep as its submission queue. */
+#define PENDING_MAX 8
+
+BUILD_ASSERT(ADC_CHANNELS_OVERSAMPLING <= NRF_SAADC_OVERSAMPLE_256X,
+	     "unsupported SAADC oversampling");
+
+/* TIMER0 belongs to the radio (MPSL), so the sample clock uses TIMER2. */
+static const nrfx_timer_t sample_timer = NRFX_TIMER_INSTANCE(2);
+
+static nrfx_saadc_channel_t stream_channels[ADC_CHANNELS_COUNT];
+
+/* A read queued by the pipeline, with its pool buffer once allocated. A
+ * request without a read stands for the scratch buffer.
+ */
+struct stream_req {
+	struct rtio_iodev_sqe *iodev_sqe;
+	uint8_t *buf;
+};
+
+struct stream_req_ring {
+	struct stream_req reqs[PENDING_MAX];
+	uint8_t head;
+	uint8_t count;
+};
+
+static struct stream_req_ring pending;
+static struct stream_req_ring in_dma;
+
+/* Blocks arriving while no read is queued are converted into this buffer
+ * and dropped.
+ */
+static nrf_saadc_value_t scratch_buf[STREAM_BUF_SAMPLES];
+
+static uint8_t ppi_channel;
+static bool ppi_allocated;
+
+#if defined(CONFIG_APP_TIMEBASE_CAPTURE)
+static uint8_t end_capture;
+static bool end_captured;
+#endif
+static atomic_t running;
+
+static uint32_t block_seq;
+static uint32_t overrun_count;
+
+/* Frame index to common time, only used by the decoding side. */
+static struct timebase_sync frame_sync;
+
+/* While idle, full blocks are recycled in the ISR and only a limit event
+ * wakes the consumer side again.
+ */
+static atomic_t idle;
+static adc_stream_wake_t wake_handler;
+static uint32_t armed_limits;
+
+/* Low watches are independent of idle mode and fire once. */
+static adc_stream_wake_t watch_handler;
+static uint32_t watched_limits;
+
+static bool ring_push(struct stream_req_ring *ring, const struct stream_req *req)
+{
+	if (ring->count == ARRAY_SIZE(ring->reqs)) {
+		return false;
+	}
+
+	ring->reqs[(ring->head + ring->count) % ARRAY_SIZE(ring->reqs)] = *req;
+	ring->count++;
+
+	return true;
+}
+
+static bool ring_pop(struct stream_req_ring *ring, struct stream_req *req)
+{
+	if (ring->count == 0) {
+		return false;
+	}
+
+	*req = ring->reqs[ring->head];
+	ring->head = (ring->head + 1) % ARRAY_SIZE(ring->reqs);
+	ring->count--;
+
+	return true;
+}
+
+static void ring_cancel(struct stream_req_ring *ring)
+{
+	struct stream_req req;
+
+	while (ring_pop(ring, &req)) {
+		if (req.iodev_sqe) {
+			rtio_iodev_sqe_err(req.iodev_sqe, -ECANCELED);
+		}
+	}
+}
+
+/* Pick the buffer for the block after the current one. */
+static nrf_saadc_value_t *buffer_next(void)
+{
+	struct stream_req req = {0};
+	uint32_t len;
+
+	while (ring_pop(&pending, &req)) {
+		if (req.buf || rtio_sqe_rx_buf(req.iodev_sqe, STREAM_BUF_SIZE, STREAM_BUF_SIZE,
+					       &req.buf, &len) == 0) {
+			break;
+		}
+
+		rtio_iodev_sqe_err(req.iodev_sqe, -ENOMEM);
+		req = (struct stream_req){0};
+	}
+
+	ring_push(&in_dma, &req);
+
+	return req.iodev_sqe ? (nrf_saadc_value_t *)&req.buf[STREAM_HDR_SIZE] : scratch_buf;
+}
+
+static enum adc_channel_slot slot_by_channel(uint8_t channel_id)
+{
+	for (size_t i = 0; i < ADC_CHANNELS_COUNT; i++) {
+		if (adc_channels[i].channel_id == channel_id) {
+			return i;
+		}
+	}
+
+	return 0;
+}
+
+static void limits_disarm(void)
+{
+	for (size_t i = 0; i < ADC_CHANNELS_COUNT; i++) {
+		if (armed_limits & BIT(i)) {
+			nrfx_saadc_limits_set(adc_channels[i].channel_id,
+					      NRFX_SAADC_LIMITL_DISABLED,
+					      NRFX_SAADC_LIMITH_DISABLED);
+		}
+	}
+
+	armed_limits = 0;
+}
+
+static void saadc_event_handler(nrfx_saadc_evt_t const *p_event)
+{
+	struct adc_stream_header *hdr;
+	enum adc_channel_slot slot;
+	struct stream_req req;
+
+	switch (p_event->type) {
+	case NRFX_SAADC_EVT_READY:
+		/* First buffer is armed, let the timer drive conversions. */
+		nrfx_timer_enable(&sample_timer);
+		break;
+
+	case NRFX_SAADC_EVT_BUF_REQ:
+		/* The SAADC only writes into this buffer once the current one
+		 * is full, the pipeline has that long to queue another read.
+		 */
+		nrfx_saadc_buffer_set(buffer_next(), STREAM_BUF_SAMPLES);
+		break;
+
+	case NRFX_SAADC_EVT_LIMIT:
+		slot = slot_by_channel(p_event->data.limit.channel);
+		if (watched_limits & BIT(slot)) {
+			nrfx_saadc_limits_set(p_event->data.limit.channel,
+					      NRFX_SAADC_LIMITL_DISABLED,
+					      NRFX_SAADC_LIMITH_DISABLED);
+			watched_limits &= ~BIT(slot);
+			if (watch_handler) {
+				watch_handler(slot);
+			}
+			break;
+		}
+
+		limits_disarm();
+		if (atomic_cas(&idle, 1, 0) && wake_handler) {
+			wake_handler(slot);
+		}
+		break;
+
+	case NRFX_SAADC_EVT_DONE:
+		if (!ring_pop(&in_dma, &req)) {
+			break;
+		}
+
+		if (req.iodev_sqe == NULL) {
+			/* No read was queued, the block went to scratch. */
+			if (!atomic_get(&idle)) {
+				overrun_count++;
+			}
+			block_seq++;
+			break;
+		}
+
+		if (atomic_get(&idle)) {
+			/* Keep the read and its buffer for a later block. */
+			ring_push(&pending, &req);
+			block_seq++;
+			break;
+		}
+
+		hdr = (struct adc_stream_header *)req.buf;
+		hdr->seq = block_seq++;
+#if defined(CONFIG_APP_TIMEBASE_CAPTURE)
+		hdr->timestamp_us = end_captured ? timebase_capture_us(end_capture) :
+						   timebase_now_us();
+#else
+		hdr->timestamp_us = timebase_now_us();
+#endif
+		rtio_iodev_sqe_ok(req.iodev_sqe, 0);
+		break;
+
+	default:
+		break;
+	}
+}
+
+static void timer_event_handler(nrf_timer_event_t event_type, void *p_context)
+{
+	/* Compare events are routed over PPI only, no interrupt is enabled. */
+	ARG_UNUSED(event_type);
+	ARG_UNUSED(p_context);
+}
+
+static int sample_timer_setup(void)
+{
+	nrfx_timer_config_t timer_config = NRFX_TIMER_DEFAULT_CONFIG(1000000);
+	uint32_t ticks;
+	nrfx_err_t err;
+
+	timer_config.bit_width = NRF_TIMER_BIT_WIDTH_32;
+
+	err = nrfx_timer_init(&sample_timer, &timer_config, timer_event_handler);
+	if (err != NRFX_SUCCESS) {
+		printk("Sample timer init failed (err 0x%08x)\n", err);
+		return -EIO;
+	}
+
+	ticks = nrfx_timer_us_to_ticks(&sample_timer,
+				       USEC_PER_SEC / CONFIG_APP_ADC_STREAM_SAMPLE_RATE_HZ);
+	nrfx_timer_extended_compare(&sample_timer, NRF_TIMER_CC_CHANNEL0, ticks,
+				    NRF_TIMER_SHORT_COMPARE0_CLEAR_MASK, false);
+
+	err = nrfx_gppi_channel_alloc(&ppi_channel);
+	if (err != NRFX_SUCCESS) {
+		printk("No free PPI channel for the sample timer (err 0x%08x)\n", err);
+		return -EIO;
+	}
+	ppi_allocated = true;
+
+	nrfx_gppi_channel_endpoints_setup(
+		ppi_channel,
+		nrfx_timer_compare_event_address_get(&sample_timer, NRF_TIMER_CC_CHANNEL0),
+		nrf_saadc_task_address_get(NRF_SAADC, NRF_SAADC_TASK_SAMPLE));
+	nrfx_gppi_channels_enable(BIT(ppi_channel));
+
+#if defined(CONFIG_APP_TIMEBASE_CAPTURE)
+	/* Without a capture the interrupt handler latches the time. */
+	end_captured = !timebase_capture_attach(
+		nrf_saadc_event_address_get(NRF_SAADC, NRF_SAADC_EVENT_END), &end_capture);
+#endif
+
+	return 0;
+}
+
+static int saadc_gain(enum adc_gain gain, nrf_saadc_gain_t *out)
+{
+	switch (gain) {
+	case ADC_GAIN_1_6:
+		*out = NRF_SAADC_GAIN1_6;
+		break;
+	case ADC_GAIN_1_5:
+		*out = NRF_SAADC_GAIN1_5;
+		break;
+	case ADC_GAIN_1_4:
+		*out = NRF_SAADC_GAIN1_4;
+		break;
+	case ADC_GAIN_1_3:
+		*out = NRF_SAADC_GAIN1_3;
+		break;
+	case ADC_GAIN_1_2:
+		*out = NRF_SAADC_GAIN1_2;
+		break;
+	case ADC_GAIN_1:
+		*out = NRF_SAADC_GAIN1;
+		break;
+	case ADC_GAIN_2:
+		*out = NRF_SAADC_GAIN2;
+		break;
+	case ADC_GAIN_4:
+		*out = NRF_SAADC_GAIN4;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int saadc_acq_time(uint16_t acquisition_time, nrf_saadc_acqtime_t *out)
+{
+	if (acquisition_time == ADC_ACQ_TIME_DEFAULT) {
+		*out = NRF_SAADC_ACQTIME_10US;
+		return 0;
+	}
+
+	if (ADC_ACQ_TIME_UNIT(acquisition_time) != ADC_ACQ_TIME_MICROSECONDS) {
+		return -EINVAL;
+	}
+
+	switch (ADC_ACQ_TIME_VALUE(acquisition_time)) {
+	case 3:
+		*out = NRF_SAADC_ACQTIME_3US;
+		break;
+	case 5:
+		*out = NRF_SAADC_ACQTIME_5US;
+		break;
+	case 10:
+		*out = NRF_SAADC_ACQTIME_10US;
+		break;
+	case 15:
+		*out = NRF_SAADC_ACQTIME_15US;
+		break;
+	case 20:
+		*out = NRF_SAADC_ACQTIME_20US;
+		break;
+	case 40:
+		*out = NRF_SAADC_ACQTIME_40US;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static nrf_saadc_resolution_t saadc_resolution(void)
+{
+	switch (ADC_CHANNELS_RESOLUTION) {
+	case 8:
+		return NRF_SAADC_RESOLUTION_8BIT;
+	case 10:
+		return NRF_SAADC_RESOLUTION_10BIT;
+	case 14:
+		return NRF_SAADC_RESOLUTION_14BIT;
+	default:
+		return NRF_SAADC_RESOLUTION_12BIT;
+	}
+}
+
+/* Translate the devicetree channel table into nrfx channel configs. */
+static int saadc_channels_build(void)
+{
+	for (size_t i = 0; i < ADC_CHANNELS_COUNT; i++) {
+		const struct adc_channel_desc *desc = &adc_channels[i];
+		nrfx_saadc_channel_t *ch = &stream_channels[i];
+		int err;
+
+		*ch = (nrfx_saadc_channel_t)NRFX_SAADC_DEFAULT_CHANNEL_SE(
+			(nrf_saadc_input_t)desc->input_positive, desc->channel_id);
+
+		if (desc->input_negative) {
+			ch->pin_n = (nrf_saadc_input_t)desc->input_negative;
+			ch->channel_config.mode = NRF_SAADC_MODE_DIFFERENTIAL;
+		}
+
+		if (desc->reference == ADC_REF_VDD_1_4) {
+			ch->channel_config.reference = NRF_SAADC_REFERENCE_VDD4;
+		} else if (desc->reference != ADC_REF_INTERNAL) {
+			printk("Channel %s: unsupported reference\n", desc->name);
+			return -EINVAL;
+		}
+
+		err = saadc_gain(desc->gain, &ch->channel_config.gain);
+		if (!err) {
+			err = saadc_acq_time(desc->acquisition_time,
+					     &ch->channel_config.acq_time);
+		}
+		if (err) {
+			printk("Channel %s: unsupported gain or acquisition time\n", desc->name);
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+static int saadc_setup(void)
+{
+	nrfx_saadc_adv_config_t adv_config = NRFX_SAADC_DEFAULT_ADV_CONFIG;
+	nrfx_err_t err;
+
+	if (saadc_channels_build()) {
+		return -EINVAL;
+	}
+
+	err = nrfx_saadc_init(DT_IRQ(SAADC_NODE, priority));
+	if (err != NRFX_SUCCESS) {
+		printk("SAADC init failed (err 0x%08x)\n", err);
+		return -EIO;
+	}
+
+	/* Blocking offset calibration, the residual gain and offset errors
+	 * are covered by the factory trim in adc_conv.c.
+	 */
+	err = nrfx_saadc_offset_calibrate(NULL);
+	if (err != NRFX_SUCCESS) {
+		printk("SAADC offset calibration failed (err 0x%08x)\n", err);
+		return -EIO;
+	}
+
+	err = nrfx_saadc_channels_config(stream_channels, ARRAY_SIZE(stream_channels));
+	if (err != NRFX_SUCCESS) {
+		printk("SAADC channel config failed (err 0x%08x)\n", err);
+		return -EIO;
+	}
+
+	/* Conversions are triggered externally, restart DMA on END so no
+	 * sample is lost between buffers.
+	 */
+	/* With more than one channel, oversampling needs burst mode so every
+	 * channel is averaged within one SAMPLE task.
+	 */
+	adv_config.oversampling = (nrf_saadc_oversample_t)ADC_CHANNELS_OVERSAMPLING;
+	adv_config.burst = ADC_CHANNELS_OVERSAMPLING ? NRF_SAADC_BURST_ENABLED :
+						       NRF_SAADC_BURST_DISABLED;
+	adv_config.internal_timer_cc = 0;
+	adv_config.start_on_end = true;
+
+	err = nrfx_saadc_advanced_mode_set(adc_channels_mask(), saadc_resolution(), &adv_config,
+					   saadc_event_handler);
+	if (err != NRFX_SUCCESS) {
+		printk("SAADC advanced mode failed (err 0x%08x)\n", err);
+		return -EIO;
+	}
+
+	err = nrfx_saadc_buffer_set(buffer_next(), STREAM_BUF_SAMPLES);
+	if (err != NRFX_SUCCESS) {
+		printk("SAADC buffer set failed (err 0x%08x)\n", err);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+int adc_stream_start(void)
+{
+	int err;
+
+	if (!atomic_cas(&running, 0, 1)) {
+		return -EALREADY;
+	}
+
+	timebase_sync_init(&frame_sync, CONFIG_APP_ADC_STREAM_SAMPLE_RATE_HZ, 32);
+
+	err = saadc_setup();
+	if (!err) {
+		err = sample_timer_setup();
+	}
+
+	if (!err && nrfx_saadc_mode_trigger() != NRFX_SUCCESS) {
+		err = -EIO;
+	}
+
+	if (err) {
+		adc_stream_stop();
+	}
+
+	return err;
+}
+
+int adc_stream_stop(void)
+{
+	if (!atomic_get(&running)) {
+		return 0;
+	}
+
+	if (ppi_allocated) {
+		nrfx_gppi_channels_disable(BIT(ppi_channel));
+		nrfx_gppi_channel_free(ppi_channel);
+		ppi_allocated = false;
+	}
+
+#if defined(CONFIG_APP_TIMEBASE_CAPTURE)
+	if (end_captured) {
+		timebase_capture_detach(end_capture);
+		end_captured = false;
+	}
+#endif
+
+	if (nrfx_timer_init_check(&sample_timer)) {
+		nrfx_timer_disable(&sample_timer);
+		nrfx_timer_uninit(&sample_timer);
+	}
+
+	nrfx_saadc_abort();
+	nrfx_saadc_uninit();
+
+	unsigned int key = irq_lock();
+
+	ring_cancel(&in_dma);
+	ring_cancel(&pending);
+	irq_unlock(key);
+
+	armed_limits = 0;
+	watched_limits = 0;
+	atomic_set(&idle, 0);
+	atomic_set(&running, 0);
+
+	return 0;
+}
+
+int adc_stream_limit_set(enum adc_channel_slot slot, int16_t low, int16_t high)
+{
+	nrfx_err_t err;
+	unsigned int key;
+
+	if (!atomic_get(&running)) {
+		return -EAGAIN;
+	}
+
+	key = irq_lock();
+	err = nrfx_saadc_limits_set(adc_channels[slot].channel_id, low, high);
+	if (err == NRFX_SUCCESS) {
+		armed_limits |= BIT(slot);
+	}
+	irq_unlock(key);
+
+	return (err == NRFX_SUCCESS) ? 0 : -EIO;
+}
+
+int adc_stream_watch_low(enum adc_channel_slot slot, int16_t low, adc_stream_wake_t on_low)
+{
+	nrfx_err_t err;
+	unsigned int key;
+
+	if (!atomic_get(&running)) {
+		return -EAGAIN;
+	}
+
+	key = irq_lock();
+	watch_handler = on_low;
+	err = nrfx_saadc_limits_set(adc_channels[slot].channel_id, low,
+				    NRFX_SAADC_LIMITH_DISABLED);
+	if (err == NRFX_SUCCESS) {
+		watched_limits |= BIT(slot);
+	}
+	irq_unlock(key);
+
+	return (err == NRFX_SUCCESS) ? 0 : -EIO;
+}
+
+int adc_stream_idle(adc_stream_wake_t on_wake)
+{
+	unsigned int key = irq_lock();
+	int err = 0;
+
+	/* A limit that already fired has disarmed itself. */
+	if (armed_limits) {
+		wake_handler = on_wake;
+		atomic_set(&idle, 1);
+	} else {
+		err = -EINVAL;
+	}
+
+	irq_unlock(key);
+
+	return err;
+}
+
+void adc_stream_stats_get(struct adc_stream_stats *stats)
+{
+	unsigned int key = irq_lock();
+
+	stats->blocks = block_seq;
+	stats->overruns = overrun_count;
+
+	irq_unlock(key);
+}
+
+int adc_stream_decode(const uint8_t *buf, size_t len, struct adc_stream_block *block)
+{
+	const struct adc_stream_header *hdr = (const struct adc_stream_header *)buf;
+
+	if (len < STREAM_BUF_SIZE) {
+		return -EINVAL;
+	}
+
+	block->samples = (const int16_t *)&buf[STREAM_HDR_SIZE];
+	block->count = STREAM_BUF_SAMPLES;
+	block->channels = ADC_CHANNELS_COUNT;
+	block->seq = hdr->seq;
+
+	/* The completion is latched right after the last frame of the
+	 * block, its frame index follows from the block counter.
+	 */
+	uint32_t first = hdr->seq * CONFIG_APP_ADC_STREAM_BLOCK_SAMPLES;
+
+	timebase_sync_update(&frame_sync, first + CONFIG_APP_ADC_STREAM_BLOCK_SAMPLES - 1,
+			     hdr->timestamp_us);
+	block->timestamp_us = timebase_sync_us(&frame_sync, first);
+	block->frame_period_ns = timebase_sync_period_ns(&frame_sync);
+
+	return 0;
+}
+
+static void adc_stream_submit(struct rtio_iodev_sqe *iodev_sqe)
+{
+	struct stream_req req = {
+		.iodev_sqe = iodev_sqe,
+	};
+	unsigned int key = irq_lock();
+	bool queued = ring_push(&pending, &req);
+
+	irq_unlock(key);
+
+	if (!queued) {
+		rtio_iodev_sqe_err(iodev_sqe, -ENOMEM);
+	}
+}
+
+static const struct rtio_iodev_api adc_stream_iodev_api = {
+	.submit = adc_stream_submit,
+};
+
+RTIO_IODEV_DEFINE(adc_stream_iodev, &adc_stream_iodev_api, NULL);
+
+static int adc_stream_irq_init(void)
+{
+	IRQ_CONNECT(DT_IRQN(SAADC_NODE), DT_IRQ(SAADC_NODE, priority),
+		    nrfx_isr, nrfx_saadc_irq_handler, 0);
+
+	return 0;
+}
+
+SYS_INIT(adc_stream_irq_init, APPLICATION, CONFIG_APPLICATION_INIT_PRIORITY);
@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#ifndef ADC_STREAM_H_
+#define ADC_STREAM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <zephyr/rtio/rtio.h>
+
+#include "adc_channels.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * One full DMA buffer handed over by the streaming engine.
+ *
+ * Each timer tick scans every channel of adc_channels.h, so the samples are
+ * interleaved in frames of @ref channels results that share one conversion
+ * cycle.
+ */
+struct adc_stream_block {
+	/** Raw SAADC results, interleaved per frame. */
+	const int16_t *samples;
+	/** Number of results in @ref samples. */
+	size_t count;
+	/** Results per frame, sample i belongs to slot i % channels. */
+	uint8_t channels;
+	/** Running block counter, gaps indicate dropped blocks. */
+	uint32_t seq;
+	/** Common time of the first frame, see timebase.h. */
+	int64_t timestamp_us;
+	/** Time between two frames, as measured against the timebase. */
+	uint32_t frame_period_ns;
+};
+
+struct adc_stream_stats {
+	/** Blocks completed by the SAADC. */
+	uint32_t blocks;
+	/** Blocks dropped because no read was queued. */
+	uint32_t overruns;
+};
+
+/**
+ * RTIO device completing one block per read.
+ *
+ * Queue reads with a pool buffer (rtio_sqe_prep_read_with_pool()), the
+ * SAADC converts straight into the buffer of the oldest read and completes
+ * it when the block is full. Decode the buffer with adc_stream_decode().
+ */
+extern struct rtio_iodev adc_stream_iodev;
+
+/**
+ * @brief Wake-up notification, called from the SAADC interrupt.
+ *
+ * @param slot Channel whose limit was crossed.
+ */
+typedef void (*adc_stream_wake_t)(enum adc_channel_slot slot);
+
+/**
+ * @brief Start continuous, timer-triggered acquisition.
+ *
+ * Queue reads on @ref adc_stream_iodev first, blocks arriving while no
+ * read is queued are dropped.
+ *
+ * @retval 0 on success.
+ * @retval -EALREADY if the stream is already running.
+ * @retval -EIO if a peripheral could not be configured.
+ */
+int adc_stream_start(void);
+
+/**
+ * @brief Stop acquisition and release the SAADC.
+ *
+ * Queued reads complete with -ECANCELED.
+ */
+int adc_stream_stop(void);
+
+/**
+ * @brief Get the block stored in a completed read buffer.
+ *
+ * Also refines the mapping of frames onto the common timebase, so the
+ * buffers must be decoded in the order they completed.
+ *
+ * @retval 0 on success.
+ * @retval -EINVAL if the buffer is too short.
+ */
+int adc_stream_decode(const uint8_t *buf, size_t len, struct adc_stream_block *block);
+
+/**
+ * @brief Arm the SAADC limit comparator of one channel.
+ *
+ * The hardware compares every conversion against the limits. Limits are
+ * disarmed again when the first one fires.
+ *
+ * @param slot Channel to watch.
+ * @param low  Raw code below which the limit fires.
+ * @param high Raw code above which the limit fires.
+ */
+int adc_stream_limit_set(enum adc_channel_slot slot, int16_t low, int16_t high);
+
+/**
+ * @brief Watch one channel for a drop below a level.
+ *
+ * Unlike adc_stream_limit_set(), the watch is not disarmed by other limit
+ * events and keeps working in idle mode. It fires once, call again to
+ * re-arm. A channel is either watched or used with adc_stream_limit_set().
+ *
+ * @param slot   Channel to watch.
+ * @param low    Raw code below which @p on_low is called.
+ * @param on_low Called from the SAADC interrupt.
+ */
+int adc_stream_watch_low(enum adc_channel_slot slot, int16_t low, adc_stream_wake_t on_low);
+
+/**
+ * @brief Stop delivering blocks until an armed limit fires.
+ *
+ * Sampling continues, but full buffers are recycled in the interrupt
+ * handler without completing a read. The first limit event
+ * resumes delivery and calls @p on_wake.
+ *
+ * @retval 0 on success.
+ * @retval -EINVAL if no limit is armed.
+ */
+int adc_stream_idle(adc_stream_wake_t on_wake);
+
+/**
+ * @brief Get the streaming counters.
+ */
+void adc_stream_stats_get(struct adc_stream_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ADC_STREAM_H_ */
@@ -0,0 +1,316 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/bluetooth/conn.h>
+#include <zephyr/bluetooth/l2cap.h>
+#include <zephyr/net/buf.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/byteorder.h>
+
+#include "bulk_channel.h"
+#include "link_manager.h"
+
+#define SDU_SIZE CONFIG_APP_BULK_CHANNEL_SDU_SIZE
+#define FLUSH_MS CONFIG_APP_BULK_CHANNEL_FLUSH_MS
+
+#define HEADER_SIZE (sizeof(struct bulk_channel_record))
+
+/* Every buffer is one SDU, so up to this many SDUs are in flight. L2CAP
+ * segments them into PDUs of the peer MPS, taken from the ACL TX buffers.
+ */
+NET_BUF_POOL_FIXED_DEFINE(sdu_pool, CONFIG_APP_BULK_CHANNEL_SDUS, BT_L2CAP_SDU_BUF_SIZE(SDU_SIZE),
+			  CONFIG_BT_CONN_TX_USER_DATA_SIZE, NULL);
+
+static struct bt_l2cap_le_chan bulk_chan;
+static atomic_t chan_open;
+static atomic_t in_flight;
+
+/* Writer side, the sensor pipeline writes the samples and the main thread
+ * the gait records.
+ */
+static K_MUTEX_DEFINE(writer_lock);
+static struct net_buf *sdu;
+static int64_t sdu_started;
+static uint16_t sdu_size;
+static struct bulk_channel_record *claimed;
+
+static struct {
+	atomic_t sdus;
+	atomic_t sent;
+	atomic_t dropped_bytes;
+	atomic_t bytes;
+	uint8_t max_in_flight;
+} stats;
+
+static uint32_t rate_bytes;
+static int64_t rate_start;
+
+static void sdu_send(void)
+{
+	struct net_buf *buf = sdu;
+	size_t len = buf->len;
+	int err;
+
+	sdu = NULL;
+
+	atomic_inc(&in_flight);
+	err = bt_l2cap_chan_send(&bulk_chan.chan, buf);
+	if (err < 0) {
+		atomic_dec(&in_flight);
+		atomic_add(&stats.dropped_bytes, len);
+		net_buf_unref(buf);
+		return;
+	}
+
+	link_manager_tx(len + LINK_MANAGER_L2CAP_SDU_HDR);
+
+	atomic_inc(&stats.sdus);
+	atomic_add(&stats.bytes, len);
+	stats.max_in_flight = MAX(stats.max_in_flight, atomic_get(&in_flight));
+}
+
+static struct net_buf *sdu_get(void)
+{
+	if (sdu == NULL) {
+		sdu = net_buf_alloc(&sdu_pool, K_NO_WAIT);
+		if (sdu == NULL) {
+			return NULL;
+		}
+		net_buf_reserve(sdu, BT_L2CAP_SDU_CHAN_SEND_RESERVE);
+		sdu_started = k_uptime_get();
+	}
+
+	return sdu;
+}
+
+static void sdu_flush_check(void)
+{
+	if (sdu && (sdu_size - sdu->len <= HEADER_SIZE ||
+		    k_uptime_get() - sdu_started >= FLUSH_MS)) {
+		sdu_send();
+	}
+}
+
+static bool writer_open(void)
+{
+	if (!atomic_get(&chan_open)) {
+		if (sdu) {
+			net_buf_unref(sdu);
+			sdu = NULL;
+		}
+		return false;
+	}
+
+	return true;
+}
+
+int bulk_channel_write(uint8_t type, int64_t timestamp_us, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	int err = 0;
+
+	k_mutex_lock(&writer_lock, K_FOREVER);
+
+	if (!writer_open()) {
+		err = -ENOTCONN;
+		goto out;
+	}
+
+	do {
+		struct net_buf *buf = sdu_get();
+		size_t room;
+		size_t part;
+
+		if (buf == NULL) {
+			atomic_add(&stats.dropped_bytes, len);
+			err = -ENOBUFS;
+			goto out;
+		}
+
+		/* Leave no room smaller than a header behind */
+		if (sdu_size - buf->len <= HEADER_SIZE) {
+			sdu_send();
+			continue;
+		}
+
+		room = sdu_size - buf->len - HEADER_SIZE;
+		part = MIN(len, room);
+
+		net_buf_add_u8(buf, type);
+		net_buf_add_u8(buf, part < len ? BULK_CHANNEL_MORE : 0);
+		net_buf_add_le16(buf, part);
+		net_buf_add_le32(buf, (uint32_t)timestamp_us);
+		net_buf_add_mem(buf, p, part);
+
+		p += part;
+		len -= part;
+
+		if (len) {
+			sdu_send();
+		}
+	} while (len);
+
+	sdu_flush_check();
+
+out:
+	k_mutex_unlock(&writer_lock);
+
+	return err;
+}
+
+void *bulk_channel_claim(uint8_t type, int64_t timestamp_us, size_t size)
+{
+	struct net_buf *buf;
+
+	k_mutex_lock(&writer_lock, K_FOREVER);
+
+	if (!writer_open() || HEADER_SIZE + size > sdu_size) {
+		goto fail;
+	}
+
+	buf = sdu_get();
+	if (buf && sdu_size - buf->len < HEADER_SIZE + size) {
+		sdu_send();
+		buf = sdu_get();
+	}
+
+	if (buf == NULL) {
+		atomic_add(&stats.dropped_bytes, size);
+		goto fail;
+	}
+
+	claimed = net_buf_add(buf, HEADER_SIZE);
+	claimed->type = type;
+	claimed->flags = 0;
+	claimed->len = 0;
+	claimed->timestamp_us = sys_cpu_to_le32((uint32_t)timestamp_us);
+
+	/* Held until bulk_channel_commit() */
+	return net_buf_tail(buf);
+
+fail:
+	k_mutex_unlock(&writer_lock);
+
+	return NULL;
+}
+
+void bulk_channel_commit(size_t len)
+{
+	if (len) {
+		claimed->len = sys_cpu_to_le16(len);
+		net_buf_add(sdu, len);
+	} else {
+		net_buf_remove_mem(sdu, HEADER_SIZE);
+	}
+	claimed = NULL;
+
+	sdu_flush_check();
+
+	k_mutex_unlock(&writer_lock);
+}
+
+static void chan_connected(struct bt_l2cap_chan *chan)
+{
+	struct bt_l2cap_le_chan *le_chan = BT_L2CAP_LE_CHAN(chan);
+
+	sdu_size = MIN(le_chan->tx.mtu, SDU_SIZE);
+	atomic_set(&in_flight, 0);
+	atomic_set(&chan_open, true);
+
+	printk("Bulk channel open, MTU %u MPS %u\n", le_chan->tx.mtu, le_chan->tx.mps);
+
+	/* Records keep coming for as long as the channel is open */
+	link_manager_busy(LINK_MANAGER_BULK_CHANNEL, true);
+}
+
+static void chan_disconnected(struct bt_l2cap_chan *chan)
+{
+	ARG_UNUSED(chan);
+
+	atomic_set(&chan_open, false);
+	link_manager_busy(LINK_MANAGER_BULK_CHANNEL, false);
+	printk("Bulk channel closed\n");
+}
+
+static void chan_sent(struct bt_l2cap_chan *chan)
+{
+	ARG_UNUSED(chan);
+
+	atomic_dec(&in_flight);
+	atomic_inc(&stats.sent);
+}
+
+/* Nothing is expected from the central */
+static int chan_recv(struct bt_l2cap_chan *chan, struct net_buf *buf)
+{
+	ARG_UNUSED(chan);
+	ARG_UNUSED(buf);
+
+	return 0;
+}
+
+static const struct bt_l2cap_chan_ops chan_ops = {
+	.connected = chan_connected,
+	.disconnected = chan_disconnected,
+	.sent = chan_sent,
+	.recv = chan_recv,
+};
+
+static int accept(struct bt_conn *conn, struct bt_l2cap_server *server,
+		  struct bt_l2cap_chan **chan)
+{
+	ARG_UNUSED(conn);
+	ARG_UNUSED(server);
+
+	if (bulk_chan.chan.conn) {
+		return -ENOMEM;
+	}
+
+	memset(&bulk_chan, 0, sizeof(bulk_chan));
+	bulk_chan.chan.ops = &chan_ops;
+	bulk_chan.rx.mtu = BT_L2CAP_RX_MTU;
+	*chan = &bulk_chan.chan;
+
+	return 0;
+}
+
+static struct bt_l2cap_server server = {
+	.psm = CONFIG_APP_BULK_CHANNEL_PSM,
+	.sec_level = BT_SECURITY_L2,
+	.accept = accept,
+};
+
+int bulk_channel_init(void)
+{
+	rate_start = k_uptime_get();
+
+	return bt_l2cap_server_register(&server);
+}
+
+bool bulk_channel_is_open(void)
+{
+	return atomic_get(&chan_open);
+}
+
+void bulk_channel_stats_get(struct bulk_channel_stats *out)
+{
+	int64_t now = k_uptime_get();
+	uint32_t bytes = atomic_get(&stats.bytes);
+
+	out->sdus = atomic_get(&stats.sdus);
+	out->sent = atomic_get(&stats.sent);
+	out->dropped_bytes = atomic_get(&stats.dropped_bytes);
+	out->max_in_flight = stats.max_in_flight;
+	out->bps = now > rate_start ?
+			   (uint64_t)(bytes - rate_bytes) * MSEC_PER_SEC / (now - rate_start) : 0;
+
+	rate_bytes = bytes;
+	rate_start = now;
+}
@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#ifndef BULK_CHANNEL_H_
+#define BULK_CHANNEL_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <zephyr/sys/util.h>
+#include <zephyr/toolchain.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Record types. */
+enum bulk_channel_type {
+	/** Raw SAADC results, interleaved per frame as in adc_stream_block. */
+	BULK_CHANNEL_ADC = 1,
+	/** IMU frames of six int16, accelerometer then gyroscope in raw counts. */
+	BULK_CHANNEL_IMU = 2,
+	/** One CBOR message of src/common/gait.cddl. */
+	BULK_CHANNEL_GAIT_RECORD = 3,
+};
+
+/** The record continues in the next SDU. */
+#define BULK_CHANNEL_MORE BIT(0)
+
+/**
+ * Header of every record in an SDU, little endian.
+ *
+ * An SDU holds records back to back. A record that does not fit into the
+ * rest of an SDU is split, every part but the last has BULK_CHANNEL_MORE
+ * set and the parts carry the same timestamp.
+ */
+struct bulk_channel_record {
+	uint8_t type;
+	uint8_t flags;
+	/** Bytes following the header. */
+	uint16_t len;
+	/** Common time of the first sample, lower 32 bits. */
+	uint32_t timestamp_us;
+} __packed;
+
+struct bulk_channel_stats {
+	/** SDUs handed to L2CAP. */
+	uint32_t sdus;
+	/** SDUs acknowledged as sent by L2CAP. */
+	uint32_t sent;
+	/** Record bytes dropped because every SDU buffer was in flight. */
+	uint32_t dropped_bytes;
+	/** SDU bytes per second since the previous call. */
+	uint32_t bps;
+	/** Most SDUs in flight at once. */
+	uint8_t max_in_flight;
+};
+
+/**
+ * @brief Register the L2CAP server.
+ *
+ * A central opens the channel on CONFIG_APP_BULK_CHANNEL_PSM, the records
+ * written while it is open are sent over it.
+ */
+int bulk_channel_init(void);
+
+/**
+ * @brief Append a record to the channel.
+ *
+ * Full SDUs are sent right away, a partly filled SDU once it is older than
+ * CONFIG_APP_BULK_CHANNEL_FLUSH_MS.
+ *
+ * @param type         Record type.
+ * @param timestamp_us Common time of the first sample.
+ * @param data         Record content.
+ * @param len          Bytes in @p data.
+ *
+ * @retval 0 on success.
+ * @retval -ENOTCONN if the channel is not open.
+ * @retval -ENOBUFS if all SDU buffers are in flight, the rest of the
+ *                  record was dropped.
+ */
+int bulk_channel_write(uint8_t type, int64_t timestamp_us, const void *data, size_t len);
+
+/**
+ * @brief Reserve room for a record, to be written in place.
+ *
+ * The record is not split, it goes into the current SDU or the next one.
+ * The returned pointer is inside the SDU buffer that is handed to L2CAP,
+ * so the record is never copied. Every successful claim must be followed
+ * by bulk_channel_commit() from the same thread, other writers wait until
+ * then.
+ *
+ * @param type         Record type.
+ * @param timestamp_us Common time of the first sample.
+ * @param size         Largest record that will be written.
+ *
+ * @return Where to write the record, or NULL if the channel is not open,
+ *         all SDU buffers are in flight or @p size exceeds an SDU.
+ */
+void *bulk_channel_claim(uint8_t type, int64_t timestamp_us, size_t size);
+
+/**
+ * @brief Complete the record of bulk_channel_claim().
+ *
+ * @param len Bytes written, 0 discards the record.
+ */
+void bulk_channel_commit(size_t len);
+
+/**
+ * @brief Check whether a central has the channel open.
+ */
+bool bulk_channel_is_open(void);
+
+/**
+ * @brief Get the transfer counters.
+ */
+void bulk_channel_stats_get(struct bulk_channel_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BULK_CHANNEL_H_ */
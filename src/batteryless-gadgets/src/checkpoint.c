@@ -0,0 +1,381 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/devicetree.h>
+#include <zephyr/linker/devicetree_regions.h>
+#include <zephyr/linker/section_tags.h>
+#if defined(CONFIG_SETTINGS)
+#include <zephyr/settings/settings.h>
+#endif
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/crc.h>
+
+#include "adc_channels.h"
+#include "adc_conv.h"
+#if defined(CONFIG_APP_ADC_STREAM)
+#include "adc_stream.h"
+#endif
+#include "checkpoint.h"
+
+#if defined(CONFIG_SOC_SERIES_NRF52X)
+#include <hal/nrf_power.h>
+#endif
+
+#define IMAGE_MAGIC 0x43504b54
+#define LIVE_MAGIC  0x4c495645
+
+#define PERSIST_KEY     "ckpt"
+#define PERSIST_KEY_LEN sizeof(PERSIST_KEY "/ffff")
+
+#define CHECKPOINT_RAM_NODE DT_NODELABEL(checkpoint_ram)
+
+struct checkpoint_header {
+	uint32_t crc;
+	uint32_t magic;
+	uint32_t seq;
+	uint32_t progress;
+	uint16_t used;
+	uint16_t count;
+};
+
+struct checkpoint_record {
+	uint16_t id;
+	uint16_t size;
+};
+
+struct checkpoint_image {
+	struct checkpoint_header hdr;
+	uint8_t data[CONFIG_APP_CHECKPOINT_SIZE];
+};
+
+BUILD_ASSERT(offsetof(struct checkpoint_image, data) == sizeof(struct checkpoint_header),
+	     "CRC covers the header and the data as one range");
+
+/* Not cleared at boot, the RAM keeps its content through a reset as long
+ * as the supply stays above the retention voltage. A power-on or brown-out
+ * reset loses it, sections that must survive those are also persisted.
+ */
+#if DT_NODE_EXISTS(CHECKPOINT_RAM_NODE)
+#define CHECKPOINT_RAM Z_GENERIC_SECTION(LINKER_DT_NODE_REGION_NAME(CHECKPOINT_RAM_NODE))
+#else
+#define CHECKPOINT_RAM __noinit
+#endif
+
+static CHECKPOINT_RAM struct checkpoint_image image;
+static CHECKPOINT_RAM struct {
+	uint32_t magic;
+	uint32_t progress;
+	uint32_t base;
+} live;
+
+#if DT_NODE_EXISTS(CHECKPOINT_RAM_NODE)
+BUILD_ASSERT(sizeof(image) + sizeof(live) <= DT_REG_SIZE(CHECKPOINT_RAM_NODE),
+	     "APP_CHECKPOINT_SIZE does not fit in the checkpoint RAM region");
+#endif
+
+static sys_slist_t sections = SYS_SLIST_STATIC_INIT(&sections);
+static bool checked;
+static bool image_valid;
+static atomic_t armed;
+static struct checkpoint_stats stats;
+
+#if defined(CONFIG_SOC_SERIES_NRF52X)
+/* Keep the RAM sections of the snapshot powered in System OFF too. RAM0 to
+ * RAM7 have two 4 kB sections each, RAM8 has 32 kB sections.
+ */
+static void retention_enable(uintptr_t start, size_t size)
+{
+	for (uintptr_t addr = ROUND_DOWN(start, 0x1000); addr < start + size; addr += 0x1000) {
+		uint32_t offset = addr - 0x20000000;
+		uint8_t block;
+		uint8_t section;
+
+		if (offset < 0x10000) {
+			block = offset / 0x2000;
+			section = (offset / 0x1000) % 2;
+		} else {
+			block = 8;
+			section = (offset - 0x10000) / 0x8000;
+		}
+
+		nrf_power_rampower_mask_on(NRF_POWER, block,
+					   (POWER_RAM_POWER_S0POWER_Msk |
+					    POWER_RAM_POWER_S0RETENTION_Msk)
+						   << section);
+	}
+}
+#endif
+
+static uint32_t image_crc(void)
+{
+	return crc32_ieee((const uint8_t *)&image.hdr.magic,
+			  sizeof(image.hdr) - sizeof(image.hdr.crc) + image.hdr.used);
+}
+
+static void image_check(void)
+{
+	if (checked) {
+		return;
+	}
+	checked = true;
+
+#if defined(CONFIG_SOC_SERIES_NRF52X)
+	retention_enable((uintptr_t)&image, sizeof(image));
+	retention_enable((uintptr_t)&live, sizeof(live));
+#endif
+
+	image_valid = image.hdr.magic == IMAGE_MAGIC && image.hdr.used <= sizeof(image.data) &&
+		      image.hdr.crc == image_crc();
+
+	if (live.magic != LIVE_MAGIC) {
+		live.magic = LIVE_MAGIC;
+		live.progress = 0;
+		live.base = 0;
+	}
+}
+
+#if defined(CONFIG_SETTINGS)
+static void persist_key(const struct checkpoint_section *section, char *key)
+{
+	snprintf(key, PERSIST_KEY_LEN, PERSIST_KEY "/%04x", section->id);
+}
+
+struct persist_load_arg {
+	struct checkpoint_section *section;
+	bool found;
+};
+
+static int persist_set(const char *name, size_t len, settings_read_cb read_cb, void *cb_arg,
+		       void *param)
+{
+	struct persist_load_arg *arg = param;
+	ssize_t rc;
+
+	/* The section changed size since it was written. */
+	if (name || len != arg->section->size) {
+		return 0;
+	}
+
+	rc = read_cb(cb_arg, arg->section->data, arg->section->size);
+	if (rc < 0) {
+		return rc;
+	}
+
+	arg->found = true;
+
+	return 0;
+}
+
+static bool persist_load(struct checkpoint_section *section)
+{
+	struct persist_load_arg arg = {
+		.section = section,
+	};
+	char key[PERSIST_KEY_LEN];
+
+	if (!section->persist || settings_subsys_init()) {
+		return false;
+	}
+
+	persist_key(section, key);
+
+	return settings_load_subtree_direct(key, persist_set, &arg) == 0 && arg.found;
+}
+
+int checkpoint_persist(const struct checkpoint_section *section)
+{
+	char key[PERSIST_KEY_LEN];
+
+	persist_key(section, key);
+
+	return settings_save_one(key, section->data, section->size);
+}
+#else
+static bool persist_load(struct checkpoint_section *section)
+{
+	ARG_UNUSED(section);
+
+	return false;
+}
+
+int checkpoint_persist(const struct checkpoint_section *section)
+{
+	ARG_UNUSED(section);
+
+	return -ENOTSUP;
+}
+#endif
+
+bool checkpoint_register(struct checkpoint_section *section)
+{
+	unsigned int key;
+	size_t pos = 0;
+
+	image_check();
+
+	key = irq_lock();
+	sys_slist_append(&sections, &section->node);
+	irq_unlock(key);
+
+	if (!image_valid) {
+		return persist_load(section);
+	}
+
+	for (uint16_t i = 0; i < image.hdr.count; i++) {
+		struct checkpoint_record rec;
+
+		if (pos + sizeof(rec) > image.hdr.used) {
+			break;
+		}
+
+		memcpy(&rec, &image.data[pos], sizeof(rec));
+		pos += sizeof(rec);
+
+		if (rec.id == section->id && rec.size == section->size) {
+			memcpy(section->data, &image.data[pos], rec.size);
+			return true;
+		}
+
+		pos += ROUND_UP(rec.size, 4);
+	}
+
+	return persist_load(section);
+}
+
+void checkpoint_resumed(void)
+{
+	unsigned int key;
+
+	image_check();
+
+	key = irq_lock();
+
+	stats.restored = image_valid;
+	stats.recovery_ms = k_uptime_get_32();
+
+	if (image_valid) {
+		stats.lost = live.progress - image.hdr.progress;
+		live.progress = image.hdr.progress;
+	} else {
+		/* Nothing to resume from, everything since the last restore
+		 * point is gone.
+		 */
+		stats.lost = live.progress - live.base;
+	}
+	live.base = live.progress;
+
+	image.hdr.magic = 0;
+	image_valid = false;
+
+	irq_unlock(key);
+}
+
+int checkpoint_save(void)
+{
+	struct checkpoint_section *section;
+	unsigned int key = irq_lock();
+	size_t pos = 0;
+	uint16_t count = 0;
+	int err = 0;
+
+	SYS_SLIST_FOR_EACH_CONTAINER(&sections, section, node) {
+		struct checkpoint_record rec = {
+			.id = section->id,
+			.size = section->size,
+		};
+
+		if (pos + sizeof(rec) + ROUND_UP(rec.size, 4) > sizeof(image.data)) {
+			err = -ENOSPC;
+			continue;
+		}
+
+		memcpy(&image.data[pos], &rec, sizeof(rec));
+		pos += sizeof(rec);
+		memcpy(&image.data[pos], section->data, rec.size);
+		pos += ROUND_UP(rec.size, 4);
+		count++;
+	}
+
+	image.hdr.magic = IMAGE_MAGIC;
+	image.hdr.seq = ++stats.saves;
+	image.hdr.progress = live.progress;
+	image.hdr.used = pos;
+	image.hdr.count = count;
+	image.hdr.crc = image_crc();
+
+	irq_unlock(key);
+
+	return err;
+}
+
+void checkpoint_progress(uint32_t units)
+{
+	live.progress += units;
+}
+
+#if defined(CONFIG_APP_ADC_STREAM)
+static void vdd_low(enum adc_channel_slot slot)
+{
+	ARG_UNUSED(slot);
+
+	/* Called from the SAADC interrupt, the cell may only last for a
+	 * few milliseconds more.
+	 */
+	checkpoint_save();
+	atomic_set(&armed, 0);
+}
+#endif
+
+void checkpoint_vdd_report(int32_t vdd_mv)
+{
+	if (vdd_mv <= 0) {
+		return;
+	}
+
+	if (atomic_get(&armed)) {
+#if !defined(CONFIG_APP_ADC_STREAM)
+		/* Without the limit comparator, the measurement itself is
+		 * the trigger.
+		 */
+		if (vdd_mv < CONFIG_APP_CHECKPOINT_VDD_MV) {
+			checkpoint_save();
+			atomic_set(&armed, 0);
+		}
+#endif
+		return;
+	}
+
+	if (vdd_mv < CONFIG_APP_CHECKPOINT_VDD_MV + CONFIG_APP_CHECKPOINT_VDD_HYST_MV) {
+		return;
+	}
+
+	/* The supply recovered without a reset, the snapshot is stale. */
+	unsigned int key = irq_lock();
+
+	image.hdr.magic = 0;
+	irq_unlock(key);
+
+#if defined(CONFIG_APP_ADC_STREAM)
+	int err = adc_stream_watch_low(ADC_CHANNEL_VDD,
+				       adc_conv_from_mv(ADC_CHANNEL_VDD, CONFIG_APP_CHECKPOINT_VDD_MV),
+				       vdd_low);
+	if (err) {
+		printk("Failed to watch VDD (err %d)\n", err);
+		return;
+	}
+#endif
+
+	atomic_set(&armed, 1);
+}
+
+void checkpoint_stats_get(struct checkpoint_stats *out)
+{
+	*out = stats;
+}
@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <zephyr/sys/slist.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Owners of checkpoint sections. */
+enum checkpoint_owner {
+	CHECKPOINT_OWNER_APP,
+	CHECKPOINT_OWNER_FUEL_GAUGE,
+	CHECKPOINT_OWNER_ENERGY_BUDGET,
+	CHECKPOINT_OWNER_GAIT_EVENTS,
+	CHECKPOINT_OWNER_DSP_CHAIN,
+	CHECKPOINT_OWNER_SENSOR_LOG,
+};
+
+/** Section identifier, unique per owner and index. */
+#define CHECKPOINT_ID(owner, idx) ((uint16_t)(((owner) << 8) | (idx)))
+
+/**
+ * A piece of RAM that is copied into the snapshot as is.
+ *
+ * The data must not hold pointers or uptime-relative values, those are
+ * meaningless after the reset.
+ */
+struct checkpoint_section {
+	sys_snode_t node;
+	uint16_t id;
+	uint16_t size;
+	/** Also restored from flash, see checkpoint_persist(). */
+	bool persist;
+	void *data;
+};
+
+#define CHECKPOINT_SECTION_INIT(_id, _var)                                                         \
+	{                                                                                          \
+		.id = (_id), .size = sizeof(_var), .data = &(_var),                                \
+	}
+
+#define CHECKPOINT_SECTION_PERSIST_INIT(_id, _var)                                                 \
+	{                                                                                          \
+		.id = (_id), .size = sizeof(_var), .persist = true, .data = &(_var),               \
+	}
+
+struct checkpoint_stats {
+	/** True if this boot resumed from a snapshot. */
+	bool restored;
+	/** Time from reset to checkpoint_resumed() in ms. */
+	uint32_t recovery_ms;
+	/** Progress units reported after the last snapshot, lost in the reset. */
+	uint32_t lost;
+	/** Snapshots taken since boot. */
+	uint32_t saves;
+};
+
+/**
+ * @brief Include a section in snapshots and restore it from the last one.
+ *
+ * Register after the owner has initialized the data, a valid snapshot
+ * overwrites it right away. Without one, a persistent section is read
+ * back from the last checkpoint_persist() instead.
+ *
+ * @retval true if the data was restored.
+ */
+bool checkpoint_register(struct checkpoint_section *section);
+
+/**
+ * @brief Write a persistent section to flash through the settings.
+ *
+ * Retained RAM is lost in a power-on or brown-out reset, so data that must
+ * outlive a supply dropout is written here whenever it changes in a way
+ * that matters. Not safe to call from an interrupt.
+ *
+ * @retval 0 on success.
+ * @retval -ENOTSUP without CONFIG_SETTINGS.
+ */
+int checkpoint_persist(const struct checkpoint_section *section);
+
+/**
+ * @brief Mark the end of the restore phase.
+ *
+ * Records the recovery time and the lost progress, and invalidates the
+ * snapshot so it is not restored twice.
+ */
+void checkpoint_resumed(void);
+
+/**
+ * @brief Copy every registered section into retained RAM.
+ *
+ * Safe to call from an interrupt.
+ *
+ * @retval 0 on success.
+ * @retval -ENOSPC if a section did not fit and was left out.
+ */
+int checkpoint_save(void);
+
+/**
+ * @brief Count units of work, such as processed ADC blocks.
+ *
+ * Kept in retained RAM outside the snapshot, so the work done after the
+ * last snapshot can be counted after a reset.
+ */
+void checkpoint_progress(uint32_t units);
+
+/**
+ * @brief Report a supply voltage measurement.
+ *
+ * Arms the snapshot trigger once VDD is above the threshold, and discards
+ * a snapshot whose power dip passed without a reset.
+ */
+void checkpoint_vdd_report(int32_t vdd_mv);
+
+/**
+ * @brief Get the restore statistics of this boot.
+ */
+void checkpoint_stats_get(struct checkpoint_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CHECKPOINT_H_ */
@@ -0,0 +1,154 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#include <math.h>
+
+#include <zephyr/kernel.h>
+
+#include "adc_channels.h"
+#include "checkpoint.h"
+#include "dsp_chain.h"
+
+#define BLOCK_SAMPLES CONFIG_APP_ADC_STREAM_BLOCK_SAMPLES
+#define FIR_TAPS      CONFIG_APP_DSP_FIR_TAPS
+
+BUILD_ASSERT(CONFIG_APP_ADC_STREAM_SAMPLE_RATE_HZ % CONFIG_APP_DSP_OUTPUT_RATE_HZ == 0,
+	     "the sample rate must be a multiple of the DSP output rate");
+BUILD_ASSERT(BLOCK_SAMPLES % DSP_CHAIN_DECIMATION == 0,
+	     "the stream block must hold a whole number of decimated samples");
+
+/* 12-bit codes are shifted into the q15 range. */
+#define Q15_INPUT_SHIFT (15 - ADC_CHANNELS_RESOLUTION)
+
+/* DC blocker y[n] = x[n] - x[n-1] + p * y[n-1], pole at 0.5 Hz. */
+#define DC_POLE_HZ 0.5f
+
+/* Decimator cutoff relative to the output Nyquist frequency. */
+#define FIR_CUTOFF_RATIO 0.8f
+
+static const enum adc_channel_slot pad_slot[DSP_CHAIN_PAD_COUNT] = {
+	[DSP_CHAIN_PAD_FRONT] = ADC_CHANNEL_FRONT,
+	[DSP_CHAIN_PAD_HEEL] = ADC_CHANNEL_HEEL,
+};
+
+/* Coefficients are shared, the state is per pad. */
+static q15_t dc_coeffs[6];
+static q15_t fir_coeffs[FIR_TAPS];
+
+struct pad_filter {
+	arm_biquad_casd_df1_inst_q15 dc;
+	q15_t dc_state[4];
+	arm_fir_decimate_instance_q15 decimator;
+	q15_t fir_state[FIR_TAPS + BLOCK_SAMPLES - 1];
+};
+
+static struct pad_filter pads[DSP_CHAIN_PAD_COUNT];
+
+/* Filter memories per pad, the FIR only carries FIR_TAPS - 1 samples from
+ * one block to the next.
+ */
+static struct checkpoint_section state_sections[DSP_CHAIN_PAD_COUNT][2];
+
+static q15_t work_in[BLOCK_SAMPLES];
+static q15_t work_dc[BLOCK_SAMPLES];
+
+static void dc_blocker_design(void)
+{
+	float p = 1.0f - (2.0f * PI * DC_POLE_HZ / CONFIG_APP_ADC_STREAM_SAMPLE_RATE_HZ);
+
+	/* {b0, 0, b1, b2, a1, a2}, halved and restored by a postShift of 1
+	 * because b0 = 1 is outside the q15 range.
+	 */
+	float coeffs[6] = {0.5f, 0.0f, -0.5f, 0.0f, p / 2.0f, 0.0f};
+
+	arm_float_to_q15(coeffs, dc_coeffs, ARRAY_SIZE(coeffs));
+}
+
+static void decimator_design(void)
+{
+	float taps[FIR_TAPS];
+	float fc = FIR_CUTOFF_RATIO * CONFIG_APP_DSP_OUTPUT_RATE_HZ / 2.0f /
+		   CONFIG_APP_ADC_STREAM_SAMPLE_RATE_HZ;
+	float mid = (FIR_TAPS - 1) / 2.0f;
+	float sum = 0.0f;
+
+	/* Hamming-windowed sinc, normalized to unity DC gain. */
+	for (int n = 0; n < FIR_TAPS; n++) {
+		float t = n - mid;
+		float sinc = (t == 0.0f) ? 2.0f * fc : sinf(2.0f * PI * fc * t) / (PI * t);
+		float window = 0.54f - 0.46f * cosf(2.0f * PI * n / (FIR_TAPS - 1));
+
+		taps[n] = sinc * window;
+		sum += taps[n];
+	}
+
+	for (int n = 0; n < FIR_TAPS; n++) {
+		taps[n] /= sum;
+	}
+
+	arm_float_to_q15(taps, fir_coeffs, FIR_TAPS);
+}
+
+int dsp_chain_init(void)
+{
+	dc_blocker_design();
+	decimator_design();
+
+	for (size_t i = 0; i < DSP_CHAIN_PAD_COUNT; i++) {
+		arm_status status;
+
+		arm_biquad_cascade_df1_init_q15(&pads[i].dc, 1, dc_coeffs, pads[i].dc_state, 1);
+
+		status = arm_fir_decimate_init_q15(&pads[i].decimator, FIR_TAPS,
+						   DSP_CHAIN_DECIMATION, fir_coeffs,
+						   pads[i].fir_state, BLOCK_SAMPLES);
+		if (status != ARM_MATH_SUCCESS) {
+			printk("FIR decimator init failed (status %d)\n", status);
+			return -EINVAL;
+		}
+
+		state_sections[i][0] = (struct checkpoint_section)CHECKPOINT_SECTION_INIT(
+			CHECKPOINT_ID(CHECKPOINT_OWNER_DSP_CHAIN, 2 * i), pads[i].dc_state);
+		state_sections[i][1] = (struct checkpoint_section){
+			.id = CHECKPOINT_ID(CHECKPOINT_OWNER_DSP_CHAIN, 2 * i + 1),
+			.size = (FIR_TAPS - 1) * sizeof(q15_t),
+			.data = pads[i].fir_state,
+		};
+		checkpoint_register(&state_sections[i][0]);
+		checkpoint_register(&state_sections[i][1]);
+	}
+
+	return 0;
+}
+
+void dsp_chain_process(const struct adc_stream_block *block, struct dsp_chain_output *out)
+{
+	uint32_t start = k_cycle_get_32();
+	size_t frames = MIN(block->count / block->channels, BLOCK_SAMPLES);
+
+	for (size_t i = 0; i < DSP_CHAIN_PAD_COUNT; i++) {
+		struct pad_filter *pad = &pads[i];
+
+		for (size_t n = 0; n < frames; n++) {
+			work_in[n] = block->samples[n * block->channels + pad_slot[i]];
+		}
+
+		arm_shift_q15(work_in, Q15_INPUT_SHIFT, work_in, frames);
+		arm_biquad_cascade_df1_q15(&pad->dc, work_in, work_dc, frames);
+		arm_power_q15(work_dc, frames, &out->energy[i]);
+		arm_fir_decimate_q15(&pad->decimator, work_dc, out->pressure[i], frames);
+	}
+
+	/* Output n is computed with input n * M + M - 1 as the newest sample,
+	 * and the linear phase FIR delays it by (taps - 1) / 2 inputs.
+	 */
+	out->count = frames / DSP_CHAIN_DECIMATION;
+	out->period_ns = block->frame_period_ns * DSP_CHAIN_DECIMATION;
+	out->timestamp_us = block->timestamp_us +
+			    ((int64_t)(DSP_CHAIN_DECIMATION - 1) * 2 - (FIR_TAPS - 1)) *
+				    block->frame_period_ns / (2 * NSEC_PER_USEC);
+	out->cycles = k_cycle_get_32() - start;
+}
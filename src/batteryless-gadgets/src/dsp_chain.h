@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#ifndef DSP_CHAIN_H_
+#define DSP_CHAIN_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <arm_math.h>
+
+#include "adc_stream.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Pads filtered by the chain, indexes into dsp_chain_output arrays. */
+enum dsp_chain_pad {
+	DSP_CHAIN_PAD_FRONT,
+	DSP_CHAIN_PAD_HEEL,
+	DSP_CHAIN_PAD_COUNT,
+};
+
+#define DSP_CHAIN_DECIMATION \
+	(CONFIG_APP_ADC_STREAM_SAMPLE_RATE_HZ / CONFIG_APP_DSP_OUTPUT_RATE_HZ)
+#define DSP_CHAIN_OUT_SAMPLES \
+	(CONFIG_APP_ADC_STREAM_BLOCK_SAMPLES / DSP_CHAIN_DECIMATION)
+
+/** Result of filtering one streamed block. */
+struct dsp_chain_output {
+	/** DC-free, low-passed pad signals at CONFIG_APP_DSP_OUTPUT_RATE_HZ. */
+	q15_t pressure[DSP_CHAIN_PAD_COUNT][DSP_CHAIN_OUT_SAMPLES];
+	/** Samples per pad in @ref pressure. */
+	size_t count;
+	/**
+	 * Common time of the first output sample, corrected for the delay
+	 * of the decimation filter.
+	 */
+	int64_t timestamp_us;
+	/** Time between two output samples. */
+	uint32_t period_ns;
+	/**
+	 * Sum of squares of the DC-free signal at the input rate, in q34.30
+	 * as returned by arm_power_q15(). Proportional to the electrical
+	 * energy the piezo delivered during the block.
+	 */
+	q63_t energy[DSP_CHAIN_PAD_COUNT];
+	/** CPU cycles spent in dsp_chain_process(). */
+	uint32_t cycles;
+};
+
+/**
+ * @brief Design the filters for the configured rates.
+ *
+ * @retval 0 on success, -EINVAL if the CMSIS-DSP instances reject the setup.
+ */
+int dsp_chain_init(void);
+
+/**
+ * @brief Filter and decimate one streamed block.
+ *
+ * Filter state is kept between calls, so blocks must be passed in order.
+ */
+void dsp_chain_process(const struct adc_stream_block *block, struct dsp_chain_output *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DSP_CHAIN_H_ */
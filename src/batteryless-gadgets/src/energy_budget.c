@@ -0,0 +1,218 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/shell/shell.h>
+#include <zephyr/sys/atomic.h>
+
+#include "adc_channels.h"
+#include "adc_conv.h"
+#if defined(CONFIG_APP_DSP_CHAIN)
+#include "dsp_chain.h"
+#endif
+#include "checkpoint.h"
+#include "energy_budget.h"
+#include "fuel_gauge.h"
+
+#define WINDOW_MS ((int64_t)CONFIG_APP_ENERGY_BUDGET_WINDOW_S * MSEC_PER_SEC)
+
+/* Allowed share of the nominal duty cycle for each level. The nominal
+ * rate is what a balanced budget sustains, a surplus does not go faster.
+ */
+static const uint16_t duty_permille[] = {
+	[ENERGY_BUDGET_CRITICAL] = 1000 / 16,
+	[ENERGY_BUDGET_DEFICIT] = 1000 / 4,
+	[ENERGY_BUDGET_NEUTRAL] = 1000,
+	[ENERGY_BUDGET_SURPLUS] = 1000,
+};
+
+static sys_slist_t listeners = SYS_SLIST_STATIC_INIT(&listeners);
+static K_MUTEX_DEFINE(listeners_lock);
+
+static atomic_t pending_uas;
+static struct {
+	uint64_t harvested_uas;
+	/* Net current in 1/256 uA so short updates still move the average */
+	int32_t balance_q8;
+} budget;
+
+static struct checkpoint_section budget_section =
+	CHECKPOINT_SECTION_INIT(CHECKPOINT_ID(CHECKPOINT_OWNER_ENERGY_BUDGET, 0), budget);
+static atomic_t level = ATOMIC_INIT(ENERGY_BUDGET_NEUTRAL);
+static int64_t last_update_ms;
+
+void energy_budget_harvest_add(uint32_t charge_uas)
+{
+	atomic_add(&pending_uas, charge_uas);
+	fuel_gauge_harvest_add(charge_uas);
+}
+
+#if defined(CONFIG_APP_DSP_CHAIN)
+void energy_budget_harvest_block(const struct dsp_chain_output *filtered)
+{
+	static const enum adc_channel_slot slots[DSP_CHAIN_PAD_COUNT] = {
+		ADC_CHANNEL_FRONT, ADC_CHANNEL_HEEL,
+	};
+	int32_t vbat_mv = fuel_gauge_vbat_mv();
+	uint64_t uj_x_rate = 0;
+
+	if (vbat_mv <= 0) {
+		return;
+	}
+
+	for (size_t i = 0; i < DSP_CHAIN_PAD_COUNT; i++) {
+		/* q15 full scale in mV, the energy is a sum of squares in q34.30 */
+		uint64_t fs_mv = adc_conv_to_mv(slots[i], 1 << ADC_CHANNELS_RESOLUTION);
+
+		uj_x_rate += (((uint64_t)filtered->energy[i] >> 10) * fs_mv * fs_mv) >> 20;
+	}
+
+	/* E[uJ] = sum(V^2) * dt / R, Q[uAs] = E / Vbat * efficiency */
+	uint64_t uj = uj_x_rate / CONFIG_APP_ADC_STREAM_SAMPLE_RATE_HZ /
+		      CONFIG_APP_FUEL_GAUGE_PIEZO_LOAD_OHMS;
+
+	energy_budget_harvest_add(uj * 1000 * CONFIG_APP_FUEL_GAUGE_HARVEST_EFFICIENCY_PCT / 100 /
+				  vbat_mv);
+}
+#endif
+
+/* Close to the checkpoint trigger, the next dip may reset the chip. */
+static bool vdd_margin_low(int32_t vdd_mv)
+{
+	return vdd_mv > 0 &&
+	       vdd_mv < CONFIG_APP_CHECKPOINT_VDD_MV + CONFIG_APP_ENERGY_BUDGET_CRITICAL_VDD_MARGIN_MV;
+}
+
+static enum energy_budget_level level_from_state(int32_t balance, int32_t vdd_mv)
+{
+	/* The state of charge only counts once the cell was measured. */
+	bool soc_valid = fuel_gauge_soc_valid();
+	uint8_t soc_pct = fuel_gauge_soc_pct();
+
+	if (vdd_margin_low(vdd_mv) ||
+	    (soc_valid && soc_pct < CONFIG_APP_ENERGY_BUDGET_CRITICAL_SOC_PCT)) {
+		return ENERGY_BUDGET_CRITICAL;
+	}
+
+	if (balance > CONFIG_APP_ENERGY_BUDGET_MARGIN_UA) {
+		return ENERGY_BUDGET_SURPLUS;
+	}
+
+	/* A well charged store can absorb a deficit for a while. */
+	if (balance < -CONFIG_APP_ENERGY_BUDGET_MARGIN_UA &&
+	    !(soc_valid && soc_pct >= CONFIG_APP_ENERGY_BUDGET_RESERVE_SOC_PCT)) {
+		return ENERGY_BUDGET_DEFICIT;
+	}
+
+	return ENERGY_BUDGET_NEUTRAL;
+}
+
+void energy_budget_update(void)
+{
+	int64_t now = k_uptime_get();
+	int64_t elapsed_ms = MIN(now - last_update_ms, WINDOW_MS);
+	uint32_t harvest = atomic_set(&pending_uas, 0);
+	enum energy_budget_level new_level;
+	struct energy_budget_listener *listener;
+
+	fuel_gauge_update();
+
+	last_update_ms = now;
+	budget.harvested_uas += harvest;
+
+	if (elapsed_ms <= 0) {
+		return;
+	}
+
+	/* Exponential average of the net current over the window */
+	int32_t net_ua = (int32_t)((int64_t)harvest * MSEC_PER_SEC / elapsed_ms) -
+			 (int32_t)fuel_gauge_load_ua();
+
+	budget.balance_q8 +=
+		(int32_t)(((int64_t)net_ua * 256 - budget.balance_q8) * elapsed_ms / WINDOW_MS);
+
+	new_level = level_from_state(energy_budget_balance_ua(), fuel_gauge_vdd_mv());
+	if (atomic_set(&level, new_level) == new_level) {
+		return;
+	}
+
+	k_mutex_lock(&listeners_lock, K_FOREVER);
+	SYS_SLIST_FOR_EACH_CONTAINER(&listeners, listener, node) {
+		listener->cb(new_level);
+	}
+	k_mutex_unlock(&listeners_lock);
+}
+
+enum energy_budget_level energy_budget_level_get(void)
+{
+	return atomic_get(&level);
+}
+
+int32_t energy_budget_balance_ua(void)
+{
+	return budget.balance_q8 / 256;
+}
+
+uint32_t energy_budget_duty_permille(void)
+{
+	return duty_permille[energy_budget_level_get()];
+}
+
+uint32_t energy_budget_period_ms(uint32_t nominal_ms)
+{
+	return (uint64_t)nominal_ms * 1000 / energy_budget_duty_permille();
+}
+
+void energy_budget_listener_add(struct energy_budget_listener *listener)
+{
+	k_mutex_lock(&listeners_lock, K_FOREVER);
+	sys_slist_append(&listeners, &listener->node);
+	listener->cb(energy_budget_level_get());
+	k_mutex_unlock(&listeners_lock);
+}
+
+static int energy_budget_init(void)
+{
+	checkpoint_register(&budget_section);
+
+	return 0;
+}
+
+SYS_INIT(energy_budget_init, APPLICATION, CONFIG_APPLICATION_INIT_PRIORITY);
+
+#if defined(CONFIG_SHELL)
+static int cmd_energy(const struct shell *sh, size_t argc, char **argv)
+{
+	static const char *const level_names[] = {
+		[ENERGY_BUDGET_CRITICAL] = "critical",
+		[ENERGY_BUDGET_DEFICIT] = "deficit",
+		[ENERGY_BUDGET_NEUTRAL] = "neutral",
+		[ENERGY_BUDGET_SURPLUS] = "surplus",
+	};
+	static const char *const load_names[] = {
+		[FUEL_GAUGE_LOAD_CPU] = "cpu",
+		[FUEL_GAUGE_LOAD_RADIO_ADV] = "radio adv",
+		[FUEL_GAUGE_LOAD_RADIO_CONN] = "radio conn",
+		[FUEL_GAUGE_LOAD_ADC_STREAM] = "adc stream",
+		[FUEL_GAUGE_LOAD_IMU] = "imu",
+	};
+
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	shell_print(sh, "level %s, balance %d uA, duty %u permille",
+		    level_names[energy_budget_level_get()], energy_budget_balance_ua(),
+		    energy_budget_duty_permille());
+	shell_print(sh, "harvested %llu uAs", budget.harvested_uas);
+	for (size_t i = 0; i < FUEL_GAUGE_LOAD_COUNT; i++) {
+		shell_print(sh, "%s: %llu uAs", load_names[i], fuel_gauge_spent_uas(i));
+	}
+
+	return 0;
+}
+
+SHELL_CMD_REGISTER(energy, NULL, "Harvested and spent charge", cmd_energy);
+#endif /* CONFIG_SHELL */
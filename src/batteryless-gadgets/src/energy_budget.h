@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#ifndef ENERGY_BUDGET_H_
+#define ENERGY_BUDGET_H_
+
+#include <stdint.h>
+
+#include <zephyr/sys/slist.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct dsp_chain_output;
+
+/** Energy state, ordered from the most to the least constrained. */
+enum energy_budget_level {
+	/** Storage almost empty or VDD near brown-out, essentials only. */
+	ENERGY_BUDGET_CRITICAL,
+	/** Spending more than the harvester delivers. */
+	ENERGY_BUDGET_DEFICIT,
+	/** Spending and harvesting are balanced. */
+	ENERGY_BUDGET_NEUTRAL,
+	/** Harvesting more than is spent. */
+	ENERGY_BUDGET_SURPLUS,
+};
+
+/**
+ * @brief Budget change notification.
+ *
+ * Called from energy_budget_update() when the level changes.
+ */
+typedef void (*energy_budget_cb_t)(enum energy_budget_level level);
+
+struct energy_budget_listener {
+	sys_snode_t node;
+	energy_budget_cb_t cb;
+};
+
+/**
+ * @brief Add charge delivered by the harvester.
+ *
+ * @param charge_uas Harvested charge in microampere-seconds.
+ */
+void energy_budget_harvest_add(uint32_t charge_uas);
+
+/**
+ * @brief Account the charge harvested during one filtered ADC block.
+ *
+ * The rectified pads are modelled as a resistive load of
+ * CONFIG_APP_FUEL_GAUGE_PIEZO_LOAD_OHMS, fed by the DC-free pad signals.
+ */
+void energy_budget_harvest_block(const struct dsp_chain_output *filtered);
+
+/**
+ * @brief Update the fuel gauge and the energy balance.
+ *
+ * Listeners are called from here when the level changes. Call periodically,
+ * for example with the period returned by energy_budget_period_ms().
+ */
+void energy_budget_update(void);
+
+/**
+ * @brief Current budget level.
+ */
+enum energy_budget_level energy_budget_level_get(void);
+
+/**
+ * @brief Averaged harvested minus spent current in uA.
+ */
+int32_t energy_budget_balance_ua(void);
+
+/**
+ * @brief Share of the nominal duty cycle the budget allows, in permille.
+ */
+uint32_t energy_budget_duty_permille(void);
+
+/**
+ * @brief Stretch a nominal period to the duty cycle the budget allows.
+ *
+ * @param nominal_ms Period used when harvesting covers the spending.
+ *
+ * @return Period in ms, never shorter than @p nominal_ms.
+ */
+uint32_t energy_budget_period_ms(uint32_t nominal_ms);
+
+/**
+ * @brief Register for level changes.
+ *
+ * The listener is called once right away with the current level.
+ */
+void energy_budget_listener_add(struct energy_budget_listener *listener);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ENERGY_BUDGET_H_ */
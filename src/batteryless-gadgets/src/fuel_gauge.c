@@ -0,0 +1,243 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+
+#include "checkpoint.h"
+#include "fuel_gauge.h"
+
+#define CAPACITY_UAS ((int64_t)CONFIG_APP_FUEL_GAUGE_CAPACITY_MAH * 1000 * 3600)
+
+/* SoC is kept in 1/100 percent to keep the filter free of rounding steps. */
+#define SOC_SCALE 100
+
+/* Typical average currents at 3 V with the DC/DC regulator enabled, from
+ * the nRF52840 product specification and the BLE connection parameters
+ * used by this sample.
+ */
+#define CPU_ACTIVE_UA 3300
+#define CPU_SLEEP_UA  3
+
+static const uint32_t load_ua[FUEL_GAUGE_LOAD_COUNT] = {
+	[FUEL_GAUGE_LOAD_CPU] = 0,
+	[FUEL_GAUGE_LOAD_RADIO_ADV] = 120,
+	[FUEL_GAUGE_LOAD_RADIO_CONN] = 40,
+	[FUEL_GAUGE_LOAD_ADC_STREAM] = 80,
+	[FUEL_GAUGE_LOAD_IMU] = 700,
+};
+
+/* Open-circuit voltage of a LiPo cell against state of charge. */
+static const struct {
+	int32_t mv;
+	int32_t pct;
+} ocv_table[] = {
+	{4200, 100}, {4100, 90}, {4000, 80}, {3920, 70}, {3850, 60}, {3800, 50},
+	{3750, 40},  {3710, 30}, {3680, 20}, {3640, 10}, {3550, 5},  {3300, 0},
+};
+
+/* A cell reading outside of this is not a LiPo cell, VDDH is left open or
+ * fed from USB. The state of charge then only follows the coulomb counter
+ * and is not reported as valid.
+ */
+#define VBAT_MIN_MV 3000
+#define VBAT_MAX_MV 4400
+
+static atomic_t active_loads;
+static atomic_t harvested_uas;
+static atomic_t vdd_mv;
+static atomic_t vbat_mv;
+
+/* Charge accounting, kept across brown-outs by the checkpoint. */
+static struct {
+	int64_t remaining_uas;
+	uint64_t spent_uas[FUEL_GAUGE_LOAD_COUNT];
+	int32_t soc;
+	bool ocv_seeded;
+} gauge = {
+	.remaining_uas = CAPACITY_UAS,
+	.soc = 100 * SOC_SCALE,
+};
+
+static struct checkpoint_section gauge_section =
+	CHECKPOINT_SECTION_INIT(CHECKPOINT_ID(CHECKPOINT_OWNER_FUEL_GAUGE, 0), gauge);
+
+static uint32_t last_load_ua;
+static int64_t last_update_ms;
+
+#if defined(CONFIG_SCHED_THREAD_USAGE_ALL)
+static uint64_t last_busy_cycles;
+static uint64_t last_total_cycles;
+#endif
+
+static int32_t ocv_soc(int32_t mv)
+{
+	if (mv >= ocv_table[0].mv) {
+		return 100 * SOC_SCALE;
+	}
+
+	for (size_t i = 1; i < ARRAY_SIZE(ocv_table); i++) {
+		if (mv >= ocv_table[i].mv) {
+			int32_t dmv = ocv_table[i - 1].mv - ocv_table[i].mv;
+			int32_t dpct = ocv_table[i - 1].pct - ocv_table[i].pct;
+
+			return ocv_table[i].pct * SOC_SCALE +
+			       (mv - ocv_table[i].mv) * dpct * SOC_SCALE / dmv;
+		}
+	}
+
+	return 0;
+}
+
+/* Fraction of time the CPU was not idle since the last call, in permille. */
+static uint32_t cpu_busy_permille(void)
+{
+#if defined(CONFIG_SCHED_THREAD_USAGE_ALL)
+	k_thread_runtime_stats_t stats;
+	uint64_t busy;
+	uint64_t total;
+
+	if (k_thread_runtime_stats_all_get(&stats)) {
+		return 0;
+	}
+
+	busy = stats.total_cycles - last_busy_cycles;
+	total = stats.execution_cycles - last_total_cycles;
+	last_busy_cycles = stats.total_cycles;
+	last_total_cycles = stats.execution_cycles;
+
+	return total ? (uint32_t)(busy * 1000 / total) : 0;
+#else
+	return 0;
+#endif
+}
+
+/* Total load current, and the charge each load drew over elapsed_ms. */
+static uint32_t load_current_ua(int64_t elapsed_ms)
+{
+	uint32_t busy = cpu_busy_permille();
+	uint32_t cpu_ua = (CPU_ACTIVE_UA * busy + CPU_SLEEP_UA * (1000 - busy)) / 1000;
+	atomic_val_t loads = atomic_get(&active_loads);
+	uint32_t ua = cpu_ua;
+
+	gauge.spent_uas[FUEL_GAUGE_LOAD_CPU] += (uint64_t)cpu_ua * elapsed_ms / MSEC_PER_SEC;
+
+	for (size_t i = FUEL_GAUGE_LOAD_CPU + 1; i < FUEL_GAUGE_LOAD_COUNT; i++) {
+		if (loads & BIT(i)) {
+			ua += load_ua[i];
+			gauge.spent_uas[i] += (uint64_t)load_ua[i] * elapsed_ms / MSEC_PER_SEC;
+		}
+	}
+
+	return ua;
+}
+
+void fuel_gauge_load_set(enum fuel_gauge_load load, bool on)
+{
+	if (on) {
+		atomic_or(&active_loads, BIT(load));
+	} else {
+		atomic_and(&active_loads, ~BIT(load));
+	}
+}
+
+void fuel_gauge_vdd_report(int32_t mv)
+{
+	atomic_set(&vdd_mv, mv);
+}
+
+void fuel_gauge_vbat_report(int32_t mv)
+{
+	atomic_set(&vbat_mv, mv);
+}
+
+void fuel_gauge_harvest_add(uint32_t charge_uas)
+{
+	atomic_add(&harvested_uas, charge_uas);
+}
+
+void fuel_gauge_update(void)
+{
+	int64_t now = k_uptime_get();
+	int64_t elapsed_ms = now - last_update_ms;
+	int32_t mv = atomic_get(&vbat_mv);
+	int32_t cc_soc;
+
+	last_update_ms = now;
+	last_load_ua = load_current_ua(elapsed_ms);
+
+	/* Coulomb counting: load drains, the harvester refills. */
+	gauge.remaining_uas -= (int64_t)last_load_ua * elapsed_ms / MSEC_PER_SEC;
+	gauge.remaining_uas += atomic_set(&harvested_uas, 0);
+	gauge.remaining_uas = CLAMP(gauge.remaining_uas, 0, CAPACITY_UAS);
+
+	cc_soc = (int32_t)(gauge.remaining_uas * 100 * SOC_SCALE / CAPACITY_UAS);
+
+	if (mv < VBAT_MIN_MV || mv > VBAT_MAX_MV) {
+		gauge.soc = cc_soc;
+		return;
+	}
+
+	if (!gauge.ocv_seeded) {
+		/* First cell reading sets the starting charge. */
+		gauge.soc = ocv_soc(mv);
+		gauge.remaining_uas = CAPACITY_UAS * gauge.soc / (100 * SOC_SCALE);
+		gauge.ocv_seeded = true;
+		return;
+	}
+
+	/* The cell voltage sags under load, so only let it pull the
+	 * counted charge slowly, and not at all while the radio or the CPU
+	 * draw more than the light-load limit.
+	 */
+	if (last_load_ua <= CONFIG_APP_FUEL_GAUGE_OCV_MAX_LOAD_UA) {
+		cc_soc += (ocv_soc(mv) - cc_soc) / CONFIG_APP_FUEL_GAUGE_OCV_WEIGHT;
+		gauge.remaining_uas = CAPACITY_UAS * cc_soc / (100 * SOC_SCALE);
+	}
+
+	gauge.soc = cc_soc;
+}
+
+uint8_t fuel_gauge_soc_pct(void)
+{
+	return (gauge.soc + SOC_SCALE / 2) / SOC_SCALE;
+}
+
+bool fuel_gauge_soc_valid(void)
+{
+	int32_t mv = atomic_get(&vbat_mv);
+
+	return gauge.ocv_seeded && mv >= VBAT_MIN_MV && mv <= VBAT_MAX_MV;
+}
+
+int32_t fuel_gauge_vdd_mv(void)
+{
+	return atomic_get(&vdd_mv);
+}
+
+int32_t fuel_gauge_vbat_mv(void)
+{
+	return atomic_get(&vbat_mv);
+}
+
+uint32_t fuel_gauge_load_ua(void)
+{
+	return last_load_ua;
+}
+
+uint64_t fuel_gauge_spent_uas(enum fuel_gauge_load load)
+{
+	return gauge.spent_uas[load];
+}
+
+static int fuel_gauge_init(void)
+{
+	checkpoint_register(&gauge_section);
+
+	return 0;
+}
+
+SYS_INIT(fuel_gauge_init, APPLICATION, CONFIG_APPLICATION_INIT_PRIORITY);
@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#ifndef FUEL_GAUGE_H_
+#define FUEL_GAUGE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Loads with a known average current, switched on and off by their owners. */
+enum fuel_gauge_load {
+	/** Always on, the current follows the measured CPU busy time. */
+	FUEL_GAUGE_LOAD_CPU,
+	FUEL_GAUGE_LOAD_RADIO_ADV,
+	FUEL_GAUGE_LOAD_RADIO_CONN,
+	FUEL_GAUGE_LOAD_ADC_STREAM,
+	FUEL_GAUGE_LOAD_IMU,
+	FUEL_GAUGE_LOAD_COUNT,
+};
+
+/**
+ * @brief Mark a load as active or inactive.
+ */
+void fuel_gauge_load_set(enum fuel_gauge_load load, bool on);
+
+/**
+ * @brief Report a supply voltage measurement.
+ *
+ * Typically the mean of the VDD channel over one ADC block. VDD is the
+ * regulated supply, it only tells how close the chip is to a brown-out.
+ */
+void fuel_gauge_vdd_report(int32_t vdd_mv);
+
+/**
+ * @brief Report a cell voltage measurement.
+ *
+ * Typically the mean of the VBAT channel over one ADC block. The state of
+ * charge is read from the open-circuit voltage curve of the cell.
+ */
+void fuel_gauge_vbat_report(int32_t vbat_mv);
+
+/**
+ * @brief Add charge delivered by the harvester.
+ *
+ * @param charge_uas Harvested charge in microampere-seconds.
+ */
+void fuel_gauge_harvest_add(uint32_t charge_uas);
+
+/**
+ * @brief Integrate the load current since the last call and update the SoC.
+ *
+ * Call periodically, once a second is enough.
+ */
+void fuel_gauge_update(void);
+
+/**
+ * @brief Filtered state of charge in percent.
+ */
+uint8_t fuel_gauge_soc_pct(void);
+
+/**
+ * @brief Whether the state of charge is backed by a cell measurement.
+ *
+ * False until a cell voltage in the range of a LiPo cell was reported, and
+ * while the last reading is out of that range.
+ */
+bool fuel_gauge_soc_valid(void);
+
+/**
+ * @brief Last supply voltage in mV, 0 before the first measurement.
+ */
+int32_t fuel_gauge_vdd_mv(void);
+
+/**
+ * @brief Last cell voltage in mV, 0 before the first measurement.
+ */
+int32_t fuel_gauge_vbat_mv(void);
+
+/**
+ * @brief Estimated average load current over the last update in uA.
+ */
+uint32_t fuel_gauge_load_ua(void);
+
+/**
+ * @brief Charge drawn by one load since boot in microampere-seconds.
+ */
+uint64_t fuel_gauge_spent_uas(enum fuel_gauge_load load);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FUEL_GAUGE_H_ */
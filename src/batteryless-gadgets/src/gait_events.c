@@ -0,0 +1,221 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#include <zephyr/kernel.h>
+
+#include "adc_conv.h"
+#include "checkpoint.h"
+#include "gait_events.h"
+#include "timebase.h"
+
+/* Baseline follows the unloaded pad with a ~250 ms time constant, the peak
+ * envelope decays towards the baseline within ~2 s, so the thresholds adapt
+ * to the footwear and walking speed over a few steps.
+ */
+#define BASELINE_SHIFT   LOG2(MAX(CONFIG_APP_ADC_STREAM_SAMPLE_RATE_HZ / 4, 1))
+#define PEAK_DECAY_SHIFT LOG2(CONFIG_APP_ADC_STREAM_SAMPLE_RATE_HZ * 2)
+
+enum pad_edge {
+	PAD_EDGE_NONE,
+	PAD_EDGE_RISING,
+	PAD_EDGE_FALLING,
+};
+
+struct pad_tracker {
+	/* Unloaded level in mV, Q4 for a smooth average. */
+	int32_t baseline_q4;
+	/* Decaying maximum in mV, Q16 so that the decay does not stall a
+	 * few mV above the baseline.
+	 */
+	int32_t peak_q16;
+	bool loaded;
+	bool primed;
+};
+
+static struct pad_tracker front;
+static struct pad_tracker heel;
+
+/* The adapted baselines and peaks survive a brown-out, the timestamps do not. */
+static struct checkpoint_section tracker_sections[] = {
+	CHECKPOINT_SECTION_INIT(CHECKPOINT_ID(CHECKPOINT_OWNER_GAIT_EVENTS, 0), front),
+	CHECKPOINT_SECTION_INIT(CHECKPOINT_ID(CHECKPOINT_OWNER_GAIT_EVENTS, 1), heel),
+};
+
+static gait_event_cb_t event_cb;
+static gait_load_cb_t load_cb;
+static bool foot_loaded;
+
+static bool in_stance;
+static int32_t stance_peak_mv;
+static int64_t stance_peak_us;
+static int64_t last_heel_strike_us;
+static int64_t last_event_us;
+
+static int32_t pad_range(const struct pad_tracker *pad)
+{
+	return MAX((pad->peak_q16 >> 16) - (pad->baseline_q4 >> 4), CONFIG_APP_GAIT_MIN_RANGE_MV);
+}
+
+static int32_t pad_on_threshold(const struct pad_tracker *pad)
+{
+	return (pad->baseline_q4 >> 4) + pad_range(pad) * CONFIG_APP_GAIT_ON_THRESHOLD_PCT / 100;
+}
+
+static int32_t pad_off_threshold(const struct pad_tracker *pad)
+{
+	return (pad->baseline_q4 >> 4) + pad_range(pad) * CONFIG_APP_GAIT_OFF_THRESHOLD_PCT / 100;
+}
+
+static enum pad_edge pad_update(struct pad_tracker *pad, int32_t mv)
+{
+	int32_t baseline = pad->baseline_q4 >> 4;
+
+	if (!pad->primed) {
+		pad->baseline_q4 = mv * 16;
+		pad->peak_q16 = mv * 65536;
+		pad->primed = true;
+		return PAD_EDGE_NONE;
+	}
+
+	if (mv > (pad->peak_q16 >> 16)) {
+		pad->peak_q16 = mv * 65536;
+	} else {
+		pad->peak_q16 -= (pad->peak_q16 - baseline * 65536) >> PEAK_DECAY_SHIFT;
+	}
+
+	/* Hysteresis between the on and off thresholds. */
+	if (!pad->loaded) {
+		pad->baseline_q4 += (mv * 16 - pad->baseline_q4) >> BASELINE_SHIFT;
+
+		if (mv > pad_on_threshold(pad)) {
+			pad->loaded = true;
+			return PAD_EDGE_RISING;
+		}
+	} else if (mv < pad_off_threshold(pad)) {
+		pad->loaded = false;
+		return PAD_EDGE_FALLING;
+	}
+
+	return PAD_EDGE_NONE;
+}
+
+static void event_emit(enum gait_event_type type, int64_t timestamp_us, int32_t value_mv)
+{
+	struct gait_event evt = {
+		.type = type,
+		.timestamp_us = timestamp_us,
+		.value_mv = value_mv,
+	};
+
+	last_event_us = timestamp_us;
+
+	if (event_cb) {
+		event_cb(&evt);
+	}
+}
+
+static void frame_process(int32_t front_mv, int32_t heel_mv, int64_t now_us)
+{
+	enum pad_edge heel_edge = pad_update(&heel, heel_mv);
+	enum pad_edge front_edge = pad_update(&front, front_mv);
+
+	if ((front.loaded || heel.loaded) != foot_loaded) {
+		foot_loaded = !foot_loaded;
+		if (load_cb) {
+			load_cb(now_us, foot_loaded);
+		}
+	}
+
+	if (heel_edge == PAD_EDGE_RISING &&
+	    (now_us - last_heel_strike_us) >= CONFIG_APP_GAIT_MIN_STEP_MS * USEC_PER_MSEC) {
+		last_heel_strike_us = now_us;
+		in_stance = true;
+		stance_peak_mv = INT32_MIN;
+		event_emit(GAIT_EVENT_HEEL_STRIKE, now_us, heel_mv);
+	}
+
+	if (in_stance && (front_mv + heel_mv) > stance_peak_mv) {
+		stance_peak_mv = front_mv + heel_mv;
+		stance_peak_us = now_us;
+	}
+
+	if (front_edge == PAD_EDGE_FALLING && in_stance) {
+		in_stance = false;
+		event_emit(GAIT_EVENT_PEAK_PRESSURE, stance_peak_us, stance_peak_mv);
+		event_emit(GAIT_EVENT_TOE_OFF, now_us, front_mv);
+	}
+}
+
+static void gait_wake(enum adc_channel_slot slot)
+{
+	/* Runs in the SAADC ISR, the next block is delivered as usual. */
+	ARG_UNUSED(slot);
+}
+
+static void idle_enter(int64_t now_us)
+{
+	int err;
+
+	err = adc_stream_limit_set(ADC_CHANNEL_FRONT, INT16_MIN,
+				   adc_conv_from_mv(ADC_CHANNEL_FRONT, pad_on_threshold(&front)));
+	if (!err) {
+		err = adc_stream_limit_set(ADC_CHANNEL_HEEL, INT16_MIN,
+					   adc_conv_from_mv(ADC_CHANNEL_HEEL,
+							    pad_on_threshold(&heel)));
+	}
+	if (!err) {
+		err = adc_stream_idle(gait_wake);
+	}
+
+	if (err) {
+		printk("Failed to enter gait idle (err %d)\n", err);
+	}
+
+	/* Either way, wait another timeout before trying again. */
+	last_event_us = now_us;
+}
+
+void gait_events_init(gait_event_cb_t cb)
+{
+	event_cb = cb;
+	last_event_us = timebase_now_us();
+
+	for (size_t i = 0; i < ARRAY_SIZE(tracker_sections); i++) {
+		checkpoint_register(&tracker_sections[i]);
+	}
+
+	/* A pad that was loaded at the snapshot gets a fresh edge. */
+	front.loaded = false;
+	heel.loaded = false;
+	foot_loaded = false;
+}
+
+void gait_events_load_watch(gait_load_cb_t cb)
+{
+	load_cb = cb;
+}
+
+void gait_events_process(const struct adc_stream_block *block)
+{
+	size_t frames = block->count / block->channels;
+	int64_t end_us = block->timestamp_us;
+
+	for (size_t i = 0; i < frames; i++) {
+		const int16_t *frame = &block->samples[i * block->channels];
+		int64_t now_us = block->timestamp_us +
+				 (int64_t)i * block->frame_period_ns / NSEC_PER_USEC;
+
+		end_us = now_us;
+
+		frame_process(adc_conv_to_mv(ADC_CHANNEL_FRONT, frame[ADC_CHANNEL_FRONT]),
+			      adc_conv_to_mv(ADC_CHANNEL_HEEL, frame[ADC_CHANNEL_HEEL]), now_us);
+	}
+
+	if (!front.loaded && !heel.loaded &&
+	    (end_us - last_event_us) >= CONFIG_APP_GAIT_IDLE_TIMEOUT_MS * USEC_PER_MSEC) {
+		idle_enter(end_us);
+	}
+}
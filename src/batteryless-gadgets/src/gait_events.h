@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#ifndef GAIT_EVENTS_H_
+#define GAIT_EVENTS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "adc_stream.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum gait_event_type {
+	/** Heel pad loaded. */
+	GAIT_EVENT_HEEL_STRIKE,
+	/** Front pad unloaded, end of stance. */
+	GAIT_EVENT_TOE_OFF,
+	/** Highest combined pad pressure of the last stance. */
+	GAIT_EVENT_PEAK_PRESSURE,
+};
+
+struct gait_event {
+	enum gait_event_type type;
+	/** Common time, see timebase.h, of the sample that caused the event. */
+	int64_t timestamp_us;
+	/** Pad voltage in mV, front + heel for peak pressure events. */
+	int32_t value_mv;
+};
+
+/**
+ * @brief Event callback, called from the ADC stream consumer thread.
+ */
+typedef void (*gait_event_cb_t)(const struct gait_event *evt);
+
+/**
+ * @brief Loading callback, called from the ADC stream consumer thread.
+ *
+ * @param timestamp_us Common time of the sample that changed the loading.
+ * @param loaded       Whether either pad is loaded.
+ */
+typedef void (*gait_load_cb_t)(int64_t timestamp_us, bool loaded);
+
+/**
+ * @brief Initialize the detector.
+ */
+void gait_events_init(gait_event_cb_t cb);
+
+/**
+ * @brief Follow the loading of the foot.
+ *
+ * The callback sees every change between no pad and at least one pad
+ * loaded, without the debouncing of the heel strike events.
+ */
+void gait_events_load_watch(gait_load_cb_t cb);
+
+/**
+ * @brief Run the detector over one streamed block.
+ *
+ * After CONFIG_APP_GAIT_IDLE_TIMEOUT_MS without events the detector arms
+ * the SAADC limits at the current loading thresholds and puts the stream
+ * into idle, so no further blocks are processed until a pad is loaded.
+ */
+void gait_events_process(const struct adc_stream_block *block);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* GAIT_EVENTS_H_ */
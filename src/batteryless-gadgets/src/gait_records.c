@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#include <errno.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/spsc_lockfree.h>
+
+#include "gait_records.h"
+
+BUILD_ASSERT(IS_POWER_OF_TWO(CONFIG_APP_GAIT_RECORDS), "queue size must be a power of two");
+
+/* The processing thread produces, the Bluetooth side consumes, so neither
+ * takes a lock the other could hold.
+ */
+SPSC_DEFINE(records, struct gait_record, CONFIG_APP_GAIT_RECORDS);
+
+static atomic_t dropped;
+
+int gait_records_put(const struct gait_record *record)
+{
+	struct gait_record *slot = spsc_acquire(&records);
+
+	if (slot == NULL) {
+		atomic_inc(&dropped);
+		return -ENOBUFS;
+	}
+
+	*slot = *record;
+	spsc_produce(&records);
+
+	return 0;
+}
+
+bool gait_records_get(struct gait_record *record)
+{
+	struct gait_record *slot = spsc_consume(&records);
+
+	if (slot == NULL) {
+		return false;
+	}
+
+	*record = *slot;
+	spsc_release(&records);
+
+	return true;
+}
+
+uint32_t gait_records_dropped(void)
+{
+	return atomic_get(&dropped);
+}
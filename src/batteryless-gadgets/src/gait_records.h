@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#ifndef GAIT_RECORDS_H_
+#define GAIT_RECORDS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "gait_events.h"
+#include "imu_features.h"
+#include "zupt.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum gait_record_type {
+	GAIT_RECORD_EVENT,
+	GAIT_RECORD_STRIDE,
+	GAIT_RECORD_ACTIVITY,
+};
+
+/** One result of the sensor processing, on its way to the Bluetooth side. */
+struct gait_record {
+	enum gait_record_type type;
+	union {
+		/** Pressure event, for GAIT_RECORD_EVENT. */
+		struct gait_event event;
+		/** IMU stride, for GAIT_RECORD_STRIDE. */
+		struct {
+			/** Common time of the foot-flat phase ending the stride. */
+			int64_t timestamp_us;
+			struct zupt_stride zupt;
+		} stride;
+		/** IMU step counter and activity, for GAIT_RECORD_ACTIVITY. */
+		struct {
+			/** Common time of the IMU batch it was read with. */
+			int64_t timestamp_us;
+			uint32_t steps;
+			enum imu_activity activity;
+		} activity;
+	};
+};
+
+/**
+ * @brief Queue a record.
+ *
+ * Only called from the sensor processing thread.
+ *
+ * @retval 0 on success.
+ * @retval -ENOBUFS if the queue is full, the record is counted as dropped.
+ */
+int gait_records_put(const struct gait_record *record);
+
+/**
+ * @brief Take the oldest record.
+ *
+ * Only called from the thread sending the records.
+ *
+ * @retval true if a record was taken.
+ */
+bool gait_records_get(struct gait_record *record);
+
+/**
+ * @brief Get the number of records lost to a full queue.
+ */
+uint32_t gait_records_dropped(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* GAIT_RECORDS_H_ */
@@ -0,0 +1,1240 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/bluetooth/conn.h>
+#include <zephyr/bluetooth/gatt.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/byteorder.h>
+
+#include "energy_budget.h"
+#include "frame_codec.h"
+#include "gait_service.h"
+#include "gait_stream.h"
+#include "link_manager.h"
+#if defined(CONFIG_APP_GAIT_SERVICE_LZ4)
+#include "payload_lz4.h"
+#endif
+#if defined(CONFIG_APP_GAIT_CBOR)
+/* Generated from src/common/gait.cddl at build time */
+#include "gait_cbor_encode.h"
+#if defined(CONFIG_APP_BULK_CHANNEL)
+#include "bulk_channel.h"
+#endif
+#endif
+#if defined(CONFIG_APP_SENSOR_LOG)
+#include "sensor_log.h"
+#endif
+
+#define FRAME_SIZE     (sizeof(struct gait_stream_frame))
+#define FRAME_CHANNELS (FRAME_SIZE / sizeof(int16_t))
+#define HEADER_SIZE    (sizeof(struct gait_service_header))
+
+#define ATT_NOTIFY_HDR LINK_MANAGER_ATT_NOTIFY_HDR
+
+/* Wait for TX buffers, about one connection interval. */
+#define RETRY_DELAY K_MSEC(15)
+
+#define PDU_MAX (CONFIG_BT_L2CAP_TX_MTU - ATT_NOTIFY_HDR)
+
+/* The codec takes the frames as rows of int16 */
+BUILD_ASSERT(FRAME_CHANNELS * sizeof(int16_t) == FRAME_SIZE, "frames must not be padded");
+BUILD_ASSERT(HEADER_SIZE + FRAME_CODEC_HEADER_MAX_SIZE + FRAME_CODEC_SAMPLE_MAX_SIZE(FRAME_CHANNELS) <=
+	     PDU_MAX, "MTU too small for one frame");
+
+/* Packet sizes travel to the sent callback in the user data */
+#define SIZES_PACK(len, overhead, frames) ((len) | ((overhead) << 10) | ((frames) << 20))
+#define SIZES_LEN(sizes)                  ((sizes) & 0x3FF)
+#define SIZES_OVERHEAD(sizes)             (((sizes) >> 10) & 0x3FF)
+#define SIZES_FRAMES(sizes)               ((sizes) >> 20)
+
+BUILD_ASSERT(PDU_MAX < 0x400 && GAIT_STREAM_FRAMES < 0x1000, "sizes do not fit the user data");
+
+static struct gait_service_format format = {
+	.version = 4,
+	.frame_size = FRAME_SIZE,
+};
+
+static struct frame_codec_header codec_header = {
+	.channels = FRAME_CHANNELS,
+	.period_ns = NSEC_PER_SEC / GAIT_STREAM_FRAMES,
+	.scale_count = 3,
+	.scales = {
+		{.channels = 3},
+		{.channels = 3},
+		{.channels = DSP_CHAIN_PAD_COUNT, .scale = 1.0f / 32768.0f},
+	},
+};
+
+static ssize_t format_read(struct bt_conn *conn, const struct bt_gatt_attr *attr, void *buf,
+			   uint16_t len, uint16_t offset)
+{
+	return bt_gatt_attr_read(conn, attr, buf, len, offset, &format, sizeof(format));
+}
+
+#if defined(CONFIG_APP_GAIT_CBOR)
+static void records_ccc_changed(const struct bt_gatt_attr *attr, uint16_t value);
+
+#define RECORDS_ATTRS                                                                              \
+	BT_GATT_CHARACTERISTIC(BT_UUID_GAIT_RECORDS, BT_GATT_CHRC_NOTIFY, BT_GATT_PERM_NONE,     \
+			       NULL, NULL, NULL),                                                  \
+	BT_GATT_CCC(records_ccc_changed, BT_GATT_PERM_READ | BT_GATT_PERM_WRITE_ENCRYPT),
+#else
+#define RECORDS_ATTRS
+#endif
+
+#if defined(CONFIG_APP_SENSOR_LOG)
+static ssize_t log_read(struct bt_conn *conn, const struct bt_gatt_attr *attr, void *buf,
+			uint16_t len, uint16_t offset);
+static ssize_t log_write(struct bt_conn *conn, const struct bt_gatt_attr *attr, const void *buf,
+			 uint16_t len, uint16_t offset, uint8_t flags);
+static void log_ccc_changed(const struct bt_gatt_attr *attr, uint16_t value);
+
+#define LOG_ATTRS                                                                                  \
+	BT_GATT_CHARACTERISTIC(BT_UUID_GAIT_LOG,                                                   \
+			       BT_GATT_CHRC_READ | BT_GATT_CHRC_WRITE | BT_GATT_CHRC_NOTIFY,       \
+			       BT_GATT_PERM_READ_ENCRYPT | BT_GATT_PERM_WRITE_ENCRYPT, log_read,   \
+			       log_write, NULL),                                                   \
+	BT_GATT_CCC(log_ccc_changed, BT_GATT_PERM_READ | BT_GATT_PERM_WRITE_ENCRYPT),
+#else
+#define LOG_ATTRS
+#endif
+
+#if defined(CONFIG_APP_GAIT_SERVICE_RELIABLE)
+static ssize_t ack_write(struct bt_conn *conn, const struct bt_gatt_attr *attr, const void *buf,
+			 uint16_t len, uint16_t offset, uint8_t flags);
+
+#define ACK_ATTRS                                                                                  \
+	BT_GATT_CHARACTERISTIC(BT_UUID_GAIT_ACK,                                                   \
+			       BT_GATT_CHRC_WRITE | BT_GATT_CHRC_WRITE_WITHOUT_RESP,               \
+			       BT_GATT_PERM_WRITE_ENCRYPT, NULL, ack_write, NULL),
+#else
+#define ACK_ATTRS
+#endif
+
+BT_GATT_SERVICE_DEFINE(gait_svc,
+	BT_GATT_PRIMARY_SERVICE(BT_UUID_GAIT),
+	BT_GATT_CHARACTERISTIC(BT_UUID_GAIT_STREAM, BT_GATT_CHRC_NOTIFY, BT_GATT_PERM_NONE,
+			       NULL, NULL, NULL),
+	BT_GATT_CCC(NULL, BT_GATT_PERM_READ | BT_GATT_PERM_WRITE_ENCRYPT),
+	BT_GATT_CHARACTERISTIC(BT_UUID_GAIT_FORMAT, BT_GATT_CHRC_READ, BT_GATT_PERM_READ,
+			       format_read, NULL, NULL),
+	RECORDS_ATTRS
+	LOG_ATTRS
+	ACK_ATTRS
+);
+
+#define STREAM_ATTR  (&gait_svc.attrs[2])
+#define RECORDS_ATTR (&gait_svc.attrs[7])
+#define LOG_ATTR     (&gait_svc.attrs[IS_ENABLED(CONFIG_APP_GAIT_CBOR) ? 10 : 7])
+
+static void send_work_handler(struct k_work *work);
+
+static K_WORK_DELAYABLE_DEFINE(send_work, send_work_handler);
+
+static struct bt_conn *stream_conn;
+
+#if defined(CONFIG_APP_GAIT_SERVICE_RELIABLE)
+/* Set by the first acknowledgement of a connection. */
+static atomic_t reliable;
+#endif
+
+static uint8_t burst;
+/* Sequence number of the next batch. */
+static uint16_t seq;
+
+static struct {
+	uint32_t windows;
+	uint32_t skipped;
+	uint32_t logged;
+	uint32_t resent;
+	uint32_t spilled;
+	atomic_t packets;
+	atomic_t raw_bytes;
+	atomic_t payload_bytes;
+	atomic_t overhead_bytes;
+	uint8_t max_burst;
+} stats;
+
+#if defined(CONFIG_APP_GAIT_SERVICE_RELIABLE)
+/* Stream notifications queued and completed. They complete in the order
+ * they were queued, so a window is out once stream_done reaches the count
+ * of its last notification.
+ */
+static uint32_t stream_queued;
+static atomic_t stream_done;
+#endif
+
+static uint32_t rate_bytes;
+static int64_t rate_start;
+
+static void connected(struct bt_conn *conn, uint8_t err)
+{
+	if (!err && stream_conn == NULL) {
+		stream_conn = bt_conn_ref(conn);
+	}
+}
+
+static void disconnected(struct bt_conn *conn, uint8_t reason)
+{
+	ARG_UNUSED(reason);
+
+	if (conn == stream_conn) {
+		bt_conn_unref(stream_conn);
+		stream_conn = NULL;
+#if defined(CONFIG_APP_GAIT_SERVICE_RELIABLE)
+		atomic_set(&reliable, false);
+#endif
+	}
+}
+
+BT_CONN_CB_DEFINE(gait_conn_callbacks) = {
+	.connected = connected,
+	.disconnected = disconnected,
+};
+
+/* The user data carries the sizes, so the counters only move for
+ * notifications that made it over the air.
+ */
+static void sent(struct bt_conn *conn, void *user_data)
+{
+	uintptr_t sizes = (uintptr_t)user_data;
+
+	ARG_UNUSED(conn);
+
+	atomic_inc(&stats.packets);
+#if defined(CONFIG_APP_GAIT_SERVICE_RELIABLE)
+	atomic_inc(&stream_done);
+#endif
+	atomic_add(&stats.raw_bytes, SIZES_FRAMES(sizes) * FRAME_SIZE);
+	atomic_add(&stats.payload_bytes, SIZES_LEN(sizes));
+	atomic_add(&stats.overhead_bytes, SIZES_OVERHEAD(sizes));
+
+	link_manager_tx(HEADER_SIZE + SIZES_LEN(sizes) + ATT_NOTIFY_HDR);
+}
+
+static uint16_t overhead_get(struct bt_conn *conn, uint16_t len)
+{
+	uint16_t tx_octets = LINK_MANAGER_LL_DEFAULT_TX;
+	uint16_t l2cap_len = LINK_MANAGER_L2CAP_HDR + ATT_NOTIFY_HDR + len;
+	uint16_t pdus;
+
+#if defined(CONFIG_BT_USER_DATA_LEN_UPDATE)
+	struct bt_conn_info info;
+
+	if (bt_conn_get_info(conn, &info) == 0) {
+		tx_octets = info.le.data_len->tx_max_len;
+	}
+#endif
+
+	pdus = DIV_ROUND_UP(l2cap_len, tx_octets);
+
+	return HEADER_SIZE + LINK_MANAGER_L2CAP_HDR + ATT_NOTIFY_HDR +
+	       pdus * (LINK_MANAGER_LL_HDR +
+		       (bt_conn_get_security(conn) >= BT_SECURITY_L2 ? LINK_MANAGER_LL_MIC : 0));
+}
+
+#if defined(CONFIG_APP_SENSOR_LOG)
+
+#define LOG_OFFSET_SIZE sizeof(uint32_t)
+
+/* Ranges asked for again that can be queued. */
+#define LOG_RANGES 4
+
+static void log_work_handler(struct k_work *work);
+
+static K_WORK_DELAYABLE_DEFINE(log_work, log_work_handler);
+
+/* Next stream byte to notify, only touched by the work handler. */
+static uint32_t log_offset;
+
+/* Offset written by the central, taken over by the work handler. */
+static atomic_t log_resume;
+static atomic_t log_resume_pending;
+
+struct log_range {
+	uint32_t start;
+	uint32_t end;
+};
+
+/* Ranges asked for again, oldest first. */
+static struct k_spinlock log_lock;
+static struct log_range log_ranges[LOG_RANGES];
+static uint8_t log_range_count;
+
+#define LOG_ENTRY_SIZE sizeof(struct gait_service_log_entry)
+
+/* One window as stored, its entry header and one codec frame. */
+static uint8_t log_batch[LOG_ENTRY_SIZE + FRAME_CODEC_HEADER_MAX_SIZE +
+			 GAIT_STREAM_FRAMES * FRAME_CODEC_SAMPLE_MAX_SIZE(FRAME_CHANNELS)];
+
+static ssize_t log_read(struct bt_conn *conn, const struct bt_gatt_attr *attr, void *buf,
+			uint16_t len, uint16_t offset)
+{
+	struct sensor_log_stats log;
+	struct gait_service_log_range range;
+
+	sensor_log_stats_get(&log);
+	range.start = sys_cpu_to_le32(log.start);
+	range.end = sys_cpu_to_le32(log.end);
+
+	return bt_gatt_attr_read(conn, attr, buf, len, offset, &range, sizeof(range));
+}
+
+static ssize_t log_write(struct bt_conn *conn, const struct bt_gatt_attr *attr, const void *buf,
+			 uint16_t len, uint16_t offset, uint8_t flags)
+{
+	ARG_UNUSED(conn);
+	ARG_UNUSED(attr);
+	ARG_UNUSED(flags);
+
+	if (offset) {
+		return BT_GATT_ERR(BT_ATT_ERR_INVALID_OFFSET);
+	}
+
+	if (len == LOG_OFFSET_SIZE) {
+		atomic_set(&log_resume, sys_get_le32(buf));
+		atomic_set(&log_resume_pending, true);
+	} else if (len == sizeof(struct gait_service_log_range)) {
+		const struct gait_service_log_range *range = buf;
+		bool queued = false;
+
+		K_SPINLOCK(&log_lock) {
+			if (log_range_count < LOG_RANGES) {
+				log_ranges[log_range_count].start = sys_le32_to_cpu(range->start);
+				log_ranges[log_range_count].end = sys_le32_to_cpu(range->end);
+				log_range_count++;
+				queued = true;
+			}
+		}
+
+		if (!queued) {
+			return BT_GATT_ERR(BT_ATT_ERR_INSUFFICIENT_RESOURCES);
+		}
+	} else {
+		return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+	}
+
+	k_work_reschedule(&log_work, K_NO_WAIT);
+
+	return len;
+}
+
+static void log_ccc_changed(const struct bt_gatt_attr *attr, uint16_t value)
+{
+	ARG_UNUSED(attr);
+
+	if (value == BT_GATT_CCC_NOTIFY) {
+		k_work_reschedule(&log_work, K_NO_WAIT);
+	}
+}
+
+static void log_sent(struct bt_conn *conn, void *user_data)
+{
+	ARG_UNUSED(conn);
+
+	link_manager_tx((uintptr_t)user_data + ATT_NOTIFY_HDR);
+}
+
+/* Notifies the log from @p offset up to @p end or the end of the log,
+ * until the TX buffers run out.
+ */
+static int log_notify(struct bt_conn *conn, uint32_t *offset, uint32_t end)
+{
+	static uint8_t pdu[PDU_MAX];
+	uint16_t room = MIN(bt_gatt_get_mtu(conn) - ATT_NOTIFY_HDR, PDU_MAX);
+
+	while (*offset < end) {
+		uint32_t pos = *offset;
+		int len = sensor_log_read(&pos, pdu + LOG_OFFSET_SIZE,
+					  MIN(room - LOG_OFFSET_SIZE, end - *offset));
+
+		if (len <= 0) {
+			return len;
+		}
+
+		sys_put_le32(pos, pdu);
+
+		struct bt_gatt_notify_params params = {
+			.attr = LOG_ATTR,
+			.data = pdu,
+			.len = LOG_OFFSET_SIZE + len,
+			.func = log_sent,
+			.user_data = (void *)(uintptr_t)(LOG_OFFSET_SIZE + len),
+		};
+		int err = bt_gatt_notify_cb(conn, &params);
+
+		if (err) {
+			return err;
+		}
+
+		*offset = pos + len;
+	}
+
+	return 0;
+}
+
+/* Sends the ranges asked for again first, then drains the log. Queues
+ * notifications until the TX buffers run out, and keeps the link on the
+ * short interval until the log is drained.
+ */
+static void log_work_handler(struct k_work *work)
+{
+	struct bt_conn *conn = stream_conn;
+	int err = 0;
+
+	if (atomic_cas(&log_resume_pending, true, false)) {
+		log_offset = atomic_get(&log_resume);
+		sensor_log_release(log_offset);
+	}
+
+	if (conn == NULL || !bt_gatt_is_subscribed(conn, LOG_ATTR, BT_GATT_CCC_NOTIFY)) {
+		link_manager_busy(LINK_MANAGER_SENSOR_LOG, false);
+		return;
+	}
+
+	for (;;) {
+		struct log_range range;
+		bool pending;
+
+		K_SPINLOCK(&log_lock) {
+			pending = log_range_count > 0;
+			range = log_ranges[0];
+		}
+
+		if (!pending) {
+			break;
+		}
+
+		err = log_notify(conn, &range.start, range.end);
+
+		K_SPINLOCK(&log_lock) {
+			if (err == -ENOMEM) {
+				log_ranges[0].start = range.start;
+				K_SPINLOCK_BREAK;
+			}
+
+			log_range_count--;
+			memmove(&log_ranges[0], &log_ranges[1], log_range_count * sizeof(range));
+		}
+
+		if (err == -ENOMEM) {
+			break;
+		}
+	}
+
+	if (err != -ENOMEM) {
+		err = log_notify(conn, &log_offset, UINT32_MAX);
+	}
+
+	if (err == -ENOMEM) {
+		link_manager_busy(LINK_MANAGER_SENSOR_LOG, true);
+		k_work_reschedule(k_work_delayable_from_work(work), RETRY_DELAY);
+		return;
+	}
+
+	link_manager_busy(LINK_MANAGER_SENSOR_LOG, false);
+}
+
+/* Appends the window in log_batch, its entry header and @p len bytes of
+ * codec frame.
+ */
+static bool log_store(uint8_t flags, uint16_t batch, size_t len)
+{
+	struct gait_service_log_entry entry = {
+		.flags = flags,
+		.seq = sys_cpu_to_le16(batch),
+	};
+
+	memcpy(log_batch, &entry, sizeof(entry));
+	if (len == 0 || sensor_log_append(log_batch, LOG_ENTRY_SIZE + len)) {
+		return false;
+	}
+
+	stats.logged++;
+	k_work_schedule(&log_work, K_NO_WAIT);
+
+	return true;
+}
+
+/* Stores a window that could not be sent, or that went out as @p batch if
+ * @p sent. Flash writes are left out on a critical budget, they cost more
+ * than the window is worth then.
+ */
+static bool window_log(const struct gait_stream_window *window, bool sent, uint16_t batch)
+{
+	size_t len;
+
+	if (energy_budget_level_get() == ENERGY_BUDGET_CRITICAL) {
+		return false;
+	}
+
+	codec_header.timestamp_us = window->timestamp_us;
+	len = frame_codec_encode(&codec_header, window->frames[0].acc, GAIT_STREAM_FRAMES,
+				 &log_batch[LOG_ENTRY_SIZE], sizeof(log_batch) - LOG_ENTRY_SIZE);
+
+	return log_store(window->flags | (sent ? GAIT_SERVICE_SENT : 0), sent ? batch : 0, len);
+}
+
+#else
+
+static bool window_log(const struct gait_stream_window *window, bool sent, uint16_t batch)
+{
+	ARG_UNUSED(window);
+	ARG_UNUSED(sent);
+	ARG_UNUSED(batch);
+
+	return false;
+}
+
+#endif /* CONFIG_APP_SENSOR_LOG */
+
+#if defined(CONFIG_APP_GAIT_SERVICE_LZ4)
+
+#define BATCH_WINDOWS CONFIG_APP_GAIT_SERVICE_LZ4_SECONDS
+#define BATCH_SIZE                                                                                 \
+	(BATCH_WINDOWS * (FRAME_CODEC_HEADER_MAX_SIZE +                                            \
+			  GAIT_STREAM_FRAMES * FRAME_CODEC_SAMPLE_MAX_SIZE(FRAME_CHANNELS)))
+
+BUILD_ASSERT(BATCH_WINDOWS * GAIT_STREAM_FRAMES < 0x1000, "sizes do not fit the user data");
+
+/* Codec frames of the windows collected so far, one frame per window. */
+static uint8_t batch[BATCH_SIZE];
+static size_t batch_len;
+static uint8_t batch_windows;
+static uint8_t batch_flags;
+static uint32_t batch_time_s;
+
+/* Where the frame of each window ends in the batch, and its own flags. */
+static size_t batch_ends[BATCH_WINDOWS];
+static uint8_t batch_window_flags[BATCH_WINDOWS];
+
+/* The batch after the compression stage, sent in chunks. */
+static uint8_t block[PAYLOAD_LZ4_BOUND(BATCH_SIZE)];
+static size_t block_len;
+static size_t block_sent;
+static uint8_t block_chunk;
+static bool block_lz4;
+
+static void batch_add(const struct gait_stream_window *window)
+{
+	if (batch_windows == 0) {
+		batch_time_s = window->timestamp_us / USEC_PER_SEC;
+		batch_flags = 0;
+	}
+
+	codec_header.timestamp_us = window->timestamp_us;
+	batch_len += frame_codec_encode(&codec_header, window->frames[0].acc, GAIT_STREAM_FRAMES,
+					&batch[batch_len], sizeof(batch) - batch_len);
+	batch_flags |= window->flags;
+	batch_ends[batch_windows] = batch_len;
+	batch_window_flags[batch_windows] = window->flags;
+	batch_windows++;
+}
+
+/* Stores the windows of a batch that never went out, each from its codec
+ * frame as window_log() would have. Returns how many did not make it.
+ */
+static uint8_t batch_log(void)
+{
+	uint8_t lost = batch_windows;
+
+#if defined(CONFIG_APP_SENSOR_LOG)
+	if (energy_budget_level_get() == ENERGY_BUDGET_CRITICAL) {
+		return lost;
+	}
+
+	for (uint8_t i = 0; i < batch_windows; i++) {
+		size_t start = i ? batch_ends[i - 1] : 0;
+		size_t len = batch_ends[i] - start;
+
+		memcpy(&log_batch[LOG_ENTRY_SIZE], &batch[start], len);
+		if (log_store(batch_window_flags[i], 0, len)) {
+			lost--;
+		}
+	}
+#endif
+
+	return lost;
+}
+
+static void batch_reset(void)
+{
+	batch_len = 0;
+	batch_windows = 0;
+	block_len = 0;
+	block_sent = 0;
+	block_chunk = 0;
+	burst = 0;
+}
+
+/* Queues every chunk of the block in one go, like the windows are queued
+ * without the compression stage.
+ */
+static int block_send(struct bt_conn *conn)
+{
+	static uint8_t pdu[PDU_MAX];
+	uint16_t room = MIN(bt_gatt_get_mtu(conn) - ATT_NOTIFY_HDR, PDU_MAX) - HEADER_SIZE;
+
+	if (DIV_ROUND_UP(block_len, room) > UINT8_MAX + 1) {
+		return -EMSGSIZE;
+	}
+
+	while (block_sent < block_len) {
+		size_t part = MIN(room, block_len - block_sent);
+		bool last = block_sent + part == block_len;
+		struct gait_service_header hdr = {
+			.seq = sys_cpu_to_le16(seq),
+			.flags = batch_flags | GAIT_SERVICE_BLOCK |
+				 (block_lz4 ? GAIT_SERVICE_LZ4 : 0) | (last ? GAIT_SERVICE_LAST : 0),
+			.first = block_chunk,
+			.time_s = sys_cpu_to_le32(batch_time_s),
+		};
+
+		memcpy(pdu, &hdr, sizeof(hdr));
+		memcpy(pdu + HEADER_SIZE, &block[block_sent], part);
+
+		struct bt_gatt_notify_params params = {
+			.attr = STREAM_ATTR,
+			.data = pdu,
+			.len = HEADER_SIZE + part,
+			.func = sent,
+			.user_data = (void *)(uintptr_t)SIZES_PACK(
+				part, overhead_get(conn, HEADER_SIZE + part),
+				last ? batch_windows * GAIT_STREAM_FRAMES : 0),
+		};
+		int err = bt_gatt_notify_cb(conn, &params);
+
+		if (err) {
+			return err;
+		}
+
+		burst++;
+		block_chunk++;
+		block_sent += part;
+	}
+
+	return 0;
+}
+
+static void send_work_handler(struct k_work *work)
+{
+	const struct gait_stream_window *window;
+
+	for (;;) {
+		struct bt_conn *conn = stream_conn;
+		bool subscribed = conn && bt_gatt_is_subscribed(conn, STREAM_ATTR,
+								BT_GATT_CCC_NOTIFY);
+		int err;
+
+		if (block_len == 0) {
+			window = gait_stream_peek();
+			if (window == NULL) {
+				link_manager_busy(LINK_MANAGER_GAIT_STREAM, false);
+				return;
+			}
+
+			if (!subscribed) {
+				stats.skipped += batch_log() + !window_log(window, false, 0);
+				batch_reset();
+				gait_stream_release();
+				continue;
+			}
+
+			batch_add(window);
+			gait_stream_release();
+			if (batch_windows < BATCH_WINDOWS) {
+				continue;
+			}
+
+			block_len = payload_lz4_compress(batch, batch_len, block, sizeof(block),
+							 &block_lz4);
+		}
+
+		err = subscribed ? block_send(conn) : -ENOTCONN;
+
+		if (err == -ENOMEM) {
+			/* Out of TX buffers, carry on with the rest of the
+			 * block once some were sent, on a shorter interval.
+			 */
+			link_manager_busy(LINK_MANAGER_GAIT_STREAM, true);
+			k_work_reschedule(k_work_delayable_from_work(work), RETRY_DELAY);
+			return;
+		}
+
+		/* A block cut short is lost, an unsent one goes to the log */
+		if (err) {
+			stats.skipped += block_chunk ? batch_windows : batch_log();
+		} else {
+			stats.windows += batch_windows;
+			stats.max_burst = MAX(stats.max_burst, burst);
+		}
+
+		/* Every chunk of the block carries its sequence number */
+		if (block_chunk) {
+			seq++;
+		}
+		batch_reset();
+	}
+}
+
+#else
+
+/* Position within the window at the head of the queue. */
+static uint8_t next_frame;
+
+/* Encodes as many frames from @p first on as fit into @p room bytes.
+ * Returns the packet length and sets @p count to the frames it holds.
+ */
+static size_t packet_build(const struct gait_stream_window *window, uint16_t batch, uint8_t *pdu,
+			   uint16_t room, uint8_t first, uint8_t *count)
+{
+	struct gait_service_header hdr = {
+		.seq = sys_cpu_to_le16(batch),
+		.flags = window->flags,
+		.first = first,
+		.time_s = sys_cpu_to_le32(window->timestamp_us / USEC_PER_SEC),
+	};
+	size_t len;
+
+	memcpy(pdu, &hdr, sizeof(hdr));
+
+	codec_header.timestamp_us = window->timestamp_us + first * GAIT_STREAM_PERIOD_US;
+	len = frame_codec_encode(&codec_header, window->frames[first].acc,
+				 GAIT_STREAM_FRAMES - first, pdu + HEADER_SIZE, room - HEADER_SIZE);
+	*count = len ? codec_header.count : 0;
+
+	return HEADER_SIZE + len;
+}
+
+/* Queues every notification of a window in one go, so the controller sends
+ * them back to back in the next connection event. @p next is the first
+ * frame not queued yet.
+ */
+static int window_send(struct bt_conn *conn, const struct gait_stream_window *window,
+		       uint16_t batch, uint8_t *next)
+{
+	static uint8_t pdu[PDU_MAX];
+	uint16_t room = MIN(bt_gatt_get_mtu(conn) - ATT_NOTIFY_HDR, PDU_MAX);
+
+	while (*next < GAIT_STREAM_FRAMES) {
+		uint8_t count;
+		size_t len = packet_build(window, batch, pdu, room, *next, &count);
+
+		if (count == 0) {
+			return -EMSGSIZE;
+		}
+
+		struct bt_gatt_notify_params params = {
+			.attr = STREAM_ATTR,
+			.data = pdu,
+			.len = len,
+			.func = sent,
+			.user_data = (void *)(uintptr_t)SIZES_PACK(len - HEADER_SIZE,
+								    overhead_get(conn, len),
+								    count),
+		};
+		int err = bt_gatt_notify_cb(conn, &params);
+
+		if (err) {
+			return err;
+		}
+
+		burst++;
+#if defined(CONFIG_APP_GAIT_SERVICE_RELIABLE)
+		stream_queued++;
+#endif
+		*next += count;
+	}
+
+	return 0;
+}
+
+#if defined(CONFIG_APP_GAIT_SERVICE_RELIABLE)
+
+#define HELD CONFIG_APP_GAIT_SERVICE_RETRANSMIT_WINDOWS
+
+/* Slots map the whole sequence number space */
+BUILD_ASSERT(IS_POWER_OF_TWO(HELD), "retransmit windows must be a power of two");
+
+/* Windows sent on this connection and not acknowledged yet. The batches
+ * held_first to held_first + held_count - 1 are held, each in the slot of
+ * its sequence number. Only touched by the work handler.
+ */
+static struct {
+	struct gait_stream_window window;
+	bool acked;
+	bool resend;
+	/* Queued and not sent yet, up to notification done_at. */
+	bool in_flight;
+	uint32_t done_at;
+} held[HELD];
+static uint16_t held_first;
+static uint8_t held_count;
+
+/* Batch being resent and the first of its frames not queued yet. */
+static uint16_t resend_batch;
+static uint8_t resend_frame;
+
+/* Latest acknowledgement, in host order, taken over by the work handler. */
+static struct k_spinlock ack_lock;
+static struct gait_service_ack ack;
+static bool ack_pending;
+
+#define HELD_SLOT(batch) (&held[(uint16_t)(batch) % HELD])
+
+static ssize_t ack_write(struct bt_conn *conn, const struct bt_gatt_attr *attr, const void *buf,
+			 uint16_t len, uint16_t offset, uint8_t flags)
+{
+	const struct gait_service_ack *in = buf;
+
+	ARG_UNUSED(attr);
+	ARG_UNUSED(flags);
+
+	if (offset) {
+		return BT_GATT_ERR(BT_ATT_ERR_INVALID_OFFSET);
+	}
+
+	if (len != sizeof(*in)) {
+		return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+	}
+
+	if (conn != stream_conn) {
+		return BT_GATT_ERR(BT_ATT_ERR_WRITE_NOT_PERMITTED);
+	}
+
+	K_SPINLOCK(&ack_lock) {
+		ack.next = sys_le16_to_cpu(in->next);
+		ack.received = sys_le32_to_cpu(in->received);
+		ack_pending = true;
+	}
+
+	atomic_set(&reliable, true);
+	k_work_reschedule(&send_work, K_NO_WAIT);
+
+	return len;
+}
+
+/* Moves the oldest held window out of the way, to the log if it was never
+ * acknowledged. The central finds it there.
+ */
+static void held_spill(void)
+{
+	const struct gait_stream_window *window = &HELD_SLOT(held_first)->window;
+
+	if (!HELD_SLOT(held_first)->acked && window_log(window, true, held_first)) {
+		stats.spilled++;
+	}
+
+	held_first++;
+	held_count--;
+}
+
+static void held_add(const struct gait_stream_window *window, uint16_t batch)
+{
+	if (held_count == HELD) {
+		held_spill();
+	}
+
+	if (held_count == 0) {
+		held_first = batch;
+	}
+
+	HELD_SLOT(batch)->window = *window;
+	HELD_SLOT(batch)->acked = false;
+	HELD_SLOT(batch)->resend = false;
+	HELD_SLOT(batch)->in_flight = true;
+	HELD_SLOT(batch)->done_at = stream_queued;
+	held_count++;
+}
+
+/* Clears the in-flight flag once the last notification of the window
+ * completed.
+ */
+static bool held_in_flight(uint16_t batch)
+{
+	if (HELD_SLOT(batch)->in_flight &&
+	    (int32_t)(atomic_get(&stream_done) - HELD_SLOT(batch)->done_at) >= 0) {
+		HELD_SLOT(batch)->in_flight = false;
+	}
+
+	return HELD_SLOT(batch)->in_flight;
+}
+
+/* Everything before next is acknowledged, and bit i of received stands for
+ * batch next + 1 + i. Held batches below the highest acknowledged one are
+ * missing and sent again, later ones may still be on their way. So may a
+ * window still in the TX queue, an acknowledgement written before it went
+ * out would have it sent twice.
+ */
+static void held_ack(uint16_t next, uint32_t received)
+{
+	uint16_t highest = next + find_msb_set(received);
+
+	for (uint8_t i = 0; i < held_count; i++) {
+		uint16_t batch = held_first + i;
+		int16_t d = (int16_t)(batch - next);
+
+		if (d < 0 || (d > 0 && d <= 32 && (received & BIT(d - 1)))) {
+			HELD_SLOT(batch)->acked = true;
+			HELD_SLOT(batch)->resend = false;
+		} else if ((int16_t)(batch - highest) < 0 && !held_in_flight(batch)) {
+			HELD_SLOT(batch)->resend = true;
+		}
+	}
+
+	while (held_count && HELD_SLOT(held_first)->acked) {
+		held_first++;
+		held_count--;
+	}
+}
+
+/* Queues the missing windows, oldest first. */
+static int held_resend(struct bt_conn *conn)
+{
+	for (uint8_t i = 0; i < held_count; i++) {
+		uint16_t batch = held_first + i;
+		int err;
+
+		if (!HELD_SLOT(batch)->resend) {
+			continue;
+		}
+
+		if (batch != resend_batch) {
+			resend_batch = batch;
+			resend_frame = 0;
+		}
+
+		err = window_send(conn, &HELD_SLOT(batch)->window, batch, &resend_frame);
+		if (err == -ENOMEM) {
+			return err;
+		}
+
+		HELD_SLOT(batch)->resend = false;
+		resend_frame = 0;
+		if (err == 0) {
+			HELD_SLOT(batch)->in_flight = true;
+			HELD_SLOT(batch)->done_at = stream_queued;
+			stats.resent++;
+		}
+	}
+
+	return 0;
+}
+
+/* Takes over the latest acknowledgement and resends what it reports
+ * missing. A connection without acknowledgements holds nothing, what was
+ * held when it ended goes to the log.
+ */
+static int held_process(struct bt_conn *conn)
+{
+	struct gait_service_ack latest;
+	bool pending;
+
+	if (!atomic_get(&reliable)) {
+		while (held_count) {
+			held_spill();
+		}
+		return 0;
+	}
+
+	K_SPINLOCK(&ack_lock) {
+		pending = ack_pending;
+		latest = ack;
+		ack_pending = false;
+	}
+
+	if (pending) {
+		held_ack(latest.next, latest.received);
+	}
+
+	/* Not in the middle of a window, its frames would be interleaved */
+	if (next_frame || conn == NULL ||
+	    !bt_gatt_is_subscribed(conn, STREAM_ATTR, BT_GATT_CCC_NOTIFY)) {
+		return 0;
+	}
+
+	return held_resend(conn);
+}
+
+#else
+
+static int held_process(struct bt_conn *conn)
+{
+	ARG_UNUSED(conn);
+
+	return 0;
+}
+
+#endif /* CONFIG_APP_GAIT_SERVICE_RELIABLE */
+
+static void send_work_handler(struct k_work *work)
+{
+	const struct gait_stream_window *window;
+
+	if (held_process(stream_conn) == -ENOMEM) {
+		link_manager_busy(LINK_MANAGER_GAIT_STREAM, true);
+		k_work_reschedule(k_work_delayable_from_work(work), RETRY_DELAY);
+		return;
+	}
+
+	while ((window = gait_stream_peek()) != NULL) {
+		struct bt_conn *conn = stream_conn;
+		int err = -ENOTCONN;
+
+		if (conn && bt_gatt_is_subscribed(conn, STREAM_ATTR, BT_GATT_CCC_NOTIFY)) {
+			err = window_send(conn, window, seq, &next_frame);
+		}
+
+		/* With the queue full the next window would be dropped, an
+		 * untouched head window goes to the log instead of waiting.
+		 */
+		if (err == -ENOMEM &&
+		    (next_frame > 0 || gait_stream_queued() < CONFIG_APP_GAIT_SERVICE_WINDOWS ||
+		     !window_log(window, false, 0))) {
+			/* Out of TX buffers, carry on with the rest of the
+			 * window once some were sent, on a shorter interval.
+			 */
+			link_manager_busy(LINK_MANAGER_GAIT_STREAM, true);
+			k_work_reschedule(k_work_delayable_from_work(work), RETRY_DELAY);
+			return;
+		}
+
+		if (err == 0) {
+			stats.windows++;
+			stats.max_burst = MAX(stats.max_burst, burst);
+		} else if (err != -ENOMEM && (next_frame > 0 || !window_log(window, false, 0))) {
+			stats.skipped++;
+		}
+
+		/* Any frame sent, the window took a sequence number */
+		if (next_frame > 0) {
+#if defined(CONFIG_APP_GAIT_SERVICE_RELIABLE)
+			if (atomic_get(&reliable)) {
+				held_add(window, seq);
+			}
+#endif
+			seq++;
+		}
+
+		next_frame = 0;
+		burst = 0;
+		gait_stream_release();
+	}
+
+	link_manager_busy(LINK_MANAGER_GAIT_STREAM, false);
+}
+
+#endif /* CONFIG_APP_GAIT_SERVICE_LZ4 */
+
+#if defined(CONFIG_APP_GAIT_CBOR)
+
+/* Largest encoded message, a stride with every field at its widest. */
+#define RECORD_MAX 48
+
+static atomic_t header_pending;
+
+static void records_ccc_changed(const struct bt_gatt_attr *attr, uint16_t value)
+{
+	ARG_UNUSED(attr);
+
+	atomic_set(&header_pending, value == BT_GATT_CCC_NOTIFY);
+}
+
+static int header_encode(uint8_t *buf, size_t size, size_t *len)
+{
+	struct gait_msg_header msg = {
+		.schema = 2,
+		.rate_hz = GAIT_STREAM_FRAMES,
+		.acc_range_g = sys_le16_to_cpu(format.acc_range_g),
+		.gyr_range_dps = sys_le16_to_cpu(format.gyr_range_dps),
+	};
+
+	return cbor_encode_gait_msg_header(buf, size, &msg, len) == ZCBOR_SUCCESS ? 0 : -EINVAL;
+}
+
+static int record_encode(const struct gait_record *record, uint8_t *buf, size_t size,
+			 size_t *len)
+{
+	int err;
+
+	if (record->type == GAIT_RECORD_STRIDE) {
+		struct gait_msg_stride msg = {
+			.timestamp_us = record->stride.timestamp_us,
+			.length_mm = record->stride.zupt.length_mm,
+			.duration_ms = record->stride.zupt.duration_ms,
+			.speed_mm_s = record->stride.zupt.speed_mm_s,
+			.clearance_mm = record->stride.zupt.clearance_mm,
+		};
+
+		err = cbor_encode_gait_msg_stride(buf, size, &msg, len);
+	} else if (record->type == GAIT_RECORD_ACTIVITY) {
+		struct gait_msg_activity msg = {
+			.timestamp_us = record->activity.timestamp_us,
+			.steps = record->activity.steps,
+			.activity = record->activity.activity,
+		};
+
+		err = cbor_encode_gait_msg_activity(buf, size, &msg, len);
+	} else {
+		struct gait_msg_event msg = {
+			.timestamp_us = record->event.timestamp_us,
+			.event = record->event.type,
+			.value_mv = record->event.value_mv,
+		};
+
+		err = cbor_encode_gait_msg_event(buf, size, &msg, len);
+	}
+
+	return err == ZCBOR_SUCCESS ? 0 : -EINVAL;
+}
+
+#if defined(CONFIG_APP_BULK_CHANNEL)
+static bool bulk_header_sent;
+
+static int64_t record_timestamp(const struct gait_record *record)
+{
+	switch (record->type) {
+	case GAIT_RECORD_STRIDE:
+		return record->stride.timestamp_us;
+	case GAIT_RECORD_ACTIVITY:
+		return record->activity.timestamp_us;
+	default:
+		return record->event.timestamp_us;
+	}
+}
+
+/* The encoders write straight into the SDU buffer that L2CAP sends, the
+ * message is never copied.
+ */
+static int record_bulk_write(const struct gait_record *record)
+{
+	int64_t timestamp_us = record_timestamp(record);
+	uint8_t *buf;
+	size_t len = 0;
+	int err;
+
+	if (!bulk_header_sent) {
+		buf = bulk_channel_claim(BULK_CHANNEL_GAIT_RECORD, timestamp_us, RECORD_MAX);
+		if (buf == NULL) {
+			return -ENOBUFS;
+		}
+
+		err = header_encode(buf, RECORD_MAX, &len);
+		bulk_channel_commit(err ? 0 : len);
+		if (err) {
+			return err;
+		}
+		bulk_header_sent = true;
+	}
+
+	buf = bulk_channel_claim(BULK_CHANNEL_GAIT_RECORD, timestamp_us, RECORD_MAX);
+	if (buf == NULL) {
+		return -ENOBUFS;
+	}
+
+	err = record_encode(record, buf, RECORD_MAX, &len);
+	bulk_channel_commit(err ? 0 : len);
+
+	return err;
+}
+#endif
+
+/* bt_gatt_notify() copies the message into an ATT buffer of its own, the
+ * bulk channel is used instead whenever it is open.
+ */
+static int header_notify(struct bt_conn *conn)
+{
+	uint8_t buf[RECORD_MAX];
+	size_t len;
+	int err;
+
+	err = header_encode(buf, sizeof(buf), &len);
+	if (err) {
+		return err;
+	}
+
+	return bt_gatt_notify(conn, RECORDS_ATTR, buf, len);
+}
+
+int gait_service_record(const struct gait_record *record)
+{
+	uint8_t buf[RECORD_MAX];
+	struct bt_conn *conn = stream_conn;
+	size_t len;
+	int err;
+
+#if defined(CONFIG_APP_BULK_CHANNEL)
+	if (bulk_channel_is_open()) {
+		return record_bulk_write(record);
+	}
+	bulk_header_sent = false;
+#endif
+
+	if (conn == NULL || !bt_gatt_is_subscribed(conn, RECORDS_ATTR, BT_GATT_CCC_NOTIFY)) {
+		return -ENOTCONN;
+	}
+
+	if (atomic_cas(&header_pending, true, false)) {
+		err = header_notify(conn);
+		if (err) {
+			atomic_set(&header_pending, true);
+			return err;
+		}
+	}
+
+	err = record_encode(record, buf, sizeof(buf), &len);
+	if (err) {
+		return err;
+	}
+
+	return bt_gatt_notify(conn, RECORDS_ATTR, buf, len);
+}
+
+#endif /* CONFIG_APP_GAIT_CBOR */
+
+static void window_ready(void)
+{
+	k_work_schedule(&send_work, K_NO_WAIT);
+}
+
+void gait_service_init(uint16_t acc_range_g, uint16_t gyr_range_dps)
+{
+	format.acc_range_g = sys_cpu_to_le16(acc_range_g);
+	format.gyr_range_dps = sys_cpu_to_le16(gyr_range_dps);
+	format.rate_hz = sys_cpu_to_le16(GAIT_STREAM_FRAMES);
+
+	codec_header.scales[0].scale = acc_range_g / 32768.0f;
+	codec_header.scales[1].scale = gyr_range_dps / 32768.0f;
+
+	rate_start = k_uptime_get();
+	gait_stream_init(window_ready);
+}
+
+void gait_service_stats_get(struct gait_service_stats *out)
+{
+	int64_t now = k_uptime_get();
+	uint32_t payload = atomic_get(&stats.payload_bytes);
+
+	out->windows = stats.windows;
+	out->skipped = stats.skipped;
+	out->logged = stats.logged;
+	out->resent = stats.resent;
+	out->spilled = stats.spilled;
+	out->packets = atomic_get(&stats.packets);
+	out->raw_bytes = atomic_get(&stats.raw_bytes);
+	out->payload_bytes = payload;
+	out->overhead_bytes = atomic_get(&stats.overhead_bytes);
+	out->max_burst = stats.max_burst;
+	out->payload_bps = now > rate_start ?
+				   (uint64_t)(payload - rate_bytes) * MSEC_PER_SEC / (now - rate_start) :
+				   0;
+
+	rate_bytes = payload;
+	rate_start = now;
+}
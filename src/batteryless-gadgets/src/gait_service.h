@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#ifndef GAIT_SERVICE_H_
+#define GAIT_SERVICE_H_
+
+#include <stdint.h>
+
+#include <zephyr/bluetooth/uuid.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/toolchain.h>
+
+#include "gait_records.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BT_UUID_GAIT_VAL \
+	BT_UUID_128_ENCODE(0x3a1c0001, 0x7b4e, 0x4c2a, 0x9f1d, 0x5e6b2a8c4d10)
+#define BT_UUID_GAIT_STREAM_VAL \
+	BT_UUID_128_ENCODE(0x3a1c0002, 0x7b4e, 0x4c2a, 0x9f1d, 0x5e6b2a8c4d10)
+#define BT_UUID_GAIT_FORMAT_VAL \
+	BT_UUID_128_ENCODE(0x3a1c0003, 0x7b4e, 0x4c2a, 0x9f1d, 0x5e6b2a8c4d10)
+#define BT_UUID_GAIT_RECORDS_VAL \
+	BT_UUID_128_ENCODE(0x3a1c0004, 0x7b4e, 0x4c2a, 0x9f1d, 0x5e6b2a8c4d10)
+#define BT_UUID_GAIT_LOG_VAL \
+	BT_UUID_128_ENCODE(0x3a1c0005, 0x7b4e, 0x4c2a, 0x9f1d, 0x5e6b2a8c4d10)
+#define BT_UUID_GAIT_ACK_VAL \
+	BT_UUID_128_ENCODE(0x3a1c0006, 0x7b4e, 0x4c2a, 0x9f1d, 0x5e6b2a8c4d10)
+
+#define BT_UUID_GAIT         BT_UUID_DECLARE_128(BT_UUID_GAIT_VAL)
+#define BT_UUID_GAIT_STREAM  BT_UUID_DECLARE_128(BT_UUID_GAIT_STREAM_VAL)
+#define BT_UUID_GAIT_FORMAT  BT_UUID_DECLARE_128(BT_UUID_GAIT_FORMAT_VAL)
+#define BT_UUID_GAIT_RECORDS BT_UUID_DECLARE_128(BT_UUID_GAIT_RECORDS_VAL)
+#define BT_UUID_GAIT_LOG     BT_UUID_DECLARE_128(BT_UUID_GAIT_LOG_VAL)
+#define BT_UUID_GAIT_ACK     BT_UUID_DECLARE_128(BT_UUID_GAIT_ACK_VAL)
+
+/**
+ * Header flags next to the window sources. With them set, the notification
+ * holds one chunk of a batch of CONFIG_APP_GAIT_SERVICE_LZ4_SECONDS
+ * windows, and @ref gait_service_header.first is the chunk index. The
+ * chunks put together form the codec frames of the windows, one frame per
+ * window, LZ4 compressed if GAIT_SERVICE_LZ4 is set.
+ */
+#define GAIT_SERVICE_BLOCK BIT(5)
+#define GAIT_SERVICE_LZ4   BIT(6)
+#define GAIT_SERVICE_LAST  BIT(7)
+
+/**
+ * Header of every stream notification, little endian.
+ *
+ * The header is followed by one frame_codec frame, see frame_codec.h, with
+ * as many gait_stream_frame entries as fit into the notification. Each
+ * frame carries the acceleration, rotation and pressure units. Receivers
+ * detect lost batches from gaps in @ref seq, and lost notifications within
+ * a batch from gaps in @ref first.
+ */
+struct gait_service_header {
+	/** Batch sequence number, shared by the notifications of one window,
+	 *  or of one block with GAIT_SERVICE_BLOCK.
+	 */
+	uint16_t seq;
+	/** Sources of the window, GAIT_STREAM_IMU and GAIT_STREAM_PRESSURE. */
+	uint8_t flags;
+	/** Index of the first frame within the window. */
+	uint8_t first;
+	/** Common time of the window in seconds. */
+	uint32_t time_s;
+} __packed;
+
+/** Content of the read-only format characteristic, little endian. */
+struct gait_service_format {
+	uint8_t version;
+	/** Bytes per decoded frame. */
+	uint8_t frame_size;
+	/** Frames per second, a window holds one second. */
+	uint16_t rate_hz;
+	/** Accelerometer full scale in g, 0 without an IMU. */
+	uint16_t acc_range_g;
+	/** Gyroscope full scale in deg/s, 0 without an IMU. */
+	uint16_t gyr_range_dps;
+} __packed;
+
+/** Log entry flag, the window went out as batch @ref gait_service_log_entry.seq. */
+#define GAIT_SERVICE_SENT BIT(4)
+
+/**
+ * Header of every window in the log, little endian.
+ *
+ * A window that left the retransmit hold without an acknowledgement keeps
+ * its batch sequence number, so the central can fill the gap it saw in
+ * the stream.
+ */
+struct gait_service_log_entry {
+	/** Sources of the window, and GAIT_SERVICE_SENT. */
+	uint8_t flags;
+	/** Batch sequence number, only with GAIT_SERVICE_SENT. */
+	uint16_t seq;
+} __packed;
+
+/**
+ * Content of the log characteristic, little endian.
+ *
+ * Windows that could not be sent are stored in flash, each as a
+ * gait_service_log_entry followed by one frame_codec frame of the whole
+ * window. The stored windows form one byte stream, positions in it are
+ * offsets since the log was created.
+ *
+ * A read returns this range. Every notification is the offset of its first
+ * byte, followed by as many bytes of the stream as fit. Writing an offset
+ * acknowledges everything before it and resumes the notifications from
+ * there, so a central writes the end of what it has on every reconnect
+ * and periodically while draining. Writing a range instead has just that
+ * range sent again, ahead of the drain and without acknowledging
+ * anything. Up to four ranges are queued.
+ */
+struct gait_service_log_range {
+	/** Offset of the oldest stored byte. */
+	uint32_t start;
+	/** Offset after the newest stored byte. */
+	uint32_t end;
+} __packed;
+
+/**
+ * Acknowledgement of stream batches, written by the central, little endian.
+ *
+ * The first one on a connection turns on retransmission: from then on
+ * the last CONFIG_APP_GAIT_SERVICE_RETRANSMIT_WINDOWS windows are held
+ * until acknowledged. Held windows below the highest acknowledged batch
+ * are missing and sent again, with their original sequence number, unless
+ * an earlier send of them is still in the TX queue. Windows that leave the
+ * hold without an acknowledgement go to the log with GAIT_SERVICE_SENT.
+ */
+struct gait_service_ack {
+	/** Every batch before this one was received. */
+	uint16_t next;
+	/** Bit i set if batch next + 1 + i was received. */
+	uint32_t received;
+} __packed;
+
+struct gait_service_stats {
+	/** Windows queued completely. */
+	uint32_t windows;
+	/** Windows discarded without a subscriber or with a too small MTU,
+	 *  and not logged.
+	 */
+	uint32_t skipped;
+	/** Windows stored in the log instead. */
+	uint32_t logged;
+	/** Windows sent again on request. */
+	uint32_t resent;
+	/** Windows moved to the log without an acknowledgement. */
+	uint32_t spilled;
+	/** Notifications transmitted. */
+	uint32_t packets;
+	/** Frame bytes transmitted, before encoding. */
+	uint32_t raw_bytes;
+	/** Encoded frame bytes transmitted. */
+	uint32_t payload_bytes;
+	/** Stream header, ATT, L2CAP and link layer bytes of those packets. */
+	uint32_t overhead_bytes;
+	/** Encoded frame bytes per second since the previous call. */
+	uint32_t payload_bps;
+	/** Most notifications queued back to back for one window. */
+	uint8_t max_burst;
+};
+
+/**
+ * @brief Start sending the gait stream windows.
+ *
+ * @param acc_range_g   Accelerometer full scale, reported to the client.
+ * @param gyr_range_dps Gyroscope full scale, reported to the client.
+ */
+void gait_service_init(uint16_t acc_range_g, uint16_t gyr_range_dps);
+
+#if defined(CONFIG_APP_GAIT_CBOR)
+/**
+ * @brief Notify a gait record to the subscriber of the records characteristic.
+ *
+ * Records are CBOR messages of src/common/gait.cddl, one per notification.
+ * While the bulk channel is open they are encoded in place into its SDUs
+ * as BULK_CHANNEL_GAIT_RECORD records instead. Either way the receiver
+ * gets a gait-msg-header first. Called from one thread only.
+ *
+ * @retval 0 on success.
+ * @retval -ENOTCONN if nobody subscribed.
+ * @retval -ENOBUFS if every bulk channel SDU is in flight.
+ * @retval -EINVAL if the record could not be encoded.
+ */
+int gait_service_record(const struct gait_record *record);
+#endif
+
+/**
+ * @brief Get the transfer counters.
+ */
+void gait_service_stats_get(struct gait_service_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* GAIT_SERVICE_H_ */
@@ -0,0 +1,256 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/spsc_lockfree.h>
+
+#include "gait_stream.h"
+
+#define WINDOW_US  ((int64_t)USEC_PER_SEC)
+#define LATENCY_US ((int64_t)CONFIG_APP_GAIT_SERVICE_LATENCY_MS * USEC_PER_MSEC)
+
+/* Samples of the two sources arrive up to a block apart, so one window
+ * collects while the one before waits for the slower source.
+ */
+#define OPEN_WINDOWS 2
+
+#if defined(CONFIG_APP_IMU_FIFO)
+#define SOURCES (GAIT_STREAM_IMU | GAIT_STREAM_PRESSURE)
+#else
+#define SOURCES GAIT_STREAM_PRESSURE
+#endif
+
+BUILD_ASSERT(IS_POWER_OF_TWO(CONFIG_APP_GAIT_SERVICE_WINDOWS),
+	     "queue size must be a power of two");
+
+struct slot {
+	int32_t acc_sum[3];
+	int32_t gyr_sum[3];
+	uint16_t acc_count;
+	uint16_t gyr_count;
+	int16_t pressure[DSP_CHAIN_PAD_COUNT];
+};
+
+struct open_window {
+	/* Seconds of common time. */
+	int64_t index;
+	uint8_t flags;
+	bool used;
+	struct slot slots[GAIT_STREAM_FRAMES];
+};
+
+static struct open_window open_windows[OPEN_WINDOWS];
+
+/* Newest window handed out or dropped, samples for it are late. */
+static int64_t last_index = -1;
+
+/* Common time of the newest sample of each source. */
+static int64_t imu_time_us = -1;
+static int64_t pressure_time_us = -1;
+
+/* The processing thread produces, the Bluetooth side consumes. */
+SPSC_DEFINE(windows, struct gait_stream_window, CONFIG_APP_GAIT_SERVICE_WINDOWS);
+
+static atomic_t dropped;
+static gait_stream_ready_t ready_cb;
+
+static void publish(struct open_window *w)
+{
+	struct gait_stream_window *out = spsc_acquire(&windows);
+
+	last_index = w->index;
+	w->used = false;
+
+	if (out == NULL) {
+		atomic_inc(&dropped);
+		return;
+	}
+
+	out->timestamp_us = w->index * WINDOW_US;
+	out->flags = w->flags;
+
+	for (size_t i = 0; i < GAIT_STREAM_FRAMES; i++) {
+		const struct slot *s = &w->slots[i];
+		struct gait_stream_frame *frame = &out->frames[i];
+
+		for (size_t axis = 0; axis < 3; axis++) {
+			frame->acc[axis] = s->acc_count ? s->acc_sum[axis] / s->acc_count : 0;
+			frame->gyr[axis] = s->gyr_count ? s->gyr_sum[axis] / s->gyr_count : 0;
+		}
+		memcpy(frame->pressure, s->pressure, sizeof(frame->pressure));
+	}
+
+	spsc_produce(&windows);
+
+	if (ready_cb) {
+		ready_cb();
+	}
+}
+
+static struct open_window *oldest_get(void)
+{
+	struct open_window *oldest = NULL;
+
+	for (size_t i = 0; i < OPEN_WINDOWS; i++) {
+		if (open_windows[i].used &&
+		    (oldest == NULL || open_windows[i].index < oldest->index)) {
+			oldest = &open_windows[i];
+		}
+	}
+
+	return oldest;
+}
+
+static struct open_window *window_get(int64_t index)
+{
+	struct open_window *w = &open_windows[index % OPEN_WINDOWS];
+
+	if (index <= last_index || (w->used && w->index > index)) {
+		return NULL;
+	}
+
+	if (w->used && w->index == index) {
+		return w;
+	}
+
+	/* The slot holds an older window, hand it and anything before it
+	 * out with what it has.
+	 */
+	if (w->used) {
+		struct open_window *oldest;
+
+		while ((oldest = oldest_get()) != NULL && oldest->index <= w->index) {
+			publish(oldest);
+		}
+	}
+
+	memset(w, 0, sizeof(*w));
+	w->index = index;
+	w->used = true;
+
+	return w;
+}
+
+static struct slot *slot_get(int64_t time_us, uint8_t source)
+{
+	if (time_us < 0) {
+		return NULL;
+	}
+
+	struct open_window *w = window_get(time_us / WINDOW_US);
+
+	if (w == NULL) {
+		return NULL;
+	}
+
+	w->flags |= source;
+
+	return &w->slots[(time_us % WINDOW_US) * GAIT_STREAM_FRAMES / WINDOW_US];
+}
+
+/* A window is complete once every source has moved past its end. A source
+ * that stopped, like the IMU in low power mode or the pads in idle, only
+ * holds the window back for the latency bound.
+ */
+static void windows_flush(void)
+{
+	struct open_window *w;
+
+	while ((w = oldest_get()) != NULL) {
+		int64_t end = (w->index + 1) * WINDOW_US;
+		int64_t newest = MAX(imu_time_us, pressure_time_us);
+		bool complete = true;
+
+		if ((SOURCES & GAIT_STREAM_IMU) && imu_time_us < end) {
+			complete = false;
+		}
+		if ((SOURCES & GAIT_STREAM_PRESSURE) && pressure_time_us < end) {
+			complete = false;
+		}
+
+		if (!complete && newest < end + LATENCY_US) {
+			return;
+		}
+
+		publish(w);
+	}
+}
+
+void gait_stream_init(gait_stream_ready_t ready)
+{
+	ready_cb = ready;
+}
+
+void gait_stream_imu(const struct imu_fifo_batch *batch)
+{
+	for (size_t i = 0; i < batch->count; i++) {
+		const struct imu_fifo_frame *frame = &batch->frames[i];
+		int64_t t = batch->timestamp_us + (int64_t)i * batch->frame_period_ns / NSEC_PER_USEC;
+		struct slot *s = slot_get(t, GAIT_STREAM_IMU);
+
+		imu_time_us = t;
+		if (s == NULL) {
+			continue;
+		}
+
+		for (size_t axis = 0; axis < 3; axis++) {
+			if (frame->flags & IMU_FIFO_FRAME_ACC) {
+				s->acc_sum[axis] += frame->acc[axis];
+			}
+			if (frame->flags & IMU_FIFO_FRAME_GYR) {
+				s->gyr_sum[axis] += frame->gyr[axis];
+			}
+		}
+		s->acc_count += !!(frame->flags & IMU_FIFO_FRAME_ACC);
+		s->gyr_count += !!(frame->flags & IMU_FIFO_FRAME_GYR);
+	}
+
+	windows_flush();
+}
+
+void gait_stream_pressure(const struct dsp_chain_output *filtered)
+{
+	for (size_t n = 0; n < filtered->count; n++) {
+		int64_t t = filtered->timestamp_us + (int64_t)n * filtered->period_ns / NSEC_PER_USEC;
+		struct slot *s = slot_get(t, GAIT_STREAM_PRESSURE);
+
+		pressure_time_us = t;
+		if (s == NULL) {
+			continue;
+		}
+
+		for (size_t pad = 0; pad < DSP_CHAIN_PAD_COUNT; pad++) {
+			s->pressure[pad] = filtered->pressure[pad][n];
+		}
+	}
+
+	windows_flush();
+}
+
+const struct gait_stream_window *gait_stream_peek(void)
+{
+	return spsc_peek(&windows);
+}
+
+void gait_stream_release(void)
+{
+	if (spsc_consume(&windows) != NULL) {
+		spsc_release(&windows);
+	}
+}
+
+uint32_t gait_stream_queued(void)
+{
+	return spsc_consumable(&windows);
+}
+
+uint32_t gait_stream_dropped(void)
+{
+	return atomic_get(&dropped);
+}
@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#ifndef GAIT_STREAM_H_
+#define GAIT_STREAM_H_
+
+#include <stdint.h>
+
+#include "dsp_chain.h"
+#include "imu_fifo.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Frames per window, a window spans one second of common time. */
+#define GAIT_STREAM_FRAMES CONFIG_APP_GAIT_SERVICE_RATE_HZ
+#define GAIT_STREAM_PERIOD_US (USEC_PER_SEC / GAIT_STREAM_FRAMES)
+
+/** Window flags, set for the sources that contributed to the window. */
+#define GAIT_STREAM_IMU      BIT(0)
+#define GAIT_STREAM_PRESSURE BIT(1)
+
+/** One frame of the aggregated stream. */
+struct gait_stream_frame {
+	/** Accelerometer, mean of the IMU frames in raw counts. */
+	int16_t acc[3];
+	/** Gyroscope, mean of the IMU frames in raw counts. */
+	int16_t gyr[3];
+	/** Filtered pad signals, front and heel, in q15. */
+	int16_t pressure[DSP_CHAIN_PAD_COUNT];
+};
+
+/** One second of frames, aligned on the common timebase. */
+struct gait_stream_window {
+	/** Common time of the first frame, a whole second. */
+	int64_t timestamp_us;
+	/** Source flags. */
+	uint8_t flags;
+	struct gait_stream_frame frames[GAIT_STREAM_FRAMES];
+};
+
+/**
+ * @brief Window notification.
+ *
+ * Called from the sensor processing thread when a window was queued.
+ */
+typedef void (*gait_stream_ready_t)(void);
+
+/**
+ * @brief Set the window notification.
+ */
+void gait_stream_init(gait_stream_ready_t ready);
+
+/**
+ * @brief Add the IMU frames of one FIFO batch.
+ *
+ * The frames are averaged into the stream frames they fall into.
+ */
+void gait_stream_imu(const struct imu_fifo_batch *batch);
+
+/**
+ * @brief Add the filtered pads of one ADC block.
+ *
+ * Each stream frame takes the last pad sample that falls into it.
+ */
+void gait_stream_pressure(const struct dsp_chain_output *filtered);
+
+/**
+ * @brief Get the oldest queued window without taking it.
+ *
+ * Only called from the thread sending the windows.
+ *
+ * @return The window, or NULL if none is queued.
+ */
+const struct gait_stream_window *gait_stream_peek(void);
+
+/**
+ * @brief Free the window returned by gait_stream_peek().
+ */
+void gait_stream_release(void);
+
+/**
+ * @brief Get the number of windows queued, up to CONFIG_APP_GAIT_SERVICE_WINDOWS.
+ */
+uint32_t gait_stream_queued(void);
+
+/**
+ * @brief Get the number of windows dropped because the queue was full.
+ */
+uint32_t gait_stream_dropped(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* GAIT_STREAM_H_ */
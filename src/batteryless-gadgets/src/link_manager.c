@@ -0,0 +1,373 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#include <errno.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/bluetooth/conn.h>
+#include <zephyr/bluetooth/gap.h>
+#include <zephyr/sys/atomic.h>
+
+#include "energy_budget.h"
+#include "link_manager.h"
+
+#define IDLE_DELAY K_MSEC(CONFIG_APP_LINK_MANAGER_IDLE_MS)
+
+/* Time the central has to apply requested parameters before they are
+ * asked for again, doubled after every rejection up to 2^4 times.
+ */
+#define PARAM_WAIT_MS     5000
+#define PARAM_BACKOFF_MAX 4
+
+/* Air time model of the peripheral radio. A PDU carries the preamble,
+ * access address, header and CRC on top of its payload, and the MIC on an
+ * encrypted link. Every connection event is at least one empty exchange,
+ * every data PDU is acknowledged by an empty one.
+ */
+#define T_IFS_US     150
+#define PDU_OVERHEAD 10
+
+/* Connection parameters for each energy budget level, slower links when
+ * the harvester does not keep up.
+ */
+static const struct bt_le_conn_param budget_conn_param[] = {
+	[ENERGY_BUDGET_CRITICAL] = BT_LE_CONN_PARAM_INIT(800, 800, 4, 2000),
+	[ENERGY_BUDGET_DEFICIT] = BT_LE_CONN_PARAM_INIT(320, 400, 2, 600),
+	[ENERGY_BUDGET_NEUTRAL] = BT_LE_CONN_PARAM_INIT(80, 120, 0, 400),
+	[ENERGY_BUDGET_SURPLUS] = BT_LE_CONN_PARAM_INIT(24, 40, 0, 400),
+};
+
+/* While draining a backlog, as many connection events as possible. */
+static const struct bt_le_conn_param fast_conn_param =
+	BT_LE_CONN_PARAM_INIT(CONFIG_APP_LINK_MANAGER_FAST_INTERVAL_MIN,
+			      CONFIG_APP_LINK_MANAGER_FAST_INTERVAL_MAX, 0, 400);
+
+static void params_work_handler(struct k_work *work);
+
+static K_WORK_DELAYABLE_DEFINE(params_work, params_work_handler);
+
+static struct bt_conn *link_conn;
+static atomic_t busy_users;
+
+/* Parameters last requested, only changed by the work handler. Confirmed
+ * once the link runs them.
+ */
+static const struct bt_le_conn_param *requested;
+static int64_t requested_ms;
+static uint8_t rejects;
+static atomic_t confirmed;
+
+struct link_state {
+	int64_t start_ms;
+	/* Idle events are accounted up to here. */
+	int64_t segment_ms;
+	uint64_t radio_us;
+	uint32_t tx_bytes;
+	uint32_t interval_us;
+	uint16_t latency;
+	uint8_t phy;
+	uint16_t tx_octets;
+	uint16_t fast_requests;
+	uint16_t param_rejects;
+};
+
+static struct k_spinlock lock;
+static struct link_state link;
+
+static uint32_t byte_us(uint8_t phy)
+{
+	switch (phy) {
+	case BT_GAP_LE_PHY_2M:
+		return 4;
+	case BT_GAP_LE_PHY_CODED:
+		return 64;
+	default:
+		return 8;
+	}
+}
+
+static uint32_t empty_pdu_us(uint8_t phy)
+{
+	/* The 2M PHY has a two byte preamble */
+	return (PDU_OVERHEAD + (phy == BT_GAP_LE_PHY_2M ? 1 : 0)) * byte_us(phy);
+}
+
+/* Adds the events since the last segment, with the parameters they ran at.
+ * With nothing to send, the peripheral skips latency events in a row.
+ */
+static void segment_close(int64_t now)
+{
+	uint64_t period_us = (uint64_t)link.interval_us * (link.latency + 1);
+
+	if (period_us) {
+		uint64_t events = (uint64_t)(now - link.segment_ms) * USEC_PER_MSEC / period_us;
+
+		link.radio_us += events * (2 * empty_pdu_us(link.phy) + T_IFS_US);
+	}
+	link.segment_ms = now;
+}
+
+static void params_work_handler(struct k_work *work)
+{
+	const struct bt_le_conn_param *param;
+	struct bt_conn *conn = link_conn;
+	int err;
+
+	ARG_UNUSED(work);
+
+	if (conn == NULL) {
+		return;
+	}
+
+	if (atomic_get(&busy_users) && energy_budget_level_get() > ENERGY_BUDGET_CRITICAL) {
+		param = &fast_conn_param;
+	} else {
+		param = &budget_conn_param[energy_budget_level_get()];
+	}
+
+	if (param == requested) {
+		int64_t wait_ms;
+
+		if (atomic_get(&confirmed)) {
+			return;
+		}
+
+		wait_ms = ((int64_t)PARAM_WAIT_MS << MIN(rejects, PARAM_BACKOFF_MAX)) -
+			  (k_uptime_get() - requested_ms);
+		if (wait_ms > 0) {
+			k_work_reschedule(&params_work, K_MSEC(wait_ms));
+			return;
+		}
+
+		/* Nothing matching came back, the central turned it down */
+		rejects++;
+		K_SPINLOCK(&lock) {
+			link.param_rejects++;
+		}
+	} else {
+		rejects = 0;
+		if (param == &fast_conn_param) {
+			K_SPINLOCK(&lock) {
+				link.fast_requests++;
+			}
+		}
+	}
+
+	atomic_set(&confirmed, false);
+	requested = param;
+	requested_ms = k_uptime_get();
+
+	err = bt_conn_le_param_update(conn, param);
+	if (err) {
+		printk("Failed to update connection parameters (err %d)\n", err);
+	}
+
+	/* Checked again once the central had time to apply them */
+	k_work_reschedule(&params_work,
+			  K_MSEC((int64_t)PARAM_WAIT_MS << MIN(rejects, PARAM_BACKOFF_MAX)));
+}
+
+void link_manager_busy(enum link_manager_user user, bool busy)
+{
+	if (busy) {
+		if (!atomic_test_and_set_bit(&busy_users, user)) {
+			k_work_reschedule(&params_work, K_NO_WAIT);
+		}
+	} else if (atomic_test_and_clear_bit(&busy_users, user) && !atomic_get(&busy_users)) {
+		k_work_reschedule(&params_work, IDLE_DELAY);
+	}
+}
+
+void link_manager_tx(uint16_t len)
+{
+	bool encrypted = false;
+	struct bt_conn *conn = link_conn;
+
+	if (conn == NULL) {
+		return;
+	}
+	encrypted = bt_conn_get_security(conn) >= BT_SECURITY_L2;
+
+	K_SPINLOCK(&lock) {
+		uint32_t pdus = DIV_ROUND_UP(len + LINK_MANAGER_L2CAP_HDR, link.tx_octets);
+		uint32_t pdu_us = (PDU_OVERHEAD + (encrypted ? LINK_MANAGER_LL_MIC : 0)) *
+				  byte_us(link.phy);
+
+		link.tx_bytes += len;
+		link.radio_us += (uint64_t)(len + LINK_MANAGER_L2CAP_HDR) * byte_us(link.phy) +
+				 pdus * (pdu_us + 2 * T_IFS_US + empty_pdu_us(link.phy));
+	}
+}
+
+int link_manager_stats_get(struct link_manager_stats *stats)
+{
+	int64_t now = k_uptime_get();
+	int err = 0;
+
+	K_SPINLOCK(&lock) {
+		if (link_conn == NULL) {
+			err = -ENOTCONN;
+			K_SPINLOCK_BREAK;
+		}
+
+		segment_close(now);
+
+		stats->duration_ms = now - link.start_ms;
+		stats->tx_bytes = link.tx_bytes;
+		stats->throughput_bps = stats->duration_ms ?
+			(uint64_t)link.tx_bytes * MSEC_PER_SEC / stats->duration_ms : 0;
+		stats->radio_on_ms = link.radio_us / USEC_PER_MSEC;
+		stats->interval_us = link.interval_us;
+		stats->latency = link.latency;
+		stats->phy = link.phy;
+		stats->tx_octets = link.tx_octets;
+		stats->fast_requests = link.fast_requests;
+		stats->param_rejects = link.param_rejects;
+	}
+
+	return err;
+}
+
+static void connected(struct bt_conn *conn, uint8_t conn_err)
+{
+	struct bt_conn_info info;
+	int64_t now = k_uptime_get();
+	int err;
+
+	if (conn_err || link_conn || bt_conn_get_info(conn, &info)) {
+		return;
+	}
+
+	K_SPINLOCK(&lock) {
+		link = (struct link_state){
+			.start_ms = now,
+			.segment_ms = now,
+			.interval_us = info.le.interval * 1250U,
+			.latency = info.le.latency,
+			.phy = BT_GAP_LE_PHY_1M,
+			.tx_octets = LINK_MANAGER_LL_DEFAULT_TX,
+		};
+	}
+	link_conn = bt_conn_ref(conn);
+	requested = NULL;
+	rejects = 0;
+
+#if defined(CONFIG_BT_USER_PHY_UPDATE)
+	err = bt_conn_le_phy_update(conn, BT_CONN_LE_PHY_PARAM_2M);
+	if (err) {
+		printk("Failed to request the 2M PHY (err %d)\n", err);
+	}
+#endif
+#if defined(CONFIG_BT_USER_DATA_LEN_UPDATE)
+	err = bt_conn_le_data_len_update(conn, BT_LE_DATA_LEN_PARAM_MAX);
+	if (err) {
+		printk("Failed to request the data length (err %d)\n", err);
+	}
+#endif
+
+	k_work_reschedule(&params_work, K_NO_WAIT);
+}
+
+static void disconnected(struct bt_conn *conn, uint8_t reason)
+{
+	struct link_manager_stats stats;
+
+	ARG_UNUSED(reason);
+
+	if (conn != link_conn) {
+		return;
+	}
+
+	if (link_manager_stats_get(&stats) == 0) {
+		printk("Link: %u s, %u B sent, %u B/s, radio on %u ms (%u permille), "
+		       "%u fast requests, %u rejected\n",
+		       stats.duration_ms / MSEC_PER_SEC, stats.tx_bytes, stats.throughput_bps,
+		       stats.radio_on_ms,
+		       stats.duration_ms ? stats.radio_on_ms * 1000U / stats.duration_ms : 0,
+		       stats.fast_requests, stats.param_rejects);
+	}
+
+	bt_conn_unref(link_conn);
+	link_conn = NULL;
+	k_work_cancel_delayable(&params_work);
+}
+
+static void le_param_updated(struct bt_conn *conn, uint16_t interval, uint16_t latency,
+			     uint16_t timeout)
+{
+	const struct bt_le_conn_param *param = requested;
+
+	if (conn != link_conn) {
+		return;
+	}
+
+	/* The central may pick any interval in the range and less latency */
+	if (param && interval >= param->interval_min && interval <= param->interval_max &&
+	    latency <= param->latency && timeout == param->timeout) {
+		atomic_set(&confirmed, true);
+	}
+
+	K_SPINLOCK(&lock) {
+		segment_close(k_uptime_get());
+		link.interval_us = interval * 1250U;
+		link.latency = latency;
+	}
+}
+
+#if defined(CONFIG_BT_USER_PHY_UPDATE)
+static void le_phy_updated(struct bt_conn *conn, struct bt_conn_le_phy_info *param)
+{
+	if (conn != link_conn) {
+		return;
+	}
+
+	K_SPINLOCK(&lock) {
+		segment_close(k_uptime_get());
+		link.phy = param->tx_phy;
+	}
+}
+#endif
+
+#if defined(CONFIG_BT_USER_DATA_LEN_UPDATE)
+static void le_data_len_updated(struct bt_conn *conn, struct bt_conn_le_data_len_info *info)
+{
+	if (conn != link_conn) {
+		return;
+	}
+
+	K_SPINLOCK(&lock) {
+		link.tx_octets = info->tx_max_len;
+	}
+}
+#endif
+
+BT_CONN_CB_DEFINE(link_conn_callbacks) = {
+	.connected = connected,
+	.disconnected = disconnected,
+	.le_param_updated = le_param_updated,
+#if defined(CONFIG_BT_USER_PHY_UPDATE)
+	.le_phy_updated = le_phy_updated,
+#endif
+#if defined(CONFIG_BT_USER_DATA_LEN_UPDATE)
+	.le_data_len_updated = le_data_len_updated,
+#endif
+};
+
+static void energy_budget_changed(enum energy_budget_level level)
+{
+	ARG_UNUSED(level);
+
+	k_work_schedule(&params_work, K_NO_WAIT);
+}
+
+static struct energy_budget_listener budget_listener = {
+	.cb = energy_budget_changed,
+};
+
+void link_manager_init(void)
+{
+	energy_budget_listener_add(&budget_listener);
+}
@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#ifndef LINK_MANAGER_H_
+#define LINK_MANAGER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Bytes the lower layers add to application data: the ATT opcode and handle
+ * of a notification, the L2CAP length and channel, the SDU length of the
+ * first PDU on a credit-based channel, and per link layer PDU the header
+ * and, on an encrypted link, the MIC. Link layer payloads are 27 bytes
+ * until the data length is updated.
+ */
+#define LINK_MANAGER_ATT_NOTIFY_HDR 3
+#define LINK_MANAGER_L2CAP_HDR      4
+#define LINK_MANAGER_L2CAP_SDU_HDR  2
+#define LINK_MANAGER_LL_HDR         2
+#define LINK_MANAGER_LL_MIC         4
+#define LINK_MANAGER_LL_DEFAULT_TX  27
+
+/** Senders that can hold a backlog. */
+enum link_manager_user {
+	LINK_MANAGER_GAIT_STREAM,
+	LINK_MANAGER_BULK_CHANNEL,
+	LINK_MANAGER_MDS,
+	LINK_MANAGER_SENSOR_LOG,
+};
+
+struct link_manager_stats {
+	/** Time since the connection was established. */
+	uint32_t duration_ms;
+	/** Application bytes handed to the host for sending. */
+	uint32_t tx_bytes;
+	/** tx_bytes over the duration. */
+	uint32_t throughput_bps;
+	/** Estimated time the radio was on for the connection. */
+	uint32_t radio_on_ms;
+	/** Current connection interval. */
+	uint32_t interval_us;
+	uint16_t latency;
+	/** Current TX PHY, BT_GAP_LE_PHY_*. */
+	uint8_t phy;
+	/** Current longest TX link layer payload. */
+	uint16_t tx_octets;
+	/** Times the fast parameters were requested. */
+	uint16_t fast_requests;
+	/** Requests the central rejected or answered with other parameters. */
+	uint16_t param_rejects;
+};
+
+/**
+ * @brief Start managing connections.
+ *
+ * Every new connection is moved to the 2M PHY and the longest data length.
+ * The connection parameters follow the energy budget while nothing is
+ * queued, and switch to a short interval without latency while a user
+ * reports a backlog.
+ */
+void link_manager_init(void);
+
+/**
+ * @brief Report whether a user has data waiting to be sent.
+ *
+ * The short interval is requested right away. The budget parameters come
+ * back once no user has been busy for CONFIG_APP_LINK_MANAGER_IDLE_MS.
+ * Can be called from any thread.
+ */
+void link_manager_busy(enum link_manager_user user, bool busy);
+
+/**
+ * @brief Account bytes handed to the host for sending.
+ *
+ * @param len Bytes of one notification or SDU, with its ATT or L2CAP
+ *            header.
+ */
+void link_manager_tx(uint16_t len);
+
+/**
+ * @brief Get the counters of the current connection.
+ *
+ * @retval 0 on success.
+ * @retval -ENOTCONN if there is no connection.
+ */
+int link_manager_stats_get(struct link_manager_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LINK_MANAGER_H_ */
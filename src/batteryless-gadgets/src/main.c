@@ -4,6 +4,8 @@
  * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
  */
 
+#include <string.h>
+
 #include <zephyr/kernel.h>
 #include <zephyr/bluetooth/bluetooth.h>
 #include <zephyr/bluetooth/conn.h>
@@ -23,26 +25,70 @@
 #include <memfault/core/platform/core.h>
 #include "memfault/metrics/platform/overrides.h"
 #include "memfault/core/data_export.h"
+#include "memfault/core/data_packetizer.h"
+
+#include "adc_channels.h"
+#include "adc_conv.h"
+#if defined(CONFIG_APP_SENSOR_PIPELINE)
+#include "sensor_pipeline.h"
+#endif
+#if defined(CONFIG_APP_ADC_STREAM)
+#include "adc_stream.h"
+#endif
+#if defined(CONFIG_APP_GAIT_EVENTS)
+#include "gait_events.h"
+#endif
+#if defined(CONFIG_APP_DSP_CHAIN)
+#include "dsp_chain.h"
+#endif
+#if defined(CONFIG_APP_IMU_FIFO)
+#include <zephyr/drivers/sensor.h>
+#include "imu_fifo.h"
+#endif
+#if defined(CONFIG_APP_IMU_FEATURES)
+#include "imu_features.h"
+#endif
+#if defined(CONFIG_APP_IMU_POWER)
+#include "imu_power.h"
+#endif
+#if defined(CONFIG_APP_IMU_FUSION)
+#include "fusion.h"
+#endif
+#if defined(CONFIG_APP_ZUPT)
+#include "zupt.h"
+#endif
+#if defined(CONFIG_APP_ZUPT_PRESSURE_GATE)
+#include "zupt_gate.h"
+#endif
+#if defined(CONFIG_APP_GAIT_SERVICE)
+#include "gait_stream.h"
+#include "gait_service.h"
+#endif
+#if defined(CONFIG_APP_BULK_CHANNEL)
+#include "bulk_channel.h"
+#endif
+#if defined(CONFIG_APP_SENSOR_LOG)
+#include "sensor_log.h"
+#endif
+#if defined(CONFIG_APP_PAYLOAD_LZ4)
+#include <zephyr/timing/timing.h>
+#include "payload_lz4.h"
+#endif
+#include "gait_records.h"
+#include "fuel_gauge.h"
+#include "energy_budget.h"
+#include "checkpoint.h"
+#include "link_manager.h"
 
 // -------------------------- ADC ----------------
-#define ADC_DEVICE_NAME     DT_NODELABEL(arduino_adc)
-#define ADC_RESOLUTION		12  // nRF52840 supports up to 12-bit resolution
-#define ADC_GAIN            ADC_GAIN_1
-#define ADC_REFERENCE       ADC_REF_INTERNAL
-#define ADC_ACQUISITION_TIME  ADC_ACQ_TIME(ADC_ACQ_TIME_MICROSECONDS, 10)
-#define ADC_CHANNEL_ID      1  // AIN1 corresponds to channel 1
-
-// Buffer for ADC sampling
-static int16_t sample_buffer;
-
-struct adc_channel_cfg adc_channel_cfg = {
-    .gain             = ADC_GAIN_1_6,
-    .reference        = ADC_REFERENCE,
-    .acquisition_time = ADC_ACQUISITION_TIME,
-    .channel_id       = ADC_CHANNEL_ID,
-    .differential     = 0,
-    .input_positive   = SAADC_CH_PSELP_PSELP_AnalogInput1 // differential SAADC_CH_PSELN_PSELN_AnalogInput1
-};
+// Channels come from the io-channels of the zephyr,user node, see
+// boards/nrf52840dk_nrf52840.overlay and adc_channels.h
+#define ADC_RESOLUTION      ADC_CHANNELS_RESOLUTION
+
+#if !defined(CONFIG_APP_ADC_STREAM)
+// Buffer for ADC sampling, one scan of every channel in adc_channels order
+static int16_t sample_buffer[ADC_CHANNELS_COUNT];
+#endif
 
 // --------------------- ADC -------------------
 
@@ -53,9 +99,13 @@ struct adc_channel_cfg adc_channel_cfg = {
 #define CON_STATUS_LED DK_LED2
 
 #define RUN_LED_BLINK_INTERVAL 200
+#define BAS_UPDATE_INTERVAL    1000
 
 uint32_t button_press_count;
 
+static struct checkpoint_section app_section =
+	CHECKPOINT_SECTION_INIT(CHECKPOINT_ID(CHECKPOINT_OWNER_APP, 0), button_press_count);
+
 static const struct bt_data ad[] = {
 	BT_DATA_BYTES(BT_DATA_FLAGS, (BT_LE_AD_GENERAL | BT_LE_AD_NO_BREDR)),
 	BT_DATA_BYTES(BT_DATA_UUID128_ALL, BT_UUID_MDS_VAL),
@@ -68,8 +118,6 @@ static const struct bt_data sd[] = {
 static struct bt_conn *pairing_confirmation_conn;
 static struct bt_conn *mds_conn;
 
-static int batterylvl = 100;
-
 // void memfault_platform_boot(void) {
 //     memfault_boot();
 // }
@@ -80,70 +128,648 @@ static K_WORK_DELAYABLE_DEFINE(bas_work, bas_work_handler);
 
 // --------------------- ADC ----------------------
 
-// Setup ADC configuration
-void configure_adc(void)
+#if defined(CONFIG_APP_ADC_STREAM)
+
+#define ADC_STREAM_REPORT_BLOCKS \
+	DIV_ROUND_UP(CONFIG_APP_ADC_STREAM_SAMPLE_RATE_HZ, CONFIG_APP_ADC_STREAM_BLOCK_SAMPLES)
+
+#if defined(CONFIG_APP_GAIT_EVENTS)
+// Called from the sensor pipeline thread, the console and Memfault are
+// left to the main loop
+static void gait_event_handler(const struct gait_event *evt)
 {
-    const struct device *adc_dev = DEVICE_DT_GET(DT_NODELABEL(adc));
-	// printk("1");
-    if (!adc_dev) {
-        printk("ADC device not found");
+    struct gait_record record = {
+        .type  = GAIT_RECORD_EVENT,
+        .event = *evt,
+    };
+
+#if defined(CONFIG_APP_IMU_POWER)
+    // A step on the pads wakes the IMU before it notices the motion itself
+    if (evt->type == GAIT_EVENT_HEEL_STRIKE) {
+        imu_power_activity_report();
+    }
+#endif
+
+    gait_records_put(&record);
+}
+#endif
+
+// Called from the sensor pipeline thread for every full DMA buffer
+static void piezo_block_handler(const struct adc_stream_block *block)
+{
+#if defined(CONFIG_APP_BULK_CHANNEL)
+    bulk_channel_write(BULK_CHANNEL_ADC, block->timestamp_us, block->samples,
+                       block->count * sizeof(block->samples[0]));
+#endif
+
+#if defined(CONFIG_APP_GAIT_EVENTS)
+    gait_events_process(block);
+#endif
+
+#if defined(CONFIG_APP_ZUPT_PRESSURE_GATE)
+    // The loading is known up to the last frame of the block now
+    if (block->count >= block->channels) {
+        zupt_gate_pads(block->timestamp_us +
+                       (int64_t)(block->count / block->channels - 1) * block->frame_period_ns /
+                       NSEC_PER_USEC);
+    }
+#endif
+
+#if defined(CONFIG_APP_DSP_CHAIN)
+    static struct dsp_chain_output filtered;
+
+    dsp_chain_process(block, &filtered);
+    energy_budget_harvest_block(&filtered);
+#if defined(CONFIG_APP_GAIT_SERVICE)
+    gait_stream_pressure(&filtered);
+#endif
+#endif
+
+    size_t frames = block->count / block->channels;
+    int32_t sum[ADC_CHANNELS_COUNT] = {0};
+    int32_t vdd_sum = 0;
+    int32_t vbat_sum = 0;
+
+    for (size_t i = 0; i < block->count; i += block->channels) {
+        vdd_sum += block->samples[i + ADC_CHANNEL_VDD];
+        vbat_sum += block->samples[i + ADC_CHANNEL_VBAT];
+    }
+    if (frames) {
+        int32_t vdd_mv = adc_conv_to_mv(ADC_CHANNEL_VDD, vdd_sum / (int32_t)frames);
+
+        fuel_gauge_vdd_report(vdd_mv);
+        fuel_gauge_vbat_report(adc_conv_to_mv(ADC_CHANNEL_VBAT, vbat_sum / (int32_t)frames));
+        checkpoint_vdd_report(vdd_mv);
+    }
+    checkpoint_progress(1);
+
+    // Roughly once a second is plenty for the console
+    if ((block->seq % ADC_STREAM_REPORT_BLOCKS) != 0 || frames == 0) {
         return;
     }
-	// printk("2");
-    int err = adc_channel_setup(adc_dev, &adc_channel_cfg);
-	// printk("3");
-    if (err < 0) {
-        printk("Error in ADC channel setup: %d", err);
+
+    for (size_t i = 0; i < block->count; i++) {
+        sum[i % block->channels] += block->samples[i];
+    }
+
+    struct adc_stream_stats stats;
+
+    adc_stream_stats_get(&stats);
+    printk("ADC block %u (overruns %u):", block->seq, stats.overruns);
+    for (size_t ch = 0; ch < ADC_CHANNELS_COUNT; ch++) {
+        int16_t mean = sum[ch] / (int32_t)frames;
+
+        printk(" %s %d mV", adc_channels[ch].name, adc_conv_to_mv(ch, mean));
+    }
+    printk("\n");
+
+#if defined(CONFIG_APP_DSP_CHAIN)
+    printk("DSP: %u cycles, front energy %lld, heel energy %lld\n", filtered.cycles,
+           filtered.energy[DSP_CHAIN_PAD_FRONT], filtered.energy[DSP_CHAIN_PAD_HEEL]);
+#endif
+}
+
+static void piezo_buf_process(const uint8_t *buf, size_t len)
+{
+    struct adc_stream_block block;
+
+    if (adc_stream_decode(buf, len, &block) == 0) {
+        piezo_block_handler(&block);
+    }
+}
+
+static struct sensor_pipeline_source piezo_source = {
+    .iodev   = &adc_stream_iodev,
+    .process = piezo_buf_process,
+    .depth   = CONFIG_APP_ADC_STREAM_READS,
+};
+
+#else
+
+// Setup every channel of the scan
+void configure_adc(void)
+{
+    const struct device *adc_dev = DEVICE_DT_GET(ADC_CHANNELS_CTLR_NODE);
+    if (!device_is_ready(adc_dev)) {
+        printk("ADC device not ready\n");
         return;
     }
+
+    for (size_t i = 0; i < ADC_CHANNELS_COUNT; i++) {
+        const struct adc_channel_desc *desc = &adc_channels[i];
+        struct adc_channel_cfg channel_cfg = {
+            .gain             = desc->gain,
+            .reference        = desc->reference,
+            .acquisition_time = desc->acquisition_time,
+            .channel_id       = desc->channel_id,
+            .differential     = desc->input_negative != 0,
+            .input_positive   = desc->input_positive,
+            .input_negative   = desc->input_negative,
+        };
+
+        int err = adc_channel_setup(adc_dev, &channel_cfg);
+        if (err < 0) {
+            printk("Error in ADC channel %s setup: %d\n", desc->name, err);
+            return;
+        }
+    }
 }
 
 
+// Sample all channels in one scan and return the front pad voltage in mV
 int read_adc_sample(void)
 {
-	// printk("4");
-    const struct device *adc_dev = DEVICE_DT_GET(DT_NODELABEL(adc));
-    if (!adc_dev) {
-        printk("ADC device not found");
+    static bool calibrated;
+
+    const struct device *adc_dev = DEVICE_DT_GET(ADC_CHANNELS_CTLR_NODE);
+    if (!device_is_ready(adc_dev)) {
+        printk("ADC device not ready\n");
         return -ENODEV;
     }
-	// printk("5");
+
     struct adc_sequence sequence = {
-        .channels    = BIT(ADC_CHANNEL_ID),
-        .buffer      = &sample_buffer,
-        .buffer_size = sizeof(sample_buffer),
-        .resolution  = ADC_RESOLUTION,
+        .channels     = adc_channels_mask(),
+        .buffer       = sample_buffer,
+        .buffer_size  = sizeof(sample_buffer),
+        .resolution   = ADC_RESOLUTION,
+        .oversampling = ADC_CHANNELS_OVERSAMPLING,
+        // SAADC offset calibration once, the factory trim does the rest
+        .calibrate    = !calibrated,
     };
-	// printk("6");
+
     int err = adc_read(adc_dev, &sequence);
-	// printk("7");
     if (err < 0) {
-        printk("Error in ADC read: %d", err);
+        printk("Error in ADC read: %d\n", err);
         return err;
     }
-	// printk("8");
-    // Convert the raw ADC value to a voltage (in millivolts)
-    int16_t raw_value = sample_buffer;
+    calibrated = true;
+
+    for (size_t i = 0; i < ADC_CHANNELS_COUNT; i++) {
+        printk("ADC %s: %d, Voltage: %d mV\n", adc_channels[i].name, sample_buffer[i],
+               adc_conv_to_mv(i, sample_buffer[i]));
+    }
+
+    int32_t vdd_mv = adc_conv_to_mv(ADC_CHANNEL_VDD, sample_buffer[ADC_CHANNEL_VDD]);
+
+    fuel_gauge_vdd_report(vdd_mv);
+    fuel_gauge_vbat_report(adc_conv_to_mv(ADC_CHANNEL_VBAT, sample_buffer[ADC_CHANNEL_VBAT]));
+    checkpoint_vdd_report(vdd_mv);
+    checkpoint_progress(1);
+
+    return adc_conv_to_mv(ADC_CHANNEL_FRONT, sample_buffer[ADC_CHANNEL_FRONT]);
+}
+
+#endif /* CONFIG_APP_ADC_STREAM */
+
+// --------------------- ADC ----------------------
+
+// --------------------- IMU ----------------------
+
+#if defined(CONFIG_APP_IMU_FIFO)
+
+#if defined(CONFIG_APP_ZUPT)
+// The foot swing saturates 2 g and 500 deg/s
+#define IMU_ACC_RANGE_G   16
+#define IMU_GYR_RANGE_DPS 2000
+#else
+#define IMU_ACC_RANGE_G   2
+#define IMU_GYR_RANGE_DPS 500
+#endif
+
+// Raw counts per g, and rad/s per raw count
+#define IMU_ACC_LSB_PER_G (32768.0f / IMU_ACC_RANGE_G)
+#define IMU_GYR_SCALE     (IMU_GYR_RANGE_DPS / 32768.0f * (3.14159265f / 180.0f))
+
+#if defined(CONFIG_APP_IMU_FUSION)
+static struct fusion foot_fusion;
+
+static const struct fusion_config foot_fusion_config = {
+    .gyr_scale     = IMU_GYR_SCALE,
+    .acc_lsb_per_g = IMU_ACC_LSB_PER_G,
+    .odr_hz        = MAX(CONFIG_APP_IMU_ACC_ODR_HZ, CONFIG_APP_IMU_GYR_ODR_HZ),
+    .output_hz     = CONFIG_APP_IMU_FUSION_OUTPUT_HZ,
+};
+#endif
+
+#if defined(CONFIG_APP_ZUPT)
+static struct zupt foot_zupt;
+
+// Called from zupt_update() at every foot-flat phase
+static void stride_handler(const struct zupt_stride *stride)
+{
+    struct gait_record record = {
+        .type   = GAIT_RECORD_STRIDE,
+        .stride = {
+            .timestamp_us = imu_fifo_time_us(stride->sensortime),
+            .zupt         = *stride,
+        },
+    };
+
+    gait_records_put(&record);
+}
+#endif
+
+#if defined(CONFIG_APP_IMU_POWER)
+static atomic_t imu_woken;
+
+// Called from the IMU work queue after every mode change
+static void imu_power_handler(enum imu_power_mode mode)
+{
+    fuel_gauge_load_set(FUEL_GAUGE_LOAD_IMU, mode == IMU_POWER_PERF);
+
+    if (mode == IMU_POWER_PERF) {
+        atomic_set(&imu_woken, 1);
+    }
+}
+
+static const struct imu_power_config imu_power_config = {
+    .acc_lsb_per_g = IMU_ACC_LSB_PER_G,
+    .gyr_scale     = IMU_GYR_SCALE,
+    .changed       = imu_power_handler,
+};
+#endif
+
+#if defined(CONFIG_APP_IMU_FEATURES)
+// Latest counters of the feature engine, taken to the gait records by the
+// sensor pipeline thread with the next IMU batch
+static atomic_t imu_steps;
+static atomic_t imu_activity;
+static atomic_t imu_features_pending;
+
+// Called from the IMU work queue, which also drains the FIFO, so it only
+// passes the motion and the counters on
+static void imu_features_handler(const struct imu_features_event *evt)
+{
+    if (evt->status & (IMU_FEATURES_STEP | IMU_FEATURES_ACTIVITY)) {
+        atomic_set(&imu_steps, evt->steps);
+        atomic_set(&imu_activity, evt->activity);
+        atomic_set(&imu_features_pending, 1);
+    }
 
-	// Vref (set to internal voltage reference of the device, or set your own)
-    float vref = 0.6;  // Internal reference voltage, for example
+#if defined(CONFIG_APP_IMU_POWER)
+    if ((evt->status & IMU_FEATURES_ANY_MOTION) ||
+        ((evt->status & IMU_FEATURES_ACTIVITY) && evt->activity != IMU_ACTIVITY_STILL)) {
+        imu_power_activity_report();
+    }
+#endif
+}
+#endif
 
-    // ADC Max Value for signed 12-bit resolution is 2047 (2^11 - 1)
-    float adc_max_value = (1 << (ADC_RESOLUTION));  // 2047 for 12-bit
+#if defined(CONFIG_APP_BULK_CHANNEL)
+// Raw frames for capture sessions, accelerometer and gyroscope only
+static void imu_bulk_write(const struct imu_fifo_batch *batch)
+{
+    static int16_t chunk[32][6];
 
-    // Apply the conversion formula to get the voltage in millivolts
-    double millivolts = (raw_value / adc_max_value) * vref * 6;
+    for (size_t i = 0; i < batch->count && bulk_channel_is_open(); i += ARRAY_SIZE(chunk)) {
+        size_t count = MIN(batch->count - i, ARRAY_SIZE(chunk));
+        int64_t t = batch->timestamp_us + (int64_t)i * batch->frame_period_ns / NSEC_PER_USEC;
 
-    // int16_t millivolts = raw_value * 0.6 / (2<<(ADC_RESOLUTION-1));
-	// int16_t millivolts = raw_value * ADC_GAIN / ADC_REFERENCE * (2<<(ADC_RESOLUTION));
+        for (size_t n = 0; n < count; n++) {
+            memcpy(&chunk[n][0], batch->frames[i + n].acc, sizeof(batch->frames[0].acc));
+            memcpy(&chunk[n][3], batch->frames[i + n].gyr, sizeof(batch->frames[0].gyr));
+        }
+        bulk_channel_write(BULK_CHANNEL_IMU, t, chunk, count * sizeof(chunk[0]));
+    }
+}
+#endif
 
+// Called from the sensor pipeline thread for every FIFO burst
+static void imu_batch_handler(const struct imu_fifo_batch *batch)
+{
+#if defined(CONFIG_APP_IMU_FEATURES)
+    if (atomic_clear(&imu_features_pending)) {
+        struct gait_record record = {
+            .type     = GAIT_RECORD_ACTIVITY,
+            .activity = {
+                .timestamp_us = batch->timestamp_us,
+                .steps        = atomic_get(&imu_steps),
+                .activity     = atomic_get(&imu_activity),
+            },
+        };
+
+        gait_records_put(&record);
+    }
+#endif
+
+#if defined(CONFIG_APP_BULK_CHANNEL)
+    imu_bulk_write(batch);
+#endif
 
-    printk("ADC Reading: %d, Voltage: %.3f V \n", raw_value, millivolts);
+#if defined(CONFIG_APP_GAIT_SERVICE)
+    gait_stream_imu(batch);
+#endif
 
-    return millivolts;
+#if defined(CONFIG_APP_IMU_POWER)
+    imu_power_batch(batch);
+
+    // Without the gyroscope there is nothing to fuse
+    if (imu_power_mode_get() == IMU_POWER_LOW) {
+        return;
+    }
+
+    // The orientation went stale while the gyroscope was off
+    if (atomic_clear(&imu_woken)) {
+#if defined(CONFIG_APP_IMU_FUSION)
+        fusion_init(&foot_fusion, &foot_fusion_config);
+#endif
+#if defined(CONFIG_APP_ZUPT)
+        zupt_init(&foot_zupt, stride_handler);
+#endif
+#if defined(CONFIG_APP_ZUPT_PRESSURE_GATE)
+        zupt_gate_init(&foot_zupt, &foot_fusion);
+#endif
+    }
+#endif
+
+#if defined(CONFIG_APP_ZUPT_PRESSURE_GATE)
+    zupt_gate_imu(batch);
+#elif defined(CONFIG_APP_ZUPT)
+    zupt_update(&foot_zupt, &foot_fusion, batch->frames, batch->count);
+#elif defined(CONFIG_APP_IMU_FUSION)
+    fusion_update(&foot_fusion, batch->frames, batch->count);
+#endif
 }
 
-// --------------------- ADC ----------------------
+BUILD_ASSERT(!IS_ENABLED(CONFIG_APP_IMU_FIFO_THREAD), "the sensor pipeline queues the IMU reads");
+
+static struct sensor_pipeline_source imu_source = {
+    .iodev   = &imu_fifo_iodev,
+    .process = imu_fifo_process,
+    .depth   = IMU_FIFO_READS,
+};
+
+// Ranges and rates through the driver, the FIFO is set up by imu_fifo
+static int imu_start(void)
+{
+    const struct device *const dev = DEVICE_DT_GET_ONE(bosch_bmi270);
+    struct sensor_value full_scale = {.val1 = IMU_ACC_RANGE_G};
+    struct sensor_value oversampling = {.val1 = 1};
+    struct sensor_value odr = {.val1 = CONFIG_APP_IMU_ACC_ODR_HZ};
+    int err;
+
+    if (!device_is_ready(dev)) {
+        return -ENODEV;
+    }
+
+    // The rate goes last, it also selects the power mode
+    err = sensor_attr_set(dev, SENSOR_CHAN_ACCEL_XYZ, SENSOR_ATTR_FULL_SCALE, &full_scale);
+    err |= sensor_attr_set(dev, SENSOR_CHAN_ACCEL_XYZ, SENSOR_ATTR_OVERSAMPLING, &oversampling);
+    err |= sensor_attr_set(dev, SENSOR_CHAN_ACCEL_XYZ, SENSOR_ATTR_SAMPLING_FREQUENCY, &odr);
+
+    full_scale.val1 = IMU_GYR_RANGE_DPS;
+    odr.val1 = CONFIG_APP_IMU_GYR_ODR_HZ;
+    err |= sensor_attr_set(dev, SENSOR_CHAN_GYRO_XYZ, SENSOR_ATTR_FULL_SCALE, &full_scale);
+    err |= sensor_attr_set(dev, SENSOR_CHAN_GYRO_XYZ, SENSOR_ATTR_OVERSAMPLING, &oversampling);
+    err |= sensor_attr_set(dev, SENSOR_CHAN_GYRO_XYZ, SENSOR_ATTR_SAMPLING_FREQUENCY, &odr);
+    if (err) {
+        return -EIO;
+    }
+
+#if defined(CONFIG_APP_IMU_FUSION)
+    fusion_init(&foot_fusion, &foot_fusion_config);
+#endif
+#if defined(CONFIG_APP_ZUPT)
+    zupt_init(&foot_zupt, stride_handler);
+#endif
+#if defined(CONFIG_APP_ZUPT_PRESSURE_GATE)
+    zupt_gate_init(&foot_zupt, &foot_fusion);
+#endif
+
+    err = imu_fifo_start(dev, imu_batch_handler);
+    if (err) {
+        return err;
+    }
+    fuel_gauge_load_set(FUEL_GAUGE_LOAD_IMU, true);
+
+#if defined(CONFIG_APP_IMU_FEATURES)
+    err = imu_features_start(imu_features_handler);
+    if (err) {
+        printk("Failed to start the IMU features (err %d)\n", err);
+    }
+#endif
+
+#if defined(CONFIG_APP_IMU_POWER)
+    err = imu_power_init(dev, &imu_power_config);
+    if (err) {
+        printk("Failed to start the IMU power control (err %d)\n", err);
+    }
+#endif
+
+    return 0;
+}
+
+#endif /* CONFIG_APP_IMU_FIFO */
+
+// --------------------- IMU ----------------------
+
+#if defined(CONFIG_APP_SENSOR_PIPELINE)
+static struct sensor_pipeline_source *const pipeline_sources[] = {
+#if defined(CONFIG_APP_ADC_STREAM)
+    &piezo_source,
+#endif
+#if defined(CONFIG_APP_IMU_FIFO)
+    &imu_source,
+#endif
+};
+#endif
+
+/* Hand the gait records to the console and Memfault, outside of the
+ * sensor threads.
+ */
+static void gait_records_report(void)
+{
+	static const char *const names[] = {
+		[GAIT_EVENT_HEEL_STRIKE] = "heel strike",
+		[GAIT_EVENT_TOE_OFF] = "toe off",
+		[GAIT_EVENT_PEAK_PRESSURE] = "peak pressure",
+	};
+	static const char *const activities[] = {
+		[IMU_ACTIVITY_STILL] = "still",
+		[IMU_ACTIVITY_WALKING] = "walking",
+		[IMU_ACTIVITY_RUNNING] = "running",
+		[IMU_ACTIVITY_UNKNOWN] = "unknown",
+	};
+	static uint32_t last_steps;
+	struct gait_record record;
+
+	while (gait_records_get(&record)) {
+#if defined(CONFIG_APP_GAIT_CBOR)
+		gait_service_record(&record);
+#endif
+
+		if (record.type == GAIT_RECORD_ACTIVITY) {
+			printk("IMU at %lld us: %u steps, %s\n", record.activity.timestamp_us,
+			       record.activity.steps, activities[record.activity.activity]);
+
+			/* The sensor counts from its own start, the heartbeat per interval */
+			memfault_metrics_heartbeat_add(MEMFAULT_METRICS_KEY(imu_step_count),
+						       record.activity.steps - last_steps);
+			MEMFAULT_METRIC_SET_UNSIGNED(imu_activity, record.activity.activity);
+			last_steps = record.activity.steps;
+			continue;
+		}
+
+		if (record.type == GAIT_RECORD_STRIDE) {
+			printk("Stride at %lld us: %u mm in %u ms, %u mm/s, clearance %u mm\n",
+			       record.stride.timestamp_us, record.stride.zupt.length_mm,
+			       record.stride.zupt.duration_ms, record.stride.zupt.speed_mm_s,
+			       record.stride.zupt.clearance_mm);
+			continue;
+		}
+
+		if (record.event.type == GAIT_EVENT_HEEL_STRIKE) {
+			memfault_metrics_heartbeat_add(MEMFAULT_METRICS_KEY(gait_step_count), 1);
+		}
+
+		printk("Gait %s at %lld us: %d mV\n", names[record.event.type],
+		       record.event.timestamp_us, record.event.value_mv);
+	}
+}
+
+#if defined(CONFIG_APP_GAIT_SERVICE)
+/* Throughput of the gait stream since the previous report */
+static void gait_service_report(void)
+{
+	struct gait_service_stats stats;
+	uint32_t total;
+
+	gait_service_stats_get(&stats);
+	total = stats.payload_bytes + stats.overhead_bytes;
+
+	printk("Gait stream: %u B/s, %u packets, %u%% of raw, %u%% overhead, burst %u, "
+	       "%u windows, %u resent, %u logged, %u spilled, %u skipped, %u dropped\n",
+	       stats.payload_bps, stats.packets,
+	       stats.raw_bytes ? (uint32_t)((uint64_t)stats.payload_bytes * 100 / stats.raw_bytes) : 0,
+	       total ? (uint32_t)((uint64_t)stats.overhead_bytes * 100 / total) : 0,
+	       stats.max_burst, stats.windows, stats.resent, stats.logged, stats.spilled,
+	       stats.skipped, gait_stream_dropped());
+
+	memfault_metrics_heartbeat_set_unsigned(MEMFAULT_METRICS_KEY(gait_stream_payload_bps),
+						stats.payload_bps);
+}
+#endif
+
+#if defined(CONFIG_APP_PAYLOAD_LZ4)
+/* What the compression stage saves and what it costs */
+static void payload_lz4_report(void)
+{
+	struct payload_lz4_stats stats;
+
+	payload_lz4_stats_get(&stats);
+	if (stats.batches == 0) {
+		return;
+	}
+
+	uint32_t mean_cycles = stats.total_cycles / stats.batches;
+
+	printk("LZ4: %u batches, %u raw, %u%% of input, %u cycles (%u us) per batch, "
+	       "max %u cycles (%u us)\n",
+	       stats.batches, stats.raw_batches,
+	       (uint32_t)((uint64_t)stats.out_bytes * 100 / MAX(stats.in_bytes, 1)), mean_cycles,
+	       (uint32_t)(timing_cycles_to_ns(mean_cycles) / NSEC_PER_USEC), stats.max_cycles,
+	       (uint32_t)(timing_cycles_to_ns(stats.max_cycles) / NSEC_PER_USEC));
+}
+#endif
+
+#if defined(CONFIG_APP_SENSOR_LOG)
+/* Backlog in flash and how much of the erase budget it took */
+static void sensor_log_report(void)
+{
+	struct sensor_log_stats stats;
+
+	sensor_log_stats_get(&stats);
+
+	printk("Sensor log: %u B stored, offsets %u to %u, %u batches, %u dropped, "
+	       "%u B overwritten, %u of %u erases today\n",
+	       stats.end - stats.start, stats.start, stats.end, stats.batches, stats.dropped,
+	       stats.overwritten, stats.erases, stats.erases_per_day);
+}
+#endif
+
+#if defined(CONFIG_APP_IMU_POWER)
+/* Time in each IMU mode since the previous report, and how fast it wakes */
+static void imu_power_report(void)
+{
+	static struct imu_power_stats last;
+	struct imu_power_stats stats;
+
+	imu_power_stats_get(&stats);
+
+	printk("IMU %s mode, %u ms low power, %u ms performance, %u wakeups, "
+	       "wakeup latency %u us (max %u us)\n",
+	       imu_power_mode_get() == IMU_POWER_LOW ? "low power" : "performance",
+	       stats.time_in_mode_ms[IMU_POWER_LOW], stats.time_in_mode_ms[IMU_POWER_PERF],
+	       stats.wakeups, stats.wake_latency_us, stats.wake_latency_max_us);
+
+	memfault_metrics_heartbeat_add(MEMFAULT_METRICS_KEY(imu_low_power_ms),
+				       stats.time_in_mode_ms[IMU_POWER_LOW] -
+					       last.time_in_mode_ms[IMU_POWER_LOW]);
+	memfault_metrics_heartbeat_add(MEMFAULT_METRICS_KEY(imu_perf_ms),
+				       stats.time_in_mode_ms[IMU_POWER_PERF] -
+					       last.time_in_mode_ms[IMU_POWER_PERF]);
+	memfault_metrics_heartbeat_add(MEMFAULT_METRICS_KEY(imu_wakeups),
+				       stats.wakeups - last.wakeups);
+	MEMFAULT_METRIC_SET_UNSIGNED(imu_wake_latency_us, stats.wake_latency_us);
+	MEMFAULT_METRIC_SET_UNSIGNED(imu_wake_latency_max_us, stats.wake_latency_max_us);
+
+	last = stats;
+}
+#endif
+
+/* What the current connection moved and what it cost */
+static void link_manager_report(void)
+{
+	struct link_manager_stats stats;
+
+	if (link_manager_stats_get(&stats)) {
+		return;
+	}
+
+	printk("Link: %u B/s, radio on %u ms of %u ms, interval %u us, latency %u, "
+	       "PHY %u, %u octets, %u rejected\n",
+	       stats.throughput_bps, stats.radio_on_ms, stats.duration_ms, stats.interval_us,
+	       stats.latency, stats.phy, stats.tx_octets, stats.param_rejects);
+}
+
+#if defined(CONFIG_APP_BULK_CHANNEL)
+static void bulk_channel_report(void)
+{
+	struct bulk_channel_stats stats;
+
+	if (!bulk_channel_is_open()) {
+		return;
+	}
+
+	bulk_channel_stats_get(&stats);
+	printk("Bulk channel: %u B/s, %u SDUs, %u sent, %u in flight max, %u B dropped\n",
+	       stats.bps, stats.sdus, stats.sent, stats.max_in_flight, stats.dropped_bytes);
+}
+#endif
+
+/* Report how the restore after the last reset went */
+static void resume_report(void)
+{
+	struct checkpoint_stats stats;
+
+	checkpoint_stats_get(&stats);
+
+	printk("%s boot after %u ms, %u ADC blocks lost\n",
+	       stats.restored ? "Resumed" : "Cold", stats.recovery_ms, stats.lost);
+
+	MEMFAULT_METRIC_SET_UNSIGNED(checkpoint_recovery_ms, stats.recovery_ms);
+	MEMFAULT_METRIC_SET_UNSIGNED(checkpoint_lost_blocks, stats.lost);
+}
+
+/* The link manager moves the connection parameters with the level */
+static void energy_budget_changed(enum energy_budget_level level)
+{
+	printk("Energy budget level %d, balance %d uA\n", level, energy_budget_balance_ua());
+}
+
+static struct energy_budget_listener budget_listener = {
+	.cb = energy_budget_changed,
+};
 
 static void security_changed(struct bt_conn *conn, bt_security_t level,
 			     enum bt_security_err err)
@@ -179,6 +805,9 @@ static void connected(struct bt_conn *conn, uint8_t conn_err)
 	printk("Connected %s\n", addr);
 
 	dk_set_led_on(CON_STATUS_LED);
+
+	fuel_gauge_load_set(FUEL_GAUGE_LOAD_RADIO_ADV, false);
+	fuel_gauge_load_set(FUEL_GAUGE_LOAD_RADIO_CONN, true);
 }
 
 static void disconnected(struct bt_conn *conn, uint8_t reason)
@@ -187,6 +816,10 @@ static void disconnected(struct bt_conn *conn, uint8_t reason)
 
 	dk_set_led_off(CON_STATUS_LED);
 
+	/* Connectable advertising resumes automatically */
+	fuel_gauge_load_set(FUEL_GAUGE_LOAD_RADIO_CONN, false);
+	fuel_gauge_load_set(FUEL_GAUGE_LOAD_RADIO_ADV, true);
+
 	if (conn == mds_conn) {
 		mds_conn = NULL;
 	}
@@ -351,18 +984,28 @@ static void button_handler(uint32_t button_state, uint32_t has_changed)
 
 static void bas_notify(void)
 {
+	static uint8_t reported_level = UINT8_MAX;
 	int err;
-	// uint8_t battery_level = bt_bas_get_battery_level();
 
-	uint8_t battery_level = batterylvl;
+	energy_budget_update();
+
+	err = MEMFAULT_METRIC_SET_SIGNED(energy_balance_ua, energy_budget_balance_ua());
+	if (err) {
+		printk("Failed to set energy_balance_ua memfault metrics (err %d)\n", err);
+	}
 
-	__ASSERT_NO_MSG(battery_level > 0);
+	/* Without a cell reading the charge is only counted, not known */
+	if (!fuel_gauge_soc_valid()) {
+		return;
+	}
 
-	battery_level--;
+	uint8_t battery_level = fuel_gauge_soc_pct();
 
-	if (battery_level == 0) {
-		battery_level = 100U;
+	/* Only pay for a notification when the value changes */
+	if (battery_level == reported_level) {
+		return;
 	}
+	reported_level = battery_level;
 
 	err = MEMFAULT_METRIC_SET_UNSIGNED(battery_soc_pct, battery_level);
 	if (err) {
@@ -375,7 +1018,10 @@ static void bas_notify(void)
 static void bas_work_handler(struct k_work *work)
 {
 	bas_notify();
-	k_work_reschedule((struct k_work_delayable *)work, K_SECONDS(1));
+
+	/* Battery accounting is part of the budget, poll less when it is tight */
+	k_work_reschedule((struct k_work_delayable *)work,
+			  K_MSEC(energy_budget_period_ms(BAS_UPDATE_INTERVAL)));
 }
 
 // LOG_MODULE_REGISTER(main, LOG_LEVEL_DBG);
@@ -385,6 +1031,10 @@ int main(void)
 	uint32_t blink_status = 0;
 	button_press_count=0;
 	int err;
+
+	if (checkpoint_register(&app_section)) {
+		printk("Restored button_3_press_count %u\n", button_press_count);
+	}
 	memfault_metrics_heartbeat_set_unsigned(MEMFAULT_METRICS_KEY(button_3_press_count), 0);
 
 	MEMFAULT_METRIC_SET_UNSIGNED(button_3_press_count, button_press_count);
@@ -445,24 +1095,115 @@ int main(void)
 	}
 
 	printk("Advertising successfully started\n");
+	fuel_gauge_load_set(FUEL_GAUGE_LOAD_RADIO_ADV, true);
+
+	energy_budget_listener_add(&budget_listener);
+	link_manager_init();
+	k_work_schedule(&bas_work, K_MSEC(BAS_UPDATE_INTERVAL));
+
+#if defined(CONFIG_APP_ADC_STREAM)
+#if defined(CONFIG_APP_GAIT_EVENTS)
+	gait_events_init(gait_event_handler);
+#endif
+#if defined(CONFIG_APP_ZUPT_PRESSURE_GATE)
+	gait_events_load_watch(zupt_gate_load);
+#endif
+#if defined(CONFIG_APP_DSP_CHAIN)
+	err = dsp_chain_init();
+	if (err) {
+		printk("Failed to initialize DSP chain (err %d)\n", err);
+	}
+#endif
+#endif
+
+#if defined(CONFIG_APP_SENSOR_LOG)
+	err = sensor_log_init();
+	if (err) {
+		printk("Failed to mount the sensor log (err %d)\n", err);
+	}
+#endif
+
+	checkpoint_resumed();
+	resume_report();
+
+#if defined(CONFIG_APP_GAIT_SERVICE)
+#if defined(CONFIG_APP_IMU_FIFO)
+	gait_service_init(IMU_ACC_RANGE_G, IMU_GYR_RANGE_DPS);
+#else
+	gait_service_init(0, 0);
+#endif
+#endif
+
+#if defined(CONFIG_APP_BULK_CHANNEL)
+	err = bulk_channel_init();
+	if (err) {
+		printk("Failed to register the bulk channel (err %d)\n", err);
+	}
+#endif
+
+#if defined(CONFIG_APP_SENSOR_PIPELINE)
+	err = sensor_pipeline_start(pipeline_sources, ARRAY_SIZE(pipeline_sources));
+	if (err) {
+		printk("Failed to start sensor pipeline (err %d)\n", err);
+	}
+#endif
 
-	k_work_schedule(&bas_work, K_SECONDS(1));
+#if defined(CONFIG_APP_IMU_FIFO)
+	err = imu_start();
+	if (err) {
+		printk("Failed to start the IMU (err %d)\n", err);
+	}
+#endif
 
+#if defined(CONFIG_APP_ADC_STREAM)
+	err = adc_stream_start();
+	if (err) {
+		printk("Failed to start ADC stream (err %d)\n", err);
+	} else {
+		fuel_gauge_load_set(FUEL_GAUGE_LOAD_ADC_STREAM, true);
+	}
+#else
 	configure_adc();
+#endif
 
 	int times = 0;
 
 	for (;;) {
-		dk_set_led(RUN_STATUS_LED, (++blink_status) % 2);
+		/* The run LED is the largest optional load on the board */
+		if (energy_budget_level_get() > ENERGY_BUDGET_CRITICAL) {
+			dk_set_led(RUN_STATUS_LED, (++blink_status) % 2);
+		} else {
+			dk_set_led_off(RUN_STATUS_LED);
+		}
 		if(times%20 == 0){
-			batterylvl--;
 			// memfault_metrics_heartbeat_debug_print();
 			printk("Should Execute memfault_metrics_heartbeat_debug_print\n");
 			memfault_metrics_heartbeat_debug_trigger();
 			// memfault_data_export_dump_chunks();
+#if defined(CONFIG_APP_GAIT_SERVICE)
+			gait_service_report();
+#endif
+#if defined(CONFIG_APP_PAYLOAD_LZ4)
+			payload_lz4_report();
+#endif
+#if defined(CONFIG_APP_BULK_CHANNEL)
+			bulk_channel_report();
+#endif
+#if defined(CONFIG_APP_SENSOR_LOG)
+			sensor_log_report();
+#endif
+#if defined(CONFIG_APP_IMU_POWER)
+			imu_power_report();
+#endif
+			link_manager_report();
 		}
 		times++;
+		/* Chunks only leave while MDS streaming is on, the central drains them */
+		link_manager_busy(LINK_MANAGER_MDS, mds_conn && memfault_packetizer_data_available());
+#if !defined(CONFIG_APP_ADC_STREAM)
 		read_adc_sample();
-		k_sleep(K_MSEC(RUN_LED_BLINK_INTERVAL));
+#endif
+		gait_records_report();
+		k_sleep(K_MSEC(energy_budget_period_ms(RUN_LED_BLINK_INTERVAL)));
 	}
 }
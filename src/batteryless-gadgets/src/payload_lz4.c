@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include <zephyr/init.h>
+#include <zephyr/kernel.h>
+#include <zephyr/timing/timing.h>
+
+#include "payload_lz4.h"
+
+/* The hash table, LZ4_compress_default() would put it on the stack. */
+static LZ4_stream_t lz4_state;
+
+static struct payload_lz4_stats stats;
+static struct k_spinlock lock;
+
+int payload_lz4_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap,
+			 bool *compressed)
+{
+	timing_t start = timing_counter_get();
+	timing_t end;
+	uint32_t cycles;
+	int out;
+
+	if (cap < len) {
+		return -ENOMEM;
+	}
+
+	/* Anything not smaller than the batch counts as a failure */
+	out = len ? LZ4_compress_fast_extState(&lz4_state, (const char *)src, (char *)dst, len,
+					       len - 1, CONFIG_APP_PAYLOAD_LZ4_ACCELERATION) : 0;
+	*compressed = out > 0;
+	if (!*compressed) {
+		memcpy(dst, src, len);
+		out = len;
+	}
+
+	end = timing_counter_get();
+	cycles = (uint32_t)timing_cycles_get(&start, &end);
+
+	K_SPINLOCK(&lock) {
+		stats.batches++;
+		stats.raw_batches += !*compressed;
+		stats.in_bytes += len;
+		stats.out_bytes += out;
+		stats.last_cycles = cycles;
+		stats.max_cycles = MAX(stats.max_cycles, cycles);
+		stats.total_cycles += cycles;
+	}
+
+	return out;
+}
+
+void payload_lz4_stats_get(struct payload_lz4_stats *out)
+{
+	K_SPINLOCK(&lock) {
+		*out = stats;
+	}
+}
+
+/* The system timer counts the 32 kHz RTC, the timing functions count CPU
+ * cycles.
+ */
+static int payload_lz4_init(void)
+{
+	timing_init();
+	timing_start();
+
+	return 0;
+}
+
+SYS_INIT(payload_lz4_init, APPLICATION, CONFIG_APPLICATION_INIT_PRIORITY);
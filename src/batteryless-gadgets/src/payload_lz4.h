@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#ifndef PAYLOAD_LZ4_H_
+#define PAYLOAD_LZ4_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <lz4.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Output buffer size that holds any result for @p len input bytes. */
+#define PAYLOAD_LZ4_BOUND(len) LZ4_COMPRESSBOUND(len)
+
+struct payload_lz4_stats {
+	/** Batches passed through the stage. */
+	uint32_t batches;
+	/** Batches sent raw because LZ4 did not make them smaller. */
+	uint32_t raw_batches;
+	/** Input bytes. */
+	uint32_t in_bytes;
+	/** Output bytes, compressed or raw. */
+	uint32_t out_bytes;
+	/** CPU cycles of the last batch. */
+	uint32_t last_cycles;
+	/** Most CPU cycles a batch took. */
+	uint32_t max_cycles;
+	/** CPU cycles of all batches. */
+	uint64_t total_cycles;
+};
+
+/**
+ * @brief Compress one batch into a preallocated buffer.
+ *
+ * Batches that do not get smaller are copied as they are. Only called from
+ * one thread at a time.
+ *
+ * @param src        Batch to compress.
+ * @param len        Bytes in @p src.
+ * @param dst        Output, PAYLOAD_LZ4_BOUND(len) bytes.
+ * @param cap        Size of @p dst.
+ * @param compressed Set to whether @p dst holds an LZ4 block.
+ *
+ * @return Bytes written to @p dst, or -ENOMEM if @p cap is smaller than
+ *         the batch.
+ */
+int payload_lz4_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap,
+			 bool *compressed);
+
+/**
+ * @brief Get the stage counters.
+ */
+void payload_lz4_stats_get(struct payload_lz4_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PAYLOAD_LZ4_H_ */
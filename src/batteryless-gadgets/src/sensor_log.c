@@ -0,0 +1,436 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/fs/fcb.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/byteorder.h>
+
+#include <pm_config.h>
+
+#include "checkpoint.h"
+#include "sensor_log.h"
+
+#define LOG_MAGIC   0x534c4f47
+#define LOG_VERSION 1
+
+/* nRF52 flash pages */
+#define SECTOR_SIZE  4096
+#define SECTOR_COUNT (PM_SENSOR_LOG_SIZE / SECTOR_SIZE)
+
+#define DAY_MS (24U * 60U * 60U * MSEC_PER_SEC)
+
+/* Guaranteed erase cycles of an nRF52 flash page */
+#define FLASH_CYCLES 10000
+
+#if CONFIG_APP_SENSOR_LOG_ERASES_PER_DAY
+#define ERASES_PER_DAY CONFIG_APP_SENSOR_LOG_ERASES_PER_DAY
+#else
+#define ERASES_PER_DAY                                                                             \
+	MAX((uint32_t)SECTOR_COUNT * FLASH_CYCLES / CONFIG_APP_SENSOR_LOG_LIFETIME_DAYS, 1)
+#endif
+
+/* Longest tail of a batch that is padded to the write block size */
+#define TAIL_MAX 16
+
+BUILD_ASSERT(SECTOR_COUNT >= 2 && SECTOR_COUNT <= UINT8_MAX, "FCB takes 2 to 255 sectors");
+
+/* Every FCB element is a batch: its offset in the byte stream, then the
+ * data. The element length gives the batch length, so the end of the log
+ * is known from the last element alone.
+ */
+struct entry_header {
+	uint32_t offset;
+};
+
+static struct flash_sector sectors[SECTOR_COUNT];
+static struct fcb fcb = {
+	.f_magic = LOG_MAGIC,
+	.f_version = LOG_VERSION,
+	.f_sectors = sectors,
+};
+static bool mounted;
+
+/* Element last found by entry_find(), reads go on from there. */
+static struct {
+	struct fcb_entry loc;
+	uint32_t offset;
+	uint16_t len;
+	bool valid;
+} cursor;
+
+/* Erases of the current day, kept across resets by the checkpoint and
+ * written to flash on every erase so a supply dropout does not reset it.
+ * The time the device was off does not count, which only makes the budget
+ * stricter.
+ */
+static struct {
+	uint32_t day_ms;
+	uint32_t erases;
+} budget;
+static int64_t budget_time;
+static struct k_spinlock budget_lock;
+
+static struct checkpoint_section budget_section =
+	CHECKPOINT_SECTION_PERSIST_INIT(CHECKPOINT_ID(CHECKPOINT_OWNER_SENSOR_LOG, 0), budget);
+
+static atomic_t log_start;
+static atomic_t log_end;
+static atomic_t batches;
+static atomic_t dropped;
+static atomic_t overwritten;
+
+static bool erase_take(void)
+{
+	int64_t now = k_uptime_get();
+	bool taken = false;
+
+	K_SPINLOCK(&budget_lock) {
+		budget.day_ms += now - budget_time;
+		budget_time = now;
+
+		if (budget.day_ms >= DAY_MS) {
+			budget.day_ms %= DAY_MS;
+			budget.erases = 0;
+		}
+
+		if (budget.erases < ERASES_PER_DAY) {
+			budget.erases++;
+			taken = true;
+		}
+	}
+
+	if (taken) {
+		checkpoint_persist(&budget_section);
+	}
+
+	return taken;
+}
+
+static int header_read(const struct fcb_entry *loc, uint32_t *offset)
+{
+	struct entry_header hdr;
+	int err;
+
+	err = flash_area_read(fcb.fap, loc->fe_sector->fs_off + loc->fe_data_off, &hdr,
+			      sizeof(hdr));
+	if (err) {
+		return err;
+	}
+
+	*offset = sys_le32_to_cpu(hdr.offset);
+	return 0;
+}
+
+/* Offset of the first element after the oldest sector, the one the log
+ * starts with once the oldest sector is erased.
+ */
+static int next_start_get(uint32_t *offset)
+{
+	struct fcb_entry loc = {
+		.fe_sector = fcb.f_oldest + 1 == &sectors[SECTOR_COUNT] ? &sectors[0] :
+									    fcb.f_oldest + 1,
+	};
+	int err;
+
+	if (fcb.f_oldest == fcb.f_active.fe_sector) {
+		return -ENOENT;
+	}
+
+	err = fcb_getnext(&fcb, &loc);
+	if (err) {
+		return err;
+	}
+
+	return header_read(&loc, offset);
+}
+
+static int oldest_erase(void)
+{
+	uint32_t start;
+	int err;
+
+	err = next_start_get(&start);
+	if (err) {
+		return err;
+	}
+
+	err = fcb_rotate(&fcb);
+	if (err) {
+		return err;
+	}
+
+	atomic_set(&log_start, start);
+	cursor.valid = false;
+
+	return 0;
+}
+
+/* Finds the element that holds @p offset, walking on from the cursor when
+ * possible.
+ */
+static int entry_find(uint32_t offset)
+{
+	if (cursor.valid && offset >= cursor.offset && offset < cursor.offset + cursor.len) {
+		return 0;
+	}
+
+	if (!cursor.valid || offset < cursor.offset) {
+		cursor.loc = (struct fcb_entry){0};
+	}
+	cursor.valid = false;
+
+	while (fcb_getnext(&fcb, &cursor.loc) == 0) {
+		int err = header_read(&cursor.loc, &cursor.offset);
+
+		if (err) {
+			return err;
+		}
+
+		cursor.len = cursor.loc.fe_data_len - sizeof(struct entry_header);
+		cursor.valid = true;
+
+		if (offset < cursor.offset + cursor.len) {
+			return 0;
+		}
+	}
+
+	cursor.valid = false;
+	return -ENOENT;
+}
+
+/* FCB takes any sector without its header for erased. A partition that
+ * holds no log sector at all, new or after a layout change, is erased as a
+ * whole before it is mounted.
+ */
+static int partition_prepare(const struct flash_area *fa, uint32_t count)
+{
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t magic;
+		int err = flash_area_read(fa, sectors[i].fs_off, &magic, sizeof(magic));
+
+		if (err) {
+			return err;
+		}
+
+		if (magic == LOG_MAGIC) {
+			return 0;
+		}
+	}
+
+	printk("Sensor log: formatting %u sectors\n", count);
+
+	return flash_area_erase(fa, 0, fa->fa_size);
+}
+
+int sensor_log_init(void)
+{
+	const struct flash_area *fa;
+	struct fcb_entry loc = {0};
+	uint32_t count = ARRAY_SIZE(sectors);
+	bool first = true;
+	int err;
+
+	checkpoint_register(&budget_section);
+	budget_time = k_uptime_get();
+
+	err = flash_area_get_sectors(PM_SENSOR_LOG_ID, &count, sectors);
+	if (err) {
+		return err;
+	}
+
+	err = flash_area_open(PM_SENSOR_LOG_ID, &fa);
+	if (err) {
+		return err;
+	}
+
+	err = partition_prepare(fa, count);
+	flash_area_close(fa);
+	if (err) {
+		return err;
+	}
+
+	fcb.f_sector_cnt = count;
+	err = fcb_init(PM_SENSOR_LOG_ID, &fcb);
+	if (err) {
+		return err;
+	}
+
+	if (fcb.f_align > TAIL_MAX || sizeof(struct entry_header) % fcb.f_align) {
+		return -ENOTSUP;
+	}
+
+	/* The stream positions only live in the elements */
+	while (fcb_getnext(&fcb, &loc) == 0) {
+		uint32_t offset;
+
+		if (header_read(&loc, &offset)) {
+			continue;
+		}
+
+		if (first) {
+			atomic_set(&log_start, offset);
+			first = false;
+		}
+		atomic_set(&log_end, offset + loc.fe_data_len - sizeof(struct entry_header));
+	}
+
+	mounted = true;
+
+	return 0;
+}
+
+int sensor_log_append(const void *data, size_t len)
+{
+	struct entry_header hdr = {
+		.offset = sys_cpu_to_le32(atomic_get(&log_end)),
+	};
+	const uint8_t *src = data;
+	size_t body;
+	struct fcb_entry loc;
+	off_t off;
+	int err;
+
+	if (!mounted) {
+		return -ENODEV;
+	}
+
+	if (len == 0 || len > UINT16_MAX - sizeof(hdr)) {
+		return -EINVAL;
+	}
+
+	for (;;) {
+		err = fcb_append(&fcb, sizeof(hdr) + len, &loc);
+		if (err != -ENOSPC) {
+			break;
+		}
+
+		/* Full, make room at the expense of the oldest data */
+		uint32_t start = atomic_get(&log_start);
+
+		if (!erase_take()) {
+			atomic_inc(&dropped);
+			return -ENOSPC;
+		}
+
+		err = oldest_erase();
+		if (err) {
+			break;
+		}
+		atomic_add(&overwritten, atomic_get(&log_start) - start);
+	}
+
+	if (err) {
+		atomic_inc(&dropped);
+		return err;
+	}
+
+	/* Written once, the tail padded to the write block size */
+	off = FCB_ENTRY_FA_DATA_OFF(loc);
+	body = ROUND_DOWN(len, fcb.f_align);
+
+	err = flash_area_write(fcb.fap, off, &hdr, sizeof(hdr));
+	if (!err && body) {
+		err = flash_area_write(fcb.fap, off + sizeof(hdr), src, body);
+	}
+	if (!err && body < len) {
+		uint8_t tail[TAIL_MAX];
+
+		memset(tail, fcb.f_erase_value, sizeof(tail));
+		memcpy(tail, &src[body], len - body);
+		err = flash_area_write(fcb.fap, off + sizeof(hdr) + body, tail, fcb.f_align);
+	}
+	if (!err) {
+		err = fcb_append_finish(&fcb, &loc);
+	}
+
+	/* A broken element fails its CRC and is skipped by the readers, the
+	 * offset moves on anyway so the receiver sees the gap.
+	 */
+	atomic_add(&log_end, len);
+	if (err) {
+		atomic_inc(&dropped);
+		return err;
+	}
+
+	atomic_inc(&batches);
+	return 0;
+}
+
+int sensor_log_read(uint32_t *offset, uint8_t *buf, size_t size)
+{
+	uint32_t pos;
+	int err;
+
+	if (!mounted) {
+		return -ENODEV;
+	}
+
+	if (*offset < (uint32_t)atomic_get(&log_start)) {
+		*offset = atomic_get(&log_start);
+	}
+
+	if (*offset >= (uint32_t)atomic_get(&log_end)) {
+		return 0;
+	}
+
+	err = entry_find(*offset);
+	if (err) {
+		return err;
+	}
+
+	/* Skip over broken elements */
+	if (*offset < cursor.offset) {
+		*offset = cursor.offset;
+	}
+
+	pos = *offset - cursor.offset;
+	size = MIN(size, cursor.len - pos);
+
+	err = flash_area_read(fcb.fap, FCB_ENTRY_FA_DATA_OFF(cursor.loc) +
+					       sizeof(struct entry_header) + pos,
+			      buf, size);
+	if (err) {
+		return err;
+	}
+
+	return size;
+}
+
+void sensor_log_release(uint32_t offset)
+{
+	uint32_t start;
+
+	if (!mounted) {
+		return;
+	}
+
+	/* The oldest sector only holds released data if the next one starts
+	 * at or before the offset. The active sector always stays.
+	 */
+	while (next_start_get(&start) == 0 && start <= offset) {
+		if (!erase_take() || oldest_erase()) {
+			break;
+		}
+	}
+}
+
+void sensor_log_stats_get(struct sensor_log_stats *stats)
+{
+	stats->start = atomic_get(&log_start);
+	stats->end = atomic_get(&log_end);
+	stats->batches = atomic_get(&batches);
+	stats->dropped = atomic_get(&dropped);
+	stats->overwritten = atomic_get(&overwritten);
+	K_SPINLOCK(&budget_lock) {
+		stats->erases = budget.erases;
+	}
+	stats->erases_per_day = ERASES_PER_DAY;
+}
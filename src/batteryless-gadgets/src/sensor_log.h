@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#ifndef SENSOR_LOG_H_
+#define SENSOR_LOG_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * The log is one byte stream. Every appended batch takes the next bytes of
+ * it, and offsets into the stream count from the creation of the log, so
+ * they stay valid across resets and after old data was dropped.
+ */
+struct sensor_log_stats {
+	/** Offset of the oldest byte still in flash. */
+	uint32_t start;
+	/** Offset the next batch is appended at. */
+	uint32_t end;
+	/** Batches appended since boot. */
+	uint32_t batches;
+	/** Batches not stored, out of erase budget or after a flash error. */
+	uint32_t dropped;
+	/** Bytes erased before they were released, since boot. */
+	uint32_t overwritten;
+	/** Sector erases in the current day. */
+	uint32_t erases;
+	/** Sector erases allowed per day. */
+	uint32_t erases_per_day;
+};
+
+/**
+ * @brief Mount the log partition.
+ *
+ * Erases the partition if it does not hold a log. Call before
+ * checkpoint_resumed(), the erase budget of the day is part of the
+ * snapshot.
+ */
+int sensor_log_init(void);
+
+/**
+ * @brief Append one batch.
+ *
+ * The oldest sector is erased when the log is full, released or not, as
+ * long as the erase budget of the day allows. May block for a sector
+ * erase.
+ *
+ * @retval 0 on success.
+ * @retval -ENOSPC if the log is full and out of erase budget.
+ * @retval -ENODEV if the log is not mounted.
+ */
+int sensor_log_append(const void *data, size_t len);
+
+/**
+ * @brief Read from the byte stream.
+ *
+ * Reads up to the end of the batch that holds @p offset, at most @p size
+ * bytes.
+ *
+ * @param offset Where to read from. Moved to the oldest byte if that data
+ *               was already erased.
+ *
+ * @return Bytes read, 0 at the end of the log, or a negative error.
+ */
+int sensor_log_read(uint32_t *offset, uint8_t *buf, size_t size);
+
+/**
+ * @brief Release everything before @p offset.
+ *
+ * Sectors that only hold released batches are erased, so the data is not
+ * sent again after a reset.
+ */
+void sensor_log_release(uint32_t offset);
+
+/**
+ * @brief Get the counters.
+ *
+ * sensor_log_append(), sensor_log_read() and sensor_log_release() are only
+ * called from one thread, this one from any.
+ */
+void sensor_log_stats_get(struct sensor_log_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SENSOR_LOG_H_ */
@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/rtio/rtio.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/spsc_lockfree.h>
+
+#include "sensor_pipeline.h"
+
+#define POOL_BLOCK_SIZE 64
+#define POOL_BLOCKS     (CONFIG_APP_SENSOR_PIPELINE_POOL_SIZE / POOL_BLOCK_SIZE)
+
+/* Every source buffer is allocated from one pool, so the producers write
+ * straight into memory the processing thread reads from.
+ */
+RTIO_DEFINE_WITH_MEMPOOL(pipeline_rtio, CONFIG_APP_SENSOR_PIPELINE_QUEUE_SIZE,
+			 CONFIG_APP_SENSOR_PIPELINE_QUEUE_SIZE, POOL_BLOCKS, POOL_BLOCK_SIZE, 4);
+
+BUILD_ASSERT(CONFIG_APP_SENSOR_PIPELINE_ACQ_PRIORITY < CONFIG_SYSTEM_WORKQUEUE_PRIORITY,
+	     "acquisition must not wait for the system workqueue");
+#if defined(CONFIG_BT_RX_PRIO)
+BUILD_ASSERT(CONFIG_APP_SENSOR_PIPELINE_ACQ_PRIORITY < K_PRIO_COOP(CONFIG_BT_RX_PRIO),
+	     "acquisition must not wait for the Bluetooth host");
+#endif
+
+/* A completed read on its way from the acquisition thread to the
+ * processing thread. The buffer stays in the pool until it is processed.
+ */
+struct pipeline_buf {
+	struct sensor_pipeline_source *source;
+	uint8_t *buf;
+	uint32_t len;
+};
+
+BUILD_ASSERT(IS_POWER_OF_TWO(CONFIG_APP_SENSOR_PIPELINE_RING_SIZE),
+	     "ring size must be a power of two");
+
+SPSC_DEFINE(pipeline_ring, struct pipeline_buf, CONFIG_APP_SENSOR_PIPELINE_RING_SIZE);
+static K_SEM_DEFINE(ring_sem, 0, K_SEM_MAX_LIMIT);
+
+static atomic_t started;
+
+static void read_queue(struct sensor_pipeline_source *source)
+{
+	struct rtio_sqe *sqe = rtio_sqe_acquire(&pipeline_rtio);
+
+	if (sqe == NULL) {
+		/* The queue is sized for the sum of all depths. */
+		printk("Sensor pipeline queue full\n");
+		return;
+	}
+
+	rtio_sqe_prep_read_with_pool(sqe, source->iodev, RTIO_PRIO_NORM, source);
+}
+
+static void completion_process(struct rtio_cqe *cqe)
+{
+	struct sensor_pipeline_source *source = cqe->userdata;
+	struct pipeline_buf *entry = NULL;
+	int result = cqe->result;
+	uint8_t *buf = NULL;
+	uint32_t len = 0;
+	int err;
+
+	err = rtio_cqe_get_mempool_buffer(&pipeline_rtio, cqe, &buf, &len);
+	rtio_cqe_release(&pipeline_rtio, cqe);
+
+	if (result < 0 || err) {
+		source->errors++;
+	} else {
+		entry = spsc_acquire(&pipeline_ring);
+		if (entry == NULL) {
+			/* Processing fell behind, drop the data rather than
+			 * stall the sources.
+			 */
+			source->drops++;
+		}
+	}
+
+	if (entry) {
+		*entry = (struct pipeline_buf){
+			.source = source,
+			.buf = buf,
+			.len = len,
+		};
+		spsc_produce(&pipeline_ring);
+		k_sem_give(&ring_sem);
+	} else if (buf) {
+		rtio_release_buffer(&pipeline_rtio, buf, len);
+	}
+
+	read_queue(source);
+}
+
+static void acquisition_thread(void *p1, void *p2, void *p3)
+{
+	ARG_UNUSED(p1);
+	ARG_UNUSED(p2);
+	ARG_UNUSED(p3);
+
+	/* Only hands the completed buffers over and queues new reads, so
+	 * the sources never run out of buffers while one is processed.
+	 */
+	for (;;) {
+		completion_process(rtio_cqe_consume_block(&pipeline_rtio));
+		rtio_submit(&pipeline_rtio, 0);
+	}
+}
+
+static void processing_thread(void *p1, void *p2, void *p3)
+{
+	ARG_UNUSED(p1);
+	ARG_UNUSED(p2);
+	ARG_UNUSED(p3);
+
+	for (;;) {
+		k_sem_take(&ring_sem, K_FOREVER);
+
+		struct pipeline_buf *entry = spsc_consume(&pipeline_ring);
+
+		entry->source->process(entry->buf, entry->len);
+		rtio_release_buffer(&pipeline_rtio, entry->buf, entry->len);
+		spsc_release(&pipeline_ring);
+	}
+}
+
+K_THREAD_DEFINE(sensor_acq_tid, CONFIG_APP_SENSOR_PIPELINE_ACQ_STACK_SIZE, acquisition_thread,
+		NULL, NULL, NULL, CONFIG_APP_SENSOR_PIPELINE_ACQ_PRIORITY, 0, SYS_FOREVER_MS);
+
+K_THREAD_DEFINE(sensor_pipeline_tid, CONFIG_APP_SENSOR_PIPELINE_THREAD_STACK_SIZE,
+		processing_thread, NULL, NULL, NULL,
+		CONFIG_APP_SENSOR_PIPELINE_THREAD_PRIORITY, 0, SYS_FOREVER_MS);
+
+int sensor_pipeline_start(struct sensor_pipeline_source *const *sources, size_t count)
+{
+	if (!atomic_cas(&started, 0, 1)) {
+		return -EALREADY;
+	}
+
+	/* Queue the first reads before the thread takes over the queue, so
+	 * the sources have buffers as soon as they start.
+	 */
+	for (size_t i = 0; i < count; i++) {
+		for (uint8_t n = 0; n < sources[i]->depth; n++) {
+			read_queue(sources[i]);
+		}
+	}
+	rtio_submit(&pipeline_rtio, 0);
+
+	k_thread_start(sensor_pipeline_tid);
+	k_thread_start(sensor_acq_tid);
+
+	return 0;
+}
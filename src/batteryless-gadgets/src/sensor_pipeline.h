@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#ifndef SENSOR_PIPELINE_H_
+#define SENSOR_PIPELINE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <zephyr/rtio/rtio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Decode and process one completed read.
+ *
+ * Called from the processing thread, in the order the reads of the source
+ * completed. The buffer belongs to the shared memory pool and is released
+ * when the callback returns.
+ */
+typedef void (*sensor_pipeline_process_t)(const uint8_t *buf, size_t len);
+
+/**
+ * A producer of buffers, such as the ADC stream or the IMU FIFO.
+ *
+ * The pipeline keeps @ref depth reads queued on the iodev. The iodev takes
+ * a buffer from the pool when it has data and completes the read. The
+ * acquisition thread queues a new read right away and passes the buffer
+ * through a single-producer, single-consumer ring to the processing thread.
+ */
+struct sensor_pipeline_source {
+	struct rtio_iodev *iodev;
+	sensor_pipeline_process_t process;
+	/** Reads kept queued on the iodev. */
+	uint8_t depth;
+	/** Completed reads that failed. */
+	uint32_t errors;
+	/** Completed reads dropped because the processing ring was full. */
+	uint32_t drops;
+};
+
+/**
+ * @brief Queue reads for every source and start the pipeline threads.
+ *
+ * @param sources Sources to serve, must stay valid.
+ * @param count   Number of sources.
+ *
+ * @retval 0 on success.
+ * @retval -EALREADY if the pipeline is already running.
+ */
+int sensor_pipeline_start(struct sensor_pipeline_source *const *sources, size_t count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SENSOR_PIPELINE_H_ */
@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#include <zephyr/kernel.h>
+
+#include "zupt_gate.h"
+
+#define BLOCK_US                                                                          \
+	((int64_t)CONFIG_APP_ADC_STREAM_BLOCK_SAMPLES * USEC_PER_SEC /                    \
+	 CONFIG_APP_ADC_STREAM_SAMPLE_RATE_HZ)
+#define IMU_RATE_HZ MAX(CONFIG_APP_IMU_ACC_ODR_HZ, CONFIG_APP_IMU_GYR_ODR_HZ)
+
+/* The pads lag by up to a block, plus the watermark batch that overtook it. */
+#define HOLD_FRAMES (BLOCK_US * IMU_RATE_HZ / USEC_PER_SEC + CONFIG_APP_IMU_FIFO_WATERMARK_FRAMES)
+
+/* A step changes the loading twice, a block holds only a few steps. */
+#define EDGE_COUNT 8
+
+static struct zupt *zupt;
+static struct fusion *fusion;
+
+static struct imu_fifo_frame hold[HOLD_FRAMES];
+static size_t hold_head;
+static size_t hold_len;
+
+static struct {
+	int64_t timestamp_us;
+	bool loaded;
+} edges[EDGE_COUNT];
+static size_t edge_head;
+static size_t edge_len;
+
+/* Loading at the last frame that went through */
+static bool foot_loaded;
+static int64_t pads_us = INT64_MIN;
+
+static void frame_release(void)
+{
+	const struct imu_fifo_frame *frame = &hold[hold_head];
+	int64_t t = imu_fifo_time_us(frame->sensortime);
+
+	while (edge_len && edges[edge_head].timestamp_us <= t) {
+		foot_loaded = edges[edge_head].loaded;
+		edge_head = (edge_head + 1) % EDGE_COUNT;
+		edge_len--;
+	}
+
+	zupt_pressure_set(zupt, foot_loaded);
+	zupt_update(zupt, fusion, frame, 1);
+
+	hold_head = (hold_head + 1) % HOLD_FRAMES;
+	hold_len--;
+}
+
+static void hold_drain(void)
+{
+	while (hold_len && imu_fifo_time_us(hold[hold_head].sensortime) <= pads_us) {
+		frame_release();
+	}
+}
+
+void zupt_gate_init(struct zupt *z, struct fusion *f)
+{
+	zupt = z;
+	fusion = f;
+	hold_len = 0;
+}
+
+void zupt_gate_load(int64_t timestamp_us, bool loaded)
+{
+	/* Out of room, the oldest change is applied early */
+	if (edge_len == EDGE_COUNT) {
+		foot_loaded = edges[edge_head].loaded;
+		edge_head = (edge_head + 1) % EDGE_COUNT;
+		edge_len--;
+	}
+
+	edges[(edge_head + edge_len) % EDGE_COUNT].timestamp_us = timestamp_us;
+	edges[(edge_head + edge_len) % EDGE_COUNT].loaded = loaded;
+	edge_len++;
+}
+
+void zupt_gate_pads(int64_t timestamp_us)
+{
+	pads_us = timestamp_us;
+	hold_drain();
+}
+
+void zupt_gate_imu(const struct imu_fifo_batch *batch)
+{
+	if (zupt == NULL) {
+		return;
+	}
+
+	for (size_t i = 0; i < batch->count; i++) {
+		if (hold_len == HOLD_FRAMES) {
+			frame_release();
+		}
+
+		hold[(hold_head + hold_len) % HOLD_FRAMES] = batch->frames[i];
+		hold_len++;
+	}
+
+	hold_drain();
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#ifndef ZUPT_GATE_H_
+#define ZUPT_GATE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "fusion.h"
+#include "imu_fifo.h"
+#include "zupt.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Foot-flat gate of the dead reckoning, fed by the pressure pads.
+ *
+ * The ADC blocks reach the processing thread up to a block after the IMU
+ * batches of the same time. IMU frames are held until the pads were
+ * processed up to their common time, then run through ZUPT one by one,
+ * each with the loading at its own time. All calls come from the sensor
+ * processing thread.
+ */
+
+/**
+ * @brief Start feeding @p z and @p f, and drop any held frames.
+ *
+ * Call after zupt_init() and fusion_init().
+ */
+void zupt_gate_init(struct zupt *z, struct fusion *f);
+
+/**
+ * @brief Add a change of the pad loading, see gait_events_load_watch().
+ */
+void zupt_gate_load(int64_t timestamp_us, bool loaded);
+
+/**
+ * @brief Release the frames up to the last processed pad sample.
+ *
+ * @param timestamp_us Common time of the last sample of an ADC block.
+ */
+void zupt_gate_pads(int64_t timestamp_us);
+
+/**
+ * @brief Hold the frames of a batch until the pads catch up.
+ *
+ * When the hold is full, the pad stream is idle and the last loading
+ * still applies, so the oldest frames go through with it.
+ */
+void zupt_gate_imu(const struct imu_fifo_batch *batch);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ZUPT_GATE_H_ */
@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "frame_codec.h"
+
+static inline uint32_t zigzag32(int32_t v)
+{
+	return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+static inline int32_t unzigzag32(uint32_t v)
+{
+	return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+
+static inline uint64_t zigzag64(int64_t v)
+{
+	return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t unzigzag64(uint64_t v)
+{
+	return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static size_t varint_put(uint64_t v, uint8_t *out)
+{
+	size_t n = 0;
+
+	while (v >= 0x80) {
+		out[n++] = (uint8_t)v | 0x80;
+		v >>= 7;
+	}
+	out[n++] = (uint8_t)v;
+
+	return n;
+}
+
+/* Returns the bytes read, 0 if the varint is truncated or too long. */
+static size_t varint_get(const uint8_t *in, size_t len, uint64_t *v)
+{
+	uint64_t result = 0;
+
+	for (size_t n = 0; n < len && n < 10; n++) {
+		result |= (uint64_t)(in[n] & 0x7F) << (7 * n);
+		if (!(in[n] & 0x80)) {
+			*v = result;
+			return n + 1;
+		}
+	}
+
+	return 0;
+}
+
+static size_t header_put(const struct frame_codec_header *hdr, uint8_t *out)
+{
+	size_t n = 0;
+
+	out[n++] = FRAME_CODEC_VERSION;
+	out[n++] = hdr->channels;
+	out[n++] = (uint8_t)hdr->count;
+	out[n++] = (uint8_t)(hdr->count >> 8);
+	n += varint_put(zigzag64(hdr->timestamp_us), &out[n]);
+	n += varint_put(hdr->period_ns, &out[n]);
+	out[n++] = hdr->scale_count;
+
+	for (size_t i = 0; i < hdr->scale_count; i++) {
+		uint32_t bits;
+
+		memcpy(&bits, &hdr->scales[i].scale, sizeof(bits));
+		out[n++] = hdr->scales[i].channels;
+		out[n++] = (uint8_t)bits;
+		out[n++] = (uint8_t)(bits >> 8);
+		out[n++] = (uint8_t)(bits >> 16);
+		out[n++] = (uint8_t)(bits >> 24);
+	}
+
+	return n;
+}
+
+size_t frame_codec_encode(struct frame_codec_header *hdr, const int16_t *samples, size_t count,
+			  uint8_t *out, size_t size)
+{
+	uint8_t head[FRAME_CODEC_HEADER_MAX_SIZE];
+	uint8_t sample[FRAME_CODEC_SAMPLE_MAX_SIZE(FRAME_CODEC_MAX_CHANNELS)];
+	size_t head_len;
+	size_t n;
+	size_t i;
+
+	if (hdr->channels == 0 || hdr->channels > FRAME_CODEC_MAX_CHANNELS ||
+	    hdr->scale_count > FRAME_CODEC_MAX_SCALES) {
+		return 0;
+	}
+
+	/* The count goes into the header last, its size does not depend
+	 * on the value.
+	 */
+	head_len = header_put(hdr, head);
+	if (head_len >= size) {
+		return 0;
+	}
+
+	n = head_len;
+	count = count > UINT16_MAX ? UINT16_MAX : count;
+
+	for (i = 0; i < count; i++) {
+		const int16_t *cur = &samples[i * hdr->channels];
+		size_t len = 0;
+
+		for (size_t c = 0; c < hdr->channels; c++) {
+			int32_t prev = i ? samples[(i - 1) * hdr->channels + c] : 0;
+
+			len += varint_put(zigzag32(cur[c] - prev), &sample[len]);
+		}
+
+		if (n + len > size) {
+			break;
+		}
+		memcpy(&out[n], sample, len);
+		n += len;
+	}
+
+	if (i == 0) {
+		return 0;
+	}
+
+	hdr->count = (uint16_t)i;
+	memcpy(out, head, head_len);
+	out[2] = (uint8_t)hdr->count;
+	out[3] = (uint8_t)(hdr->count >> 8);
+
+	return n;
+}
+
+int frame_codec_decode(const uint8_t *in, size_t len, struct frame_codec_header *hdr,
+		       int16_t *samples, size_t max_samples)
+{
+	size_t n = 4;
+	size_t step;
+	uint64_t v;
+
+	if (len < 4 || in[0] != FRAME_CODEC_VERSION || in[1] == 0 ||
+	    in[1] > FRAME_CODEC_MAX_CHANNELS) {
+		return -EINVAL;
+	}
+
+	hdr->channels = in[1];
+	hdr->count = in[2] | (in[3] << 8);
+
+	step = varint_get(&in[n], len - n, &v);
+	if (step == 0) {
+		return -EINVAL;
+	}
+	hdr->timestamp_us = unzigzag64(v);
+	n += step;
+
+	step = varint_get(&in[n], len - n, &v);
+	if (step == 0 || v > UINT32_MAX) {
+		return -EINVAL;
+	}
+	hdr->period_ns = (uint32_t)v;
+	n += step;
+
+	if (n >= len || in[n] > FRAME_CODEC_MAX_SCALES) {
+		return -EINVAL;
+	}
+	hdr->scale_count = in[n++];
+
+	if (len - n < hdr->scale_count * 5U) {
+		return -EINVAL;
+	}
+	for (size_t i = 0; i < hdr->scale_count; i++) {
+		uint32_t bits = in[n + 1] | (in[n + 2] << 8) | (in[n + 3] << 16) |
+				((uint32_t)in[n + 4] << 24);
+
+		hdr->scales[i].channels = in[n];
+		memcpy(&hdr->scales[i].scale, &bits, sizeof(bits));
+		n += 5;
+	}
+
+	if (hdr->count > max_samples) {
+		return -ENOMEM;
+	}
+
+	for (size_t i = 0; i < (size_t)hdr->count * hdr->channels; i++) {
+		int32_t prev = i >= hdr->channels ? samples[i - hdr->channels] : 0;
+
+		step = varint_get(&in[n], len - n, &v);
+		if (step == 0 || v > UINT32_MAX) {
+			return -EINVAL;
+		}
+		samples[i] = (int16_t)(prev + unzigzag32((uint32_t)v));
+		n += step;
+	}
+
+	return (int)n;
+}
@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef FRAME_CODEC_H_
+#define FRAME_CODEC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Binary frame of raw int16 samples, shared by the firmware and the host
+ * tools. Plain C without Zephyr dependencies so that both can build it.
+ *
+ * Layout, multi-byte fields little endian:
+ *
+ *   u8      version, FRAME_CODEC_VERSION
+ *   u8      channels
+ *   u16     count, samples per channel
+ *   varint  zigzag of timestamp_us
+ *   varint  period_ns
+ *   u8      scale_count
+ *   scale_count times:
+ *     u8    channels of the group
+ *     f32   physical unit per count
+ *   count times channels varint, zigzag of the residuals
+ *
+ * Samples are interleaved, channels values per sample. Each residual is
+ * the difference to the previous sample of the same channel, the first
+ * sample of a frame to 0. A frame decodes on its own, so a lost frame does
+ * not affect the next one.
+ */
+
+#define FRAME_CODEC_VERSION 1
+
+#define FRAME_CODEC_MAX_CHANNELS 16
+#define FRAME_CODEC_MAX_SCALES   4
+
+/** Largest header, with every scale group in use. */
+#define FRAME_CODEC_HEADER_MAX_SIZE (4 + 10 + 5 + 1 + FRAME_CODEC_MAX_SCALES * 5)
+
+/** Largest encoding of one sample, a residual takes up to 3 bytes. */
+#define FRAME_CODEC_SAMPLE_MAX_SIZE(channels) (3 * (channels))
+
+/** Consecutive channels sharing one unit. */
+struct frame_codec_scale {
+	uint8_t channels;
+	/** Physical unit per raw count, such as g or deg/s. */
+	float scale;
+};
+
+struct frame_codec_header {
+	/** Values per sample. */
+	uint8_t channels;
+	/** Samples in the frame, set by frame_codec_encode(). */
+	uint16_t count;
+	/** Common time of the first sample. */
+	int64_t timestamp_us;
+	/** Time between two samples. */
+	uint32_t period_ns;
+	uint8_t scale_count;
+	struct frame_codec_scale scales[FRAME_CODEC_MAX_SCALES];
+};
+
+/**
+ * @brief Encode as many samples as fit into a buffer.
+ *
+ * @param hdr     Frame metadata, @ref frame_codec_header.count is set to
+ *                the number of samples encoded.
+ * @param samples @p count samples of hdr->channels values each.
+ * @param count   Samples available.
+ * @param out     Output buffer.
+ * @param size    Size of @p out.
+ *
+ * @return Bytes written, 0 if not even the header and one sample fit or
+ *         the header is invalid.
+ */
+size_t frame_codec_encode(struct frame_codec_header *hdr, const int16_t *samples, size_t count,
+			  uint8_t *out, size_t size);
+
+/**
+ * @brief Decode one frame.
+ *
+ * @param in          Encoded frame.
+ * @param len         Bytes available in @p in.
+ * @param hdr         Decoded metadata.
+ * @param samples     Output, hdr->channels values per sample.
+ * @param max_samples Samples that fit into @p samples.
+ *
+ * @return Bytes consumed, or a negative errno: -EINVAL for a malformed
+ *         frame, -ENOMEM if @p samples is too small.
+ */
+int frame_codec_decode(const uint8_t *in, size_t len, struct frame_codec_header *hdr,
+		       int16_t *samples, size_t max_samples);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FRAME_CODEC_H_ */
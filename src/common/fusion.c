@@ -0,0 +1,167 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <math.h>
+
+#include <zephyr/kernel.h>
+
+#include "fusion.h"
+#include "orientation.h"
+
+#define KP (CONFIG_APP_IMU_FUSION_KP_MILLI / 1000.0f)
+#define KI (CONFIG_APP_IMU_FUSION_KI_MILLI / 1000.0f)
+
+/* Accelerometer samples further than this from 1 g are dominated by the
+ * motion of the foot and only the gyroscope is integrated.
+ */
+#define ACC_REJECT (CONFIG_APP_IMU_FUSION_ACC_REJECT_MG / 1000.0f)
+
+/* Longest gap bridged by integration, beyond it the step is clamped. */
+#define DT_MAX 0.1f
+
+#define RAD_TO_CENTIDEG (18000.0f / 3.14159265f)
+
+static void quat_seed(struct fusion_quat *q, float ax, float ay, float az)
+{
+	/* Roll and pitch from gravity, zero yaw. */
+	float roll = atan2f(ay, az);
+	float pitch = atan2f(-ax, sqrtf(ay * ay + az * az));
+	float cr = cosf(roll * 0.5f);
+	float sr = sinf(roll * 0.5f);
+	float cp = cosf(pitch * 0.5f);
+	float sp = sinf(pitch * 0.5f);
+
+	q->w = cr * cp;
+	q->x = sr * cp;
+	q->y = cr * sp;
+	q->z = -sr * sp;
+}
+
+void fusion_init(struct fusion *f, const struct fusion_config *cfg)
+{
+	*f = (struct fusion){
+		.cfg = *cfg,
+		.q = {.w = 1.0f},
+		.decimation = MAX(cfg->odr_hz / MAX(cfg->output_hz, 1), 1),
+	};
+}
+
+static inline void frame_update(struct fusion *f, const struct imu_fifo_frame *frame, float dt)
+{
+	struct fusion_quat *q = &f->q;
+	float gx = frame->gyr[0] * f->cfg.gyr_scale;
+	float gy = frame->gyr[1] * f->cfg.gyr_scale;
+	float gz = frame->gyr[2] * f->cfg.gyr_scale;
+	float ax = frame->acc[0];
+	float ay = frame->acc[1];
+	float az = frame->acc[2];
+	float norm2 = ax * ax + ay * ay + az * az;
+	float g2 = f->cfg.acc_lsb_per_g * f->cfg.acc_lsb_per_g;
+
+	/* Compare squares, |a|^2 / g^2 - 1 ~ 2 (|a| / g - 1). */
+	if (norm2 > 0.0f && fabsf(norm2 - g2) < 2.0f * ACC_REJECT * g2) {
+		float recip = orientation_rsqrt(norm2);
+
+		ax *= recip;
+		ay *= recip;
+		az *= recip;
+
+		/* Gravity as the quaternion sees it. */
+		float vx = 2.0f * (q->x * q->z - q->w * q->y);
+		float vy = 2.0f * (q->w * q->x + q->y * q->z);
+		float vz = q->w * q->w - q->x * q->x - q->y * q->y + q->z * q->z;
+
+		float ex = ay * vz - az * vy;
+		float ey = az * vx - ax * vz;
+		float ez = ax * vy - ay * vx;
+
+		f->bias[0] += KI * ex * dt;
+		f->bias[1] += KI * ey * dt;
+		f->bias[2] += KI * ez * dt;
+
+		gx += KP * ex;
+		gy += KP * ey;
+		gz += KP * ez;
+	} else {
+		f->rejected++;
+	}
+
+	gx = (gx + f->bias[0]) * (0.5f * dt);
+	gy = (gy + f->bias[1]) * (0.5f * dt);
+	gz = (gz + f->bias[2]) * (0.5f * dt);
+
+	float qw = q->w;
+	float qx = q->x;
+	float qy = q->y;
+	float qz = q->z;
+
+	q->w = qw - qx * gx - qy * gy - qz * gz;
+	q->x = qx + qw * gx + qy * gz - qz * gy;
+	q->y = qy + qw * gy - qx * gz + qz * gx;
+	q->z = qz + qw * gz + qx * gy - qy * gx;
+
+	float recip = orientation_rsqrt(q->w * q->w + q->x * q->x + q->y * q->y + q->z * q->z);
+
+	q->w *= recip;
+	q->x *= recip;
+	q->y *= recip;
+	q->z *= recip;
+}
+
+void fusion_step(struct fusion *f, const struct imu_fifo_frame *frame)
+{
+	float dt = 1.0f / f->cfg.odr_hz;
+
+	if (!f->started) {
+		quat_seed(&f->q, frame->acc[0], frame->acc[1], frame->acc[2]);
+		f->started = true;
+	} else {
+		uint32_t ticks = (frame->sensortime - f->last_sensortime) &
+				 IMU_FIFO_SENSORTIME_MASK;
+
+		dt = MIN((float)ticks / IMU_FIFO_SENSORTIME_HZ, DT_MAX);
+	}
+	f->last_sensortime = frame->sensortime;
+	f->dt = dt;
+
+	frame_update(f, frame, dt);
+
+	if (++f->frames < f->decimation) {
+		return;
+	}
+	f->frames = 0;
+
+	if (f->cfg.output) {
+		struct fusion_output out = {
+			.q = f->q,
+			.sensortime = frame->sensortime,
+			.rejected = f->rejected,
+		};
+
+		f->cfg.output(&out);
+	}
+}
+
+void fusion_update(struct fusion *f, const struct imu_fifo_frame *frames, size_t count)
+{
+	for (size_t i = 0; i < count; i++) {
+		fusion_step(f, &frames[i]);
+	}
+}
+
+void fusion_euler_get(const struct fusion_quat *q, struct fusion_euler *out)
+{
+	float sinp = 2.0f * (q->w * q->y - q->z * q->x);
+
+	/* Only called at the output rate, libm precision is affordable. */
+	out->roll = (int16_t)lroundf(atan2f(2.0f * (q->w * q->x + q->y * q->z),
+					    1.0f - 2.0f * (q->x * q->x + q->y * q->y)) *
+				     RAD_TO_CENTIDEG);
+	out->pitch = (int16_t)lroundf(asinf(CLAMP(sinp, -1.0f, 1.0f)) * RAD_TO_CENTIDEG);
+	out->yaw = (int16_t)lroundf(atan2f(2.0f * (q->w * q->z + q->x * q->y),
+					   1.0f - 2.0f * (q->y * q->y + q->z * q->z)) *
+				    RAD_TO_CENTIDEG);
+}
@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef FUSION_H_
+#define FUSION_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "imu_fifo.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Unit quaternion rotating the sensor frame into the earth frame. */
+struct fusion_quat {
+	float w;
+	float x;
+	float y;
+	float z;
+};
+
+/** Orientation in hundredths of a degree. */
+struct fusion_euler {
+	int16_t roll;
+	int16_t pitch;
+	int16_t yaw;
+};
+
+/** One downsampled orientation. */
+struct fusion_output {
+	struct fusion_quat q;
+	/** Sensor time of the frame the orientation belongs to. */
+	uint32_t sensortime;
+	/** Frames whose accelerometer sample was left out of the correction. */
+	uint32_t rejected;
+};
+
+/**
+ * @brief Consumer of downsampled orientations.
+ *
+ * Called from fusion_update() for every output period.
+ */
+typedef void (*fusion_output_t)(const struct fusion_output *out);
+
+struct fusion_config {
+	/** Gyroscope scale in rad/s per count. */
+	float gyr_scale;
+	/** Accelerometer counts per g. */
+	float acc_lsb_per_g;
+	/** Rate of the frames fed to fusion_update(). */
+	uint32_t odr_hz;
+	/** Rate of the outputs, at most odr_hz. */
+	uint32_t output_hz;
+	fusion_output_t output;
+};
+
+/**
+ * Mahony filter state of one IMU.
+ *
+ * The gyroscope rates are integrated into the quaternion, and the
+ * difference between the measured and the estimated gravity direction
+ * is fed back through a PI controller. The integral term tracks the
+ * gyroscope bias.
+ */
+struct fusion {
+	struct fusion_config cfg;
+	struct fusion_quat q;
+	float bias[3];
+	/** Time step of the last frame in seconds. */
+	float dt;
+	uint32_t last_sensortime;
+	uint32_t rejected;
+	uint16_t decimation;
+	uint16_t frames;
+	bool started;
+};
+
+/**
+ * @brief Reset the filter.
+ *
+ * The first frame seeds the quaternion from the accelerometer tilt, with
+ * the yaw at zero.
+ */
+void fusion_init(struct fusion *f, const struct fusion_config *cfg);
+
+/**
+ * @brief Run the filter over one FIFO frame.
+ *
+ * For consumers that need the orientation of every frame, such as the
+ * dead reckoning.
+ */
+void fusion_step(struct fusion *f, const struct imu_fifo_frame *frame);
+
+/**
+ * @brief Run the filter over a batch of FIFO frames.
+ *
+ * The time step of every frame comes from the sensor time, so frames
+ * skipped by a full FIFO are bridged.
+ */
+void fusion_update(struct fusion *f, const struct imu_fifo_frame *frames, size_t count);
+
+/**
+ * @brief Convert a quaternion to roll, pitch and yaw.
+ */
+void fusion_euler_get(const struct fusion_quat *q, struct fusion_euler *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FUSION_H_ */
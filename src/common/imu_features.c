@@ -0,0 +1,284 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/drivers/i2c.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/byteorder.h>
+
+/* The driver header carries the configuration files of the feature
+ * engine, only the base one is uploaded here.
+ */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-const-variable"
+#include "bmi270_config_file.h"
+#pragma GCC diagnostic pop
+
+#include "imu_features.h"
+
+#define IMU_NODE DT_NODELABEL(bmi270)
+
+#define REG_INTERNAL_STATUS 0x21
+#define REG_FEAT_PAGE       0x2F
+#define REG_FEATURES        0x30
+#define REG_INT_LATCH       0x55
+#define REG_INT1_MAP_FEAT   0x56
+#define REG_INIT_CTRL       0x59
+#define REG_INIT_ADDR_0     0x5B
+#define REG_INIT_ADDR_1     0x5C
+#define REG_INIT_DATA       0x5E
+#define REG_PWR_CONF        0x7C
+
+#define INT_LATCH_EN            BIT(0)
+#define INTERNAL_STATUS_MASK    0x0F
+#define INTERNAL_STATUS_INIT_OK 0x01
+#define PWR_CONF_ADV_POWER_SAVE BIT(0)
+
+/* Register accesses after leaving advanced power save must wait for the
+ * interface to wake up.
+ */
+#define ADV_POWER_SAVE_EXIT_US 450
+
+/* The feature engine reports its status at most 20 ms after the upload. */
+#define INIT_TIMEOUT_MS 20
+
+/* The feature registers are a 16 byte window onto pages of the feature
+ * engine memory. Offsets are for the base configuration file.
+ */
+#define FEATURES_LEN 16
+
+#define PAGE_OUT     0
+#define OUT_STEPS    0x00
+#define OUT_ACTIVITY 0x04
+
+#define PAGE_ANY_MOTION 1
+#define ANY_MOTION_1    0x0C
+#define ANY_MOTION_2    0x0E
+
+#define PAGE_STEP   6
+#define STEP_CONFIG 0x02
+
+#define ANY_MOTION_DUR_MASK   0x1FFF
+#define ANY_MOTION_SEL_XYZ    (BIT(13) | BIT(14) | BIT(15))
+#define ANY_MOTION_THRES_MASK 0x07FF
+#define ANY_MOTION_EN         BIT(15)
+
+#define STEP_WATERMARK_MASK 0x03FF
+#define STEP_DET_EN         BIT(11)
+#define STEP_CNT_EN         BIT(12)
+#define STEP_ACT_EN         BIT(13)
+
+/* Threshold in 1 g / 2048, duration in 50 Hz samples. */
+#define ANY_MOTION_THRES (CONFIG_APP_IMU_FEATURES_ANY_MOTION_MG * 2048 / 1000)
+#define ANY_MOTION_DUR   (CONFIG_APP_IMU_FEATURES_ANY_MOTION_MS / 20)
+
+BUILD_ASSERT(ANY_MOTION_THRES <= ANY_MOTION_THRES_MASK, "any-motion threshold above 1 g");
+
+static const struct i2c_dt_spec bus = I2C_DT_SPEC_GET(IMU_NODE);
+
+static imu_features_handler_t features_handler;
+static atomic_t started;
+static struct imu_features_event state = {
+	.activity = IMU_ACTIVITY_UNKNOWN,
+};
+
+/* Low power mode sets advanced power save, in which the feature pages
+ * must not be accessed. It is cleared for the access and restored by
+ * power_save_restore().
+ */
+static int power_save_leave(uint8_t *pwr_conf)
+{
+	int err = i2c_reg_read_byte_dt(&bus, REG_PWR_CONF, pwr_conf);
+
+	if (err || !(*pwr_conf & PWR_CONF_ADV_POWER_SAVE)) {
+		return err;
+	}
+
+	err = i2c_reg_write_byte_dt(&bus, REG_PWR_CONF, *pwr_conf & ~PWR_CONF_ADV_POWER_SAVE);
+	k_busy_wait(ADV_POWER_SAVE_EXIT_US);
+
+	return err;
+}
+
+static int power_save_restore(uint8_t pwr_conf)
+{
+	if (!(pwr_conf & PWR_CONF_ADV_POWER_SAVE)) {
+		return 0;
+	}
+
+	return i2c_reg_write_byte_dt(&bus, REG_PWR_CONF, pwr_conf);
+}
+
+/* The stock driver uploads the maximum FIFO configuration, which has no
+ * step counter, activity or any-motion. The base one replaces it, the
+ * sensor registers set so far are kept.
+ */
+static int config_upload(void)
+{
+	uint8_t status = 0;
+	int err;
+
+	err = i2c_reg_write_byte_dt(&bus, REG_INIT_CTRL, 0);
+	err |= i2c_reg_write_byte_dt(&bus, REG_INIT_ADDR_0, 0);
+	err |= i2c_reg_write_byte_dt(&bus, REG_INIT_ADDR_1, 0);
+	err |= i2c_burst_write_dt(&bus, REG_INIT_DATA, bmi270_config_file_base,
+				  sizeof(bmi270_config_file_base));
+	err |= i2c_reg_write_byte_dt(&bus, REG_INIT_CTRL, 1);
+	if (err) {
+		return -EIO;
+	}
+
+	for (int i = 0; i < INIT_TIMEOUT_MS; i++) {
+		k_msleep(1);
+		err = i2c_reg_read_byte_dt(&bus, REG_INTERNAL_STATUS, &status);
+		if (err) {
+			return err;
+		}
+		if ((status & INTERNAL_STATUS_MASK) == INTERNAL_STATUS_INIT_OK) {
+			return 0;
+		}
+	}
+
+	printk("IMU feature engine not initialized (status 0x%02x)\n", status);
+
+	return -ETIMEDOUT;
+}
+
+static int page_read(uint8_t page, uint8_t buf[FEATURES_LEN])
+{
+	int err = i2c_reg_write_byte_dt(&bus, REG_FEAT_PAGE, page);
+
+	return err ? err : i2c_burst_read_dt(&bus, REG_FEATURES, buf, FEATURES_LEN);
+}
+
+static int page_update(uint8_t page, uint8_t offset, uint16_t mask, uint16_t value)
+{
+	uint8_t buf[FEATURES_LEN];
+	uint16_t word;
+	int err;
+
+	/* The window is written as a whole, the other features of the page
+	 * keep their values.
+	 */
+	err = page_read(page, buf);
+	if (err) {
+		return err;
+	}
+
+	word = sys_get_le16(&buf[offset]);
+	word = (word & ~mask) | (value & mask);
+	sys_put_le16(word, &buf[offset]);
+
+	return i2c_burst_write_dt(&bus, REG_FEATURES, buf, FEATURES_LEN);
+}
+
+static int outputs_read(void)
+{
+	uint8_t buf[FEATURES_LEN];
+	uint8_t pwr_conf;
+	int err;
+
+	err = power_save_leave(&pwr_conf);
+	if (!err) {
+		err = page_read(PAGE_OUT, buf);
+		err |= power_save_restore(pwr_conf);
+	}
+	if (err) {
+		return err;
+	}
+
+	unsigned int key = irq_lock();
+
+	state.steps = sys_get_le32(&buf[OUT_STEPS]);
+	state.activity = buf[OUT_ACTIVITY] & 0x03;
+	irq_unlock(key);
+
+	return 0;
+}
+
+void imu_features_irq(uint8_t status)
+{
+	/* The status is read for the watermark too, before the features
+	 * are configured.
+	 */
+	status &= IMU_FEATURES_STEP | IMU_FEATURES_ACTIVITY | IMU_FEATURES_ANY_MOTION;
+	if (!status || !atomic_get(&started)) {
+		return;
+	}
+
+	if (status & (IMU_FEATURES_STEP | IMU_FEATURES_ACTIVITY)) {
+		int err = outputs_read();
+
+		if (err) {
+			printk("IMU feature read failed (err %d)\n", err);
+		}
+	}
+
+	unsigned int key = irq_lock();
+
+	state.status = status;
+	irq_unlock(key);
+
+	if (features_handler) {
+		features_handler(&state);
+	}
+}
+
+int imu_features_start(imu_features_handler_t handler)
+{
+	uint8_t pwr_conf;
+	int err;
+
+	features_handler = handler;
+
+	err = power_save_leave(&pwr_conf);
+	if (err) {
+		return err;
+	}
+
+	err = config_upload();
+	if (err) {
+		power_save_restore(pwr_conf);
+		return err;
+	}
+
+	err = page_update(PAGE_ANY_MOTION, ANY_MOTION_1,
+			  ANY_MOTION_DUR_MASK | ANY_MOTION_SEL_XYZ,
+			  ANY_MOTION_DUR | ANY_MOTION_SEL_XYZ);
+	err |= page_update(PAGE_ANY_MOTION, ANY_MOTION_2, ANY_MOTION_THRES_MASK | ANY_MOTION_EN,
+			   ANY_MOTION_THRES | ANY_MOTION_EN);
+
+	/* Without a watermark the step interrupt fires on every step. */
+	err |= page_update(PAGE_STEP, STEP_CONFIG,
+			   STEP_WATERMARK_MASK | STEP_DET_EN | STEP_CNT_EN | STEP_ACT_EN,
+			   CONFIG_APP_IMU_FEATURES_STEP_WATERMARK | STEP_CNT_EN | STEP_ACT_EN |
+				   (CONFIG_APP_IMU_FEATURES_STEP_WATERMARK ? 0 : STEP_DET_EN));
+
+	/* Latched, so that a short feature pulse is not missed while the
+	 * level of the shared pin is high for the watermark.
+	 */
+	err |= i2c_reg_write_byte_dt(&bus, REG_INT_LATCH, INT_LATCH_EN);
+	err |= i2c_reg_write_byte_dt(&bus, REG_INT1_MAP_FEAT,
+				     IMU_FEATURES_STEP | IMU_FEATURES_ACTIVITY |
+					     IMU_FEATURES_ANY_MOTION);
+	err |= power_save_restore(pwr_conf);
+	if (err) {
+		return -EIO;
+	}
+
+	err = outputs_read();
+	atomic_set(&started, 1);
+
+	return err;
+}
+
+void imu_features_get(struct imu_features_event *evt)
+{
+	unsigned int key = irq_lock();
+
+	*evt = state;
+	irq_unlock(key);
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef IMU_FEATURES_H_
+#define IMU_FEATURES_H_
+
+#include <stdint.h>
+
+#include <zephyr/sys/util.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Feature interrupts, as in the INT_STATUS_0 register. */
+#define IMU_FEATURES_STEP       BIT(1)
+#define IMU_FEATURES_ACTIVITY   BIT(2)
+#define IMU_FEATURES_ANY_MOTION BIT(6)
+
+/** Activity classified by the feature engine. */
+enum imu_activity {
+	IMU_ACTIVITY_STILL,
+	IMU_ACTIVITY_WALKING,
+	IMU_ACTIVITY_RUNNING,
+	IMU_ACTIVITY_UNKNOWN,
+};
+
+struct imu_features_event {
+	/** IMU_FEATURES_* interrupts that fired. */
+	uint8_t status;
+	enum imu_activity activity;
+	/** Steps counted by the sensor since the start. */
+	uint32_t steps;
+};
+
+/**
+ * @brief Consumer of feature interrupts.
+ *
+ * Called from the IMU work queue.
+ */
+typedef void (*imu_features_handler_t)(const struct imu_features_event *evt);
+
+/**
+ * @brief Enable the step counter, step detector, activity recognition and
+ *        any-motion detection, and route them to INT1.
+ *
+ * Must be called after imu_fifo_start(), INT1 is shared with the FIFO
+ * watermark. The base configuration file of the feature engine is
+ * uploaded first, replacing the one of the BMI270 driver.
+ *
+ * @retval 0 on success.
+ * @retval -EIO on a bus error.
+ * @retval -ETIMEDOUT if the feature engine did not report init OK.
+ */
+int imu_features_start(imu_features_handler_t handler);
+
+/**
+ * @brief Serve the feature interrupts in @p status.
+ *
+ * Called by the FIFO driver from the IMU work queue.
+ */
+void imu_features_irq(uint8_t status);
+
+/**
+ * @brief Get the last activity and step count read from the sensor.
+ */
+void imu_features_get(struct imu_features_event *evt);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* IMU_FEATURES_H_ */
@@ -0,0 +1,624 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/drivers/gpio.h>
+#include <zephyr/drivers/i2c.h>
+#include <zephyr/init.h>
+#include <zephyr/rtio/rtio.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/byteorder.h>
+
+#if defined(CONFIG_APP_TIMEBASE_CAPTURE)
+#include <nrfx_gpiote.h>
+#endif
+
+#include "imu_fifo.h"
+#include "timebase.h"
+#if defined(CONFIG_APP_IMU_FEATURES)
+#include "imu_features.h"
+#endif
+
+#define IMU_NODE DT_NODELABEL(bmi270)
+
+#define REG_INT_STATUS_0  0x1C
+#define REG_FIFO_LENGTH_0 0x24
+#define REG_FIFO_DATA     0x26
+#define REG_FIFO_WTM_0    0x46
+#define REG_FIFO_WTM_1    0x47
+#define REG_FIFO_CONFIG_0 0x48
+#define REG_FIFO_CONFIG_1 0x49
+#define REG_INT1_IO_CTRL  0x53
+#define REG_INT_MAP_DATA  0x58
+#define REG_PWR_CONF      0x7C
+#define REG_CMD           0x7E
+
+#define FIFO_CONFIG_0_TIME_EN     BIT(1)
+#define FIFO_CONFIG_1_HEADER_EN   BIT(4)
+#define FIFO_CONFIG_1_ACC_EN      BIT(6)
+#define FIFO_CONFIG_1_GYR_EN      BIT(7)
+#define INT1_IO_CTRL_LVL          BIT(1)
+#define INT1_IO_CTRL_OUTPUT_EN    BIT(3)
+#define INT_MAP_DATA_FWM_INT1     BIT(1)
+#define PWR_CONF_FIFO_SELF_WAKEUP BIT(1)
+#define CMD_FIFO_FLUSH            0xB0
+
+#define FIFO_LENGTH_MASK 0x3FFF
+#define FIFO_SIZE        2048
+
+/* Frame headers in header mode. Regular frames carry the enabled sensors
+ * in the parameter bits, in the order aux, gyr, acc.
+ */
+#define FH_MODE_MASK       0xC0
+#define FH_MODE_REGULAR    0x80
+#define FH_PARM_AUX        BIT(4)
+#define FH_PARM_GYR        BIT(3)
+#define FH_PARM_ACC        BIT(2)
+#define FH_PARM_MASK       (FH_PARM_AUX | FH_PARM_GYR | FH_PARM_ACC)
+#define FH_SKIP            0x40
+#define FH_SENSORTIME      0x44
+#define FH_INPUT_CONFIG    0x48
+
+#define AXES_BYTES         6
+#define AUX_BYTES          8
+#define SENSORTIME_BYTES   3
+#define INPUT_CONFIG_BYTES 4
+
+#define FRAME_BYTES     (1 + 2 * AXES_BYTES)
+#define WATERMARK_BYTES (CONFIG_APP_IMU_FIFO_WATERMARK_FRAMES * FRAME_BYTES)
+#define MAX_FRAMES      (FIFO_SIZE / (1 + AXES_BYTES) + 1)
+
+BUILD_ASSERT(WATERMARK_BYTES < FIFO_SIZE, "watermark must leave room in the FIFO");
+
+/* Every regular frame is one tick of the faster sensor. */
+#define FRAME_ODR_HZ MAX(CONFIG_APP_IMU_ACC_ODR_HZ, CONFIG_APP_IMU_GYR_ODR_HZ)
+#define FRAME_PERIOD (IMU_FIFO_SENSORTIME_HZ / FRAME_ODR_HZ)
+
+BUILD_ASSERT(IMU_FIFO_SENSORTIME_HZ % FRAME_ODR_HZ == 0, "unsupported output data rate");
+
+/* Metadata in front of the FIFO bytes of every completed read. */
+struct fifo_buf_header {
+	/* Common time of the watermark interrupt. */
+	int64_t irq_us;
+	/* Uptime in ticks when the sensor time frame was read. */
+	int64_t read_timestamp;
+	uint32_t len;
+};
+
+/* A full FIFO plus the sensor time frame appended to the read. */
+#define FIFO_READ_MAX (FIFO_SIZE + 1 + SENSORTIME_BYTES)
+#define BUF_HDR_SIZE  ROUND_UP(sizeof(struct fifo_buf_header), 8)
+
+#define READ_DEPTH      IMU_FIFO_READS
+#define POOL_BLOCK_SIZE 64
+#define POOL_BLOCKS     (READ_DEPTH * DIV_ROUND_UP(BUF_HDR_SIZE + FIFO_READ_MAX, POOL_BLOCK_SIZE))
+
+static const struct i2c_dt_spec bus = I2C_DT_SPEC_GET(IMU_NODE);
+static const struct gpio_dt_spec irq_gpio = GPIO_DT_SPEC_GET(IMU_NODE, irq_gpios);
+
+#if defined(CONFIG_APP_IMU_FIFO_THREAD)
+RTIO_DEFINE_WITH_MEMPOOL(imu_rtio, READ_DEPTH, READ_DEPTH, POOL_BLOCKS, POOL_BLOCK_SIZE, 4);
+#endif
+
+K_THREAD_STACK_DEFINE(imu_work_q_stack, CONFIG_APP_IMU_WORKQ_STACK_SIZE);
+struct k_work_q imu_work_q;
+
+static struct gpio_callback irq_cb;
+static int64_t irq_us;
+
+#if defined(CONFIG_APP_TIMEBASE_CAPTURE)
+/* The edge interrupt runs on a GPIOTE channel, whose IN event the timer
+ * captures.
+ */
+static const nrfx_gpiote_t gpiote = NRFX_GPIOTE_INSTANCE(0);
+#define IRQ_PIN NRF_GPIO_PIN_MAP(DT_PROP(DT_GPIO_CTLR(IMU_NODE, irq_gpios), port), \
+				 DT_GPIO_PIN(IMU_NODE, irq_gpios))
+
+static uint8_t irq_capture;
+static bool irq_captured;
+#endif
+
+static imu_fifo_handler_t fifo_handler;
+static atomic_t running;
+
+/* Reads queued on the iodev, waiting for the next watermark. */
+static struct rtio_iodev_sqe *pending[READ_DEPTH];
+static size_t pending_head;
+static size_t pending_count;
+static atomic_t drain_wanted;
+
+static struct imu_fifo_frame frames[MAX_FRAMES];
+
+/* Sensor time between two frames, changed with the output data rate. */
+static uint32_t frame_period = FRAME_PERIOD;
+
+/* Values held for the sensor that did not contribute to a frame. */
+static struct imu_fifo_frame hold;
+static uint32_t last_sensortime;
+
+/* Maps the sensor time onto the common timebase. */
+static struct timebase_sync time_sync;
+
+static struct imu_fifo_stats stats;
+
+static void axes_get(const uint8_t *raw, int16_t axes[3])
+{
+	for (size_t i = 0; i < 3; i++) {
+		axes[i] = (int16_t)sys_get_le16(&raw[2 * i]);
+	}
+}
+
+static size_t fifo_parse(const uint8_t *raw, size_t len, bool *has_time, uint32_t *time,
+			 uint32_t *skipped)
+{
+	size_t count = 0;
+	size_t pos = 0;
+
+	while (pos < len) {
+		uint8_t hdr = raw[pos++];
+
+		if ((hdr & FH_MODE_MASK) == FH_MODE_REGULAR) {
+			size_t need = ((hdr & FH_PARM_AUX) ? AUX_BYTES : 0) +
+				      ((hdr & FH_PARM_GYR) ? AXES_BYTES : 0) +
+				      ((hdr & FH_PARM_ACC) ? AXES_BYTES : 0);
+
+			/* A header without sensors marks the end of the data. */
+			if (!(hdr & FH_PARM_MASK) || pos + need > len || count == MAX_FRAMES) {
+				break;
+			}
+
+			hold.flags = 0;
+			if (hdr & FH_PARM_AUX) {
+				pos += AUX_BYTES;
+			}
+			if (hdr & FH_PARM_GYR) {
+				axes_get(&raw[pos], hold.gyr);
+				hold.flags |= IMU_FIFO_FRAME_GYR;
+				pos += AXES_BYTES;
+			}
+			if (hdr & FH_PARM_ACC) {
+				axes_get(&raw[pos], hold.acc);
+				hold.flags |= IMU_FIFO_FRAME_ACC;
+				pos += AXES_BYTES;
+			}
+
+			frames[count++] = hold;
+			continue;
+		}
+
+		switch (hdr) {
+		case FH_SKIP:
+			if (pos < len) {
+				*skipped += raw[pos];
+			}
+			pos += 1;
+			break;
+
+		case FH_SENSORTIME:
+			if (pos + SENSORTIME_BYTES <= len) {
+				*time = sys_get_le24(&raw[pos]);
+				*has_time = true;
+			}
+			pos += SENSORTIME_BYTES;
+			break;
+
+		case FH_INPUT_CONFIG:
+			pos += INPUT_CONFIG_BYTES;
+			break;
+
+		default:
+			return count;
+		}
+	}
+
+	return count;
+}
+
+static void frames_timestamp(size_t count, bool has_time, uint32_t time)
+{
+	/* The sensor time frame is captured when the read empties the FIFO,
+	 * which is within one frame period of the last sample.
+	 */
+	if (!has_time) {
+		time = last_sensortime + count * frame_period;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		frames[i].sensortime = (time - (count - 1 - i) * frame_period) &
+				       IMU_FIFO_SENSORTIME_MASK;
+	}
+
+	last_sensortime = time;
+}
+
+static struct rtio_iodev_sqe *pending_pop(void)
+{
+	struct rtio_iodev_sqe *iodev_sqe = NULL;
+	unsigned int key = irq_lock();
+
+	if (pending_count) {
+		iodev_sqe = pending[pending_head];
+		pending_head = (pending_head + 1) % READ_DEPTH;
+		pending_count--;
+	}
+
+	irq_unlock(key);
+
+	return iodev_sqe;
+}
+
+static int fifo_read(struct rtio_iodev_sqe *iodev_sqe)
+{
+	struct fifo_buf_header hdr = {
+		.irq_us = irq_us,
+	};
+	uint8_t len_raw[2];
+	uint32_t buf_len;
+	uint8_t *buf;
+	size_t len;
+	int err;
+
+	err = i2c_burst_read_dt(&bus, REG_FIFO_LENGTH_0, len_raw, sizeof(len_raw));
+	if (err) {
+		return err;
+	}
+
+	len = sys_get_le16(len_raw) & FIFO_LENGTH_MASK;
+
+	/* Read past the last frame to also get the sensor time frame. */
+	len = MIN(len + 1 + SENSORTIME_BYTES, FIFO_READ_MAX);
+
+	err = rtio_sqe_rx_buf(iodev_sqe, BUF_HDR_SIZE + len, BUF_HDR_SIZE + len, &buf, &buf_len);
+	if (err) {
+		return err;
+	}
+
+	/* The bytes go straight into the pool buffer the processing thread
+	 * decodes from.
+	 */
+	err = i2c_burst_read_dt(&bus, REG_FIFO_DATA, &buf[BUF_HDR_SIZE], len);
+	if (err) {
+		return err;
+	}
+
+	hdr.read_timestamp = k_uptime_ticks();
+	hdr.len = len;
+	memcpy(buf, &hdr, sizeof(hdr));
+
+	return 0;
+}
+
+static void drain_work_handler(struct k_work *work)
+{
+	ARG_UNUSED(work);
+
+	if (!atomic_get(&running)) {
+		return;
+	}
+
+#if defined(CONFIG_APP_IMU_FEATURES)
+	uint8_t status;
+
+	/* The feature interrupts share INT1 with the watermark. Reading the
+	 * status releases the latched ones.
+	 */
+	if (i2c_reg_read_byte_dt(&bus, REG_INT_STATUS_0, &status) == 0 && status) {
+		imu_features_irq(status);
+	}
+#endif
+
+	struct rtio_iodev_sqe *iodev_sqe = pending_pop();
+
+	if (iodev_sqe == NULL) {
+		/* The processing thread still holds both buffers, the FIFO
+		 * keeps the frames until it queues the next read.
+		 */
+		atomic_set(&drain_wanted, 1);
+
+		/* A read queued between the pop and the flag would not see
+		 * the flag.
+		 */
+		if (pending_count && atomic_cas(&drain_wanted, 1, 0)) {
+			k_work_submit_to_queue(&imu_work_q, work);
+		}
+		return;
+	}
+
+	int err = fifo_read(iodev_sqe);
+
+	if (err) {
+		rtio_iodev_sqe_err(iodev_sqe, err);
+	} else {
+		rtio_iodev_sqe_ok(iodev_sqe, 0);
+	}
+
+	/* Frames that arrived during the read keep the level interrupt
+	 * asserted without a new edge.
+	 */
+	if (gpio_pin_get_dt(&irq_gpio) > 0) {
+		k_work_submit_to_queue(&imu_work_q, work);
+	}
+}
+
+static K_WORK_DEFINE(drain_work, drain_work_handler);
+
+static void fifo_submit(struct rtio_iodev_sqe *iodev_sqe)
+{
+	unsigned int key = irq_lock();
+
+	if (pending_count == READ_DEPTH) {
+		irq_unlock(key);
+		rtio_iodev_sqe_err(iodev_sqe, -ENOMEM);
+		return;
+	}
+
+	pending[(pending_head + pending_count) % READ_DEPTH] = iodev_sqe;
+	pending_count++;
+
+	irq_unlock(key);
+
+	if (atomic_cas(&drain_wanted, 1, 0)) {
+		k_work_submit_to_queue(&imu_work_q, &drain_work);
+	}
+}
+
+static const struct rtio_iodev_api fifo_iodev_api = {
+	.submit = fifo_submit,
+};
+
+RTIO_IODEV_DEFINE(imu_fifo_iodev, &fifo_iodev_api, NULL);
+
+void imu_fifo_process(const uint8_t *buf, size_t buf_len)
+{
+	struct fifo_buf_header hdr;
+	struct imu_fifo_batch batch = {
+		.frames = frames,
+	};
+	bool has_time = false;
+	uint32_t time = 0;
+
+	if (buf_len < BUF_HDR_SIZE) {
+		return;
+	}
+
+	memcpy(&hdr, buf, sizeof(hdr));
+	if (hdr.len > buf_len - BUF_HDR_SIZE) {
+		return;
+	}
+
+	batch.irq_us = hdr.irq_us;
+	batch.count = fifo_parse(&buf[BUF_HDR_SIZE], hdr.len, &has_time, &time, &batch.skipped);
+	frames_timestamp(batch.count, has_time, time);
+
+	/* The sensor time frame is latched during the read, so the end of
+	 * the read bounds when the sensor had that time.
+	 */
+	if (has_time) {
+		timebase_sync_update(&time_sync, time, timebase_ticks_to_us(hdr.read_timestamp));
+	}
+
+	if (batch.count) {
+		batch.timestamp_us = timebase_sync_us(&time_sync, frames[0].sensortime);
+		batch.frame_period_ns = frame_period * timebase_sync_period_ns(&time_sync);
+	}
+
+	stats.bursts++;
+	stats.frames += batch.count;
+	stats.skipped += batch.skipped;
+
+	if (batch.count && fifo_handler) {
+		fifo_handler(&batch);
+	}
+}
+
+int64_t imu_fifo_time_us(uint32_t sensortime)
+{
+	return timebase_sync_us(&time_sync, sensortime);
+}
+
+static void irq_handler(const struct device *port, struct gpio_callback *cb, uint32_t pins)
+{
+	ARG_UNUSED(port);
+	ARG_UNUSED(cb);
+	ARG_UNUSED(pins);
+
+#if defined(CONFIG_APP_TIMEBASE_CAPTURE)
+	irq_us = irq_captured ? timebase_capture_us(irq_capture) : timebase_now_us();
+#else
+	irq_us = timebase_now_us();
+#endif
+	k_work_submit_to_queue(&imu_work_q, &drain_work);
+}
+
+#if defined(CONFIG_APP_IMU_FIFO_THREAD)
+static void read_queue(void)
+{
+	struct rtio_sqe *sqe = rtio_sqe_acquire(&imu_rtio);
+
+	if (sqe == NULL) {
+		return;
+	}
+
+	rtio_sqe_prep_read_with_pool(sqe, &imu_fifo_iodev, RTIO_PRIO_NORM, NULL);
+}
+
+static void fifo_thread(void)
+{
+	for (size_t i = 0; i < READ_DEPTH; i++) {
+		read_queue();
+	}
+	rtio_submit(&imu_rtio, 0);
+
+	/* The I2C transfer of the next burst runs in the IMU work queue
+	 * while this thread decodes the previous one.
+	 */
+	for (;;) {
+		struct rtio_cqe *cqe = rtio_cqe_consume_block(&imu_rtio);
+		int result = cqe->result;
+		uint8_t *buf = NULL;
+		uint32_t len = 0;
+		int err;
+
+		err = rtio_cqe_get_mempool_buffer(&imu_rtio, cqe, &buf, &len);
+		rtio_cqe_release(&imu_rtio, cqe);
+
+		if (result < 0 || err) {
+			if (result != -ECANCELED) {
+				printk("IMU FIFO read failed (err %d)\n", result < 0 ? result : err);
+			}
+		} else {
+			imu_fifo_process(buf, len);
+		}
+
+		if (buf) {
+			rtio_release_buffer(&imu_rtio, buf, len);
+		}
+
+		read_queue();
+		rtio_submit(&imu_rtio, 0);
+	}
+}
+
+K_THREAD_DEFINE(imu_fifo_thread, CONFIG_APP_IMU_FIFO_THREAD_STACK_SIZE, fifo_thread, NULL, NULL,
+		NULL, CONFIG_APP_IMU_FIFO_THREAD_PRIORITY, 0, 0);
+#endif
+
+static int imu_work_q_init(void)
+{
+	static const struct k_work_queue_config cfg = {
+		.name = "imu_workq",
+	};
+
+	k_work_queue_start(&imu_work_q, imu_work_q_stack, K_THREAD_STACK_SIZEOF(imu_work_q_stack),
+			   CONFIG_APP_IMU_WORKQ_PRIORITY, &cfg);
+
+	return 0;
+}
+
+SYS_INIT(imu_work_q_init, POST_KERNEL, CONFIG_KERNEL_INIT_PRIORITY_DEFAULT);
+
+int imu_fifo_start(const struct device *dev, imu_fifo_handler_t handler)
+{
+	int err;
+
+	if (!device_is_ready(dev) || !i2c_is_ready_dt(&bus) || !gpio_is_ready_dt(&irq_gpio)) {
+		return -ENODEV;
+	}
+
+	fifo_handler = handler;
+	timebase_sync_init(&time_sync, IMU_FIFO_SENSORTIME_HZ, 24);
+
+	err = gpio_pin_configure_dt(&irq_gpio, GPIO_INPUT);
+	if (err) {
+		return err;
+	}
+
+	gpio_init_callback(&irq_cb, irq_handler, BIT(irq_gpio.pin));
+	err = gpio_add_callback(irq_gpio.port, &irq_cb);
+	if (err) {
+		return err;
+	}
+
+	/* Advanced power save would add a wakeup delay to every register
+	 * access, the FIFO keeps filling on its own.
+	 */
+	err = i2c_reg_write_byte_dt(&bus, REG_PWR_CONF, PWR_CONF_FIFO_SELF_WAKEUP);
+	err |= i2c_reg_write_byte_dt(&bus, REG_FIFO_WTM_0, WATERMARK_BYTES & 0xFF);
+	err |= i2c_reg_write_byte_dt(&bus, REG_FIFO_WTM_1, WATERMARK_BYTES >> 8);
+	err |= i2c_reg_write_byte_dt(&bus, REG_FIFO_CONFIG_0, FIFO_CONFIG_0_TIME_EN);
+	err |= i2c_reg_write_byte_dt(&bus, REG_FIFO_CONFIG_1,
+				     FIFO_CONFIG_1_HEADER_EN | FIFO_CONFIG_1_ACC_EN |
+					     FIFO_CONFIG_1_GYR_EN);
+	err |= i2c_reg_write_byte_dt(&bus, REG_INT1_IO_CTRL,
+				     INT1_IO_CTRL_LVL | INT1_IO_CTRL_OUTPUT_EN);
+	err |= i2c_reg_update_byte_dt(&bus, REG_INT_MAP_DATA, INT_MAP_DATA_FWM_INT1,
+				      INT_MAP_DATA_FWM_INT1);
+	err |= i2c_reg_write_byte_dt(&bus, REG_CMD, CMD_FIFO_FLUSH);
+	if (err) {
+		return -EIO;
+	}
+
+	atomic_set(&running, 1);
+
+	err = gpio_pin_interrupt_configure_dt(&irq_gpio, GPIO_INT_EDGE_TO_ACTIVE);
+	if (err) {
+		return err;
+	}
+
+#if defined(CONFIG_APP_TIMEBASE_CAPTURE)
+	uint8_t channel;
+
+	/* A pin on the port SENSE mechanism has no event of its own, the
+	 * interrupt handler latches the time then.
+	 */
+	if (!irq_captured && nrfx_gpiote_channel_get(&gpiote, IRQ_PIN, &channel) == NRFX_SUCCESS) {
+		irq_captured = !timebase_capture_attach(
+			nrfx_gpiote_in_event_address_get(&gpiote, IRQ_PIN), &irq_capture);
+	}
+#endif
+
+	return 0;
+}
+
+int imu_fifo_stop(void)
+{
+	int err;
+
+	atomic_set(&running, 0);
+
+	err = gpio_pin_interrupt_configure_dt(&irq_gpio, GPIO_INT_DISABLE);
+	k_work_cancel(&drain_work);
+
+#if defined(CONFIG_APP_TIMEBASE_CAPTURE)
+	if (irq_captured) {
+		timebase_capture_detach(irq_capture);
+		irq_captured = false;
+	}
+#endif
+
+	err |= i2c_reg_update_byte_dt(&bus, REG_INT_MAP_DATA, INT_MAP_DATA_FWM_INT1, 0);
+	err |= i2c_reg_write_byte_dt(&bus, REG_FIFO_CONFIG_1, 0);
+	err |= i2c_reg_write_byte_dt(&bus, REG_CMD, CMD_FIFO_FLUSH);
+
+	return err ? -EIO : 0;
+}
+
+int imu_fifo_rate_set(uint32_t frame_hz, uint16_t watermark_frames, bool gyr)
+{
+	size_t watermark = watermark_frames * (1 + AXES_BYTES + (gyr ? AXES_BYTES : 0));
+	int err;
+
+	if (frame_hz == 0 || IMU_FIFO_SENSORTIME_HZ % frame_hz || watermark >= FIFO_SIZE) {
+		return -EINVAL;
+	}
+
+	err = i2c_reg_write_byte_dt(&bus, REG_FIFO_CONFIG_1,
+				    FIFO_CONFIG_1_HEADER_EN | FIFO_CONFIG_1_ACC_EN |
+					    (gyr ? FIFO_CONFIG_1_GYR_EN : 0));
+	err |= i2c_reg_write_byte_dt(&bus, REG_FIFO_WTM_0, watermark & 0xFF);
+	err |= i2c_reg_write_byte_dt(&bus, REG_FIFO_WTM_1, watermark >> 8);
+	err |= i2c_reg_update_byte_dt(&bus, REG_INT_MAP_DATA, INT_MAP_DATA_FWM_INT1,
+				      watermark ? INT_MAP_DATA_FWM_INT1 : 0);
+
+	/* Drop the frames of the old rate, so that every batch has a single
+	 * frame period.
+	 */
+	err |= i2c_reg_write_byte_dt(&bus, REG_CMD, CMD_FIFO_FLUSH);
+	if (err) {
+		return -EIO;
+	}
+
+	frame_period = IMU_FIFO_SENSORTIME_HZ / frame_hz;
+
+	return 0;
+}
+
+void imu_fifo_stats_get(struct imu_fifo_stats *out)
+{
+	*out = stats;
+}
@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef IMU_FIFO_H_
+#define IMU_FIFO_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <zephyr/device.h>
+#include <zephyr/kernel.h>
+#include <zephyr/rtio/rtio.h>
+#include <zephyr/sys/util.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Sensor time runs at 25.6 kHz and wraps at 24 bits. */
+#define IMU_FIFO_SENSORTIME_HZ   25600
+#define IMU_FIFO_SENSORTIME_MASK 0xFFFFFF
+
+/** Reads the iodev holds, one collects frames while the other is decoded. */
+#define IMU_FIFO_READS 2
+
+/** Frame flags, set for the sensors that produced a new sample. */
+#define IMU_FIFO_FRAME_ACC BIT(0)
+#define IMU_FIFO_FRAME_GYR BIT(1)
+
+/**
+ * One FIFO frame in raw sensor counts.
+ *
+ * When the two sensors run at different rates, the slower one holds its
+ * last value in the frames it did not contribute to.
+ */
+struct imu_fifo_frame {
+	int16_t acc[3];
+	int16_t gyr[3];
+	/** Sensor time of the sample, see IMU_FIFO_SENSORTIME_HZ. */
+	uint32_t sensortime;
+	uint8_t flags;
+};
+
+/** All frames drained by one burst read. */
+struct imu_fifo_batch {
+	const struct imu_fifo_frame *frames;
+	size_t count;
+	/** Common time of the watermark interrupt, see timebase.h. */
+	int64_t irq_us;
+	/** Common time of the first frame, see timebase.h. */
+	int64_t timestamp_us;
+	/** Time between two frames, as measured against the timebase. */
+	uint32_t frame_period_ns;
+	/** Frames the sensor dropped because the FIFO was full. */
+	uint32_t skipped;
+};
+
+/**
+ * @brief Consumer of drained batches.
+ *
+ * Called from the thread that calls imu_fifo_process(), the batch is only
+ * valid until the callback returns.
+ */
+typedef void (*imu_fifo_handler_t)(const struct imu_fifo_batch *batch);
+
+struct imu_fifo_stats {
+	/** Watermark interrupts served. */
+	uint32_t bursts;
+	/** Frames delivered. */
+	uint32_t frames;
+	/** Frames lost to FIFO overflow. */
+	uint32_t skipped;
+};
+
+/**
+ * RTIO device completing one burst read per read.
+ *
+ * With APP_IMU_FIFO_THREAD the module queues the reads itself. Otherwise
+ * queue reads with a pool buffer (rtio_sqe_prep_read_with_pool()) and hand
+ * the completed buffers to imu_fifo_process().
+ */
+extern struct rtio_iodev imu_fifo_iodev;
+
+/**
+ * Work queue of the burst reads. Other work that accesses the sensor runs
+ * here too, so that it is serialized with the reads.
+ */
+extern struct k_work_q imu_work_q;
+
+/**
+ * @brief Enable the FIFO and the watermark interrupt.
+ *
+ * The accelerometer and gyroscope must already be configured and running
+ * through the sensor API.
+ *
+ * @param dev     BMI270 device.
+ * @param handler Callback receiving every drained batch.
+ *
+ * @retval 0 on success.
+ * @retval -ENODEV if the bus or the interrupt GPIO is not ready.
+ * @retval -EIO on a bus error.
+ */
+int imu_fifo_start(const struct device *dev, imu_fifo_handler_t handler);
+
+/**
+ * @brief Decode a completed read and pass the batch to the handler.
+ *
+ * The frames are timestamped from the sensor time, so the buffers must be
+ * processed in the order they completed.
+ */
+void imu_fifo_process(const uint8_t *buf, size_t len);
+
+/**
+ * @brief Get the common time of a sensor time, see timebase.h.
+ *
+ * Only valid from the thread that calls imu_fifo_process().
+ */
+int64_t imu_fifo_time_us(uint32_t sensortime);
+
+/**
+ * @brief Disable the watermark interrupt and flush the FIFO.
+ */
+int imu_fifo_stop(void);
+
+/**
+ * @brief Follow a change of the output data rate.
+ *
+ * Must be called after the sensor rates were changed through the sensor
+ * API. The FIFO is flushed, so that every batch has one frame period.
+ *
+ * @param frame_hz         Rate of the faster enabled sensor.
+ * @param watermark_frames Frames per watermark interrupt, 0 to disable the
+ *                         interrupt while the FIFO keeps collecting.
+ * @param gyr              Whether the gyroscope is enabled.
+ *
+ * @retval 0 on success.
+ * @retval -EINVAL if the rate or the watermark is not supported.
+ * @retval -EIO on a bus error.
+ */
+int imu_fifo_rate_set(uint32_t frame_hz, uint16_t watermark_frames, bool gyr);
+
+/**
+ * @brief Get the FIFO counters.
+ */
+void imu_fifo_stats_get(struct imu_fifo_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* IMU_FIFO_H_ */
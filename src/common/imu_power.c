@@ -0,0 +1,269 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/drivers/i2c.h>
+#include <zephyr/drivers/sensor.h>
+#include <zephyr/sys/atomic.h>
+
+#include "imu_power.h"
+#include "timebase.h"
+
+#define IMU_NODE DT_NODELABEL(bmi270)
+
+#define REG_ACC_CONF 0x40
+#define REG_PWR_CONF 0x7C
+
+#define ACC_CONF_FILTER_PERF      BIT(7)
+#define PWR_CONF_ADV_POWER_SAVE   BIT(0)
+#define PWR_CONF_FIFO_SELF_WAKEUP BIT(1)
+
+/* Register writes after leaving advanced power save must wait for the
+ * interface to wake up.
+ */
+#define ADV_POWER_SAVE_EXIT_US 450
+
+#define PERF_HZ MAX(CONFIG_APP_IMU_ACC_ODR_HZ, CONFIG_APP_IMU_GYR_ODR_HZ)
+#define LOW_HZ  CONFIG_APP_IMU_POWER_LOW_ODR_HZ
+
+/* The watermark stays on in low power mode, so the frames are checked
+ * for activity even when the any-motion interrupt of the feature engine
+ * is not available.
+ */
+#define LOW_WATERMARK_FRAMES MAX(LOW_HZ * CONFIG_APP_IMU_POWER_LOW_LATENCY_MS / 1000, 1)
+
+#if defined(CONFIG_APP_IMU_FEATURES)
+BUILD_ASSERT(LOW_HZ >= 50, "the feature engine needs at least 50 Hz");
+#endif
+
+#define GYR_REST_RAD_S (CONFIG_APP_IMU_POWER_GYR_REST_DPS * 3.14159265f / 180.0f)
+#define ACC_REST       (CONFIG_APP_IMU_POWER_ACC_REST_MG / 1000.0f)
+#define ACC_WAKE       (CONFIG_APP_IMU_POWER_ACC_WAKE_MG / 1000.0f)
+
+static const struct i2c_dt_spec bus = I2C_DT_SPEC_GET(IMU_NODE);
+
+static const struct device *imu_dev;
+static struct imu_power_config config;
+
+static enum imu_power_mode mode = IMU_POWER_PERF;
+static atomic_t wanted = ATOMIC_INIT(IMU_POWER_PERF);
+
+/* Only touched by the FIFO processing thread. */
+static uint32_t rest_frames;
+static int16_t last_acc[3];
+
+/* Activity reported by other sensors, restarts the rest timeout. */
+static atomic_t activity;
+
+/* Common time of the first active sample of a pending wakeup. */
+static int64_t wake_requested_us;
+static int64_t mode_entered;
+
+static struct imu_power_stats stats;
+
+static void work_handler(struct k_work *work);
+
+static K_WORK_DEFINE(mode_work, work_handler);
+
+static int sensor_odr_set(enum sensor_channel chan, int32_t hz)
+{
+	struct sensor_value odr = {.val1 = hz};
+
+	return sensor_attr_set(imu_dev, chan, SENSOR_ATTR_SAMPLING_FREQUENCY, &odr);
+}
+
+static int low_enter(void)
+{
+	int err;
+
+	/* Suspending the gyroscope saves most of the current, the
+	 * accelerometer alone runs in duty cycled low power mode.
+	 */
+	err = sensor_odr_set(SENSOR_CHAN_GYRO_XYZ, 0);
+	err |= sensor_odr_set(SENSOR_CHAN_ACCEL_XYZ, LOW_HZ);
+	err |= i2c_reg_update_byte_dt(&bus, REG_ACC_CONF, ACC_CONF_FILTER_PERF, 0);
+	err |= imu_fifo_rate_set(LOW_HZ, LOW_WATERMARK_FRAMES, false);
+	err |= i2c_reg_write_byte_dt(&bus, REG_PWR_CONF,
+				     PWR_CONF_ADV_POWER_SAVE | PWR_CONF_FIFO_SELF_WAKEUP);
+
+	return err ? -EIO : 0;
+}
+
+static int perf_enter(void)
+{
+	int err;
+
+	err = i2c_reg_write_byte_dt(&bus, REG_PWR_CONF, PWR_CONF_FIFO_SELF_WAKEUP);
+	if (err) {
+		return err;
+	}
+	k_busy_wait(ADV_POWER_SAVE_EXIT_US);
+
+	err = sensor_odr_set(SENSOR_CHAN_ACCEL_XYZ, CONFIG_APP_IMU_ACC_ODR_HZ);
+	err |= i2c_reg_update_byte_dt(&bus, REG_ACC_CONF, ACC_CONF_FILTER_PERF,
+				      ACC_CONF_FILTER_PERF);
+	err |= sensor_odr_set(SENSOR_CHAN_GYRO_XYZ, CONFIG_APP_IMU_GYR_ODR_HZ);
+	err |= imu_fifo_rate_set(PERF_HZ, CONFIG_APP_IMU_FIFO_WATERMARK_FRAMES, true);
+
+	return err ? -EIO : 0;
+}
+
+static void work_handler(struct k_work *work)
+{
+	ARG_UNUSED(work);
+
+	enum imu_power_mode target = atomic_get(&wanted);
+	int64_t now;
+	int err;
+
+	if (target == mode) {
+		return;
+	}
+
+	now = k_uptime_ticks();
+	err = target == IMU_POWER_PERF ? perf_enter() : low_enter();
+	if (err) {
+		printk("IMU mode change failed (err %d)\n", err);
+		atomic_set(&wanted, mode);
+		return;
+	}
+
+	unsigned int key = irq_lock();
+
+	stats.time_in_mode_ms[mode] += k_ticks_to_ms_floor32(now - mode_entered);
+	mode_entered = k_uptime_ticks();
+	mode = target;
+
+	if (mode == IMU_POWER_PERF) {
+		uint32_t latency = timebase_now_us() - wake_requested_us;
+
+		stats.wakeups++;
+		stats.wake_latency_us = latency;
+		stats.wake_latency_max_us = MAX(stats.wake_latency_max_us, latency);
+	} else {
+		stats.sleeps++;
+	}
+
+	irq_unlock(key);
+
+	if (config.changed) {
+		config.changed(mode);
+	}
+}
+
+static void wake_request(int64_t sample_us)
+{
+	if (atomic_cas(&wanted, IMU_POWER_LOW, IMU_POWER_PERF)) {
+		wake_requested_us = sample_us;
+		k_work_submit_to_queue(&imu_work_q, &mode_work);
+	}
+}
+
+static bool frame_resting(const struct imu_fifo_frame *frame)
+{
+	float gx = frame->gyr[0] * config.gyr_scale;
+	float gy = frame->gyr[1] * config.gyr_scale;
+	float gz = frame->gyr[2] * config.gyr_scale;
+	float ax = frame->acc[0];
+	float ay = frame->acc[1];
+	float az = frame->acc[2];
+	float g2 = config.acc_lsb_per_g * config.acc_lsb_per_g;
+
+	return gx * gx + gy * gy + gz * gz < GYR_REST_RAD_S * GYR_REST_RAD_S &&
+	       fabsf(ax * ax + ay * ay + az * az - g2) < 2.0f * ACC_REST * g2;
+}
+
+static bool frame_active(const struct imu_fifo_frame *frame)
+{
+	float wake = ACC_WAKE * config.acc_lsb_per_g;
+	float d2 = 0.0f;
+
+	/* Any change of the gravity vector between two low rate samples,
+	 * from a tilt as well as from a push.
+	 */
+	for (size_t i = 0; i < 3; i++) {
+		float d = frame->acc[i] - last_acc[i];
+
+		d2 += d * d;
+		last_acc[i] = frame->acc[i];
+	}
+
+	return d2 > wake * wake;
+}
+
+void imu_power_batch(const struct imu_fifo_batch *batch)
+{
+	if (imu_dev == NULL || batch->count == 0) {
+		return;
+	}
+
+	if (atomic_get(&wanted) == IMU_POWER_LOW) {
+		uint32_t period_us = USEC_PER_SEC / LOW_HZ;
+
+		for (size_t i = 0; i < batch->count; i++) {
+			if (frame_active(&batch->frames[i])) {
+				/* The interrupt time belongs to its last frame. */
+				wake_request(batch->irq_us - (batch->count - 1 - i) * period_us);
+				break;
+			}
+		}
+		return;
+	}
+
+	if (atomic_clear(&activity)) {
+		rest_frames = 0;
+	}
+
+	for (size_t i = 0; i < batch->count; i++) {
+		rest_frames = frame_resting(&batch->frames[i]) ? rest_frames + 1 : 0;
+	}
+
+	if (rest_frames >= PERF_HZ * CONFIG_APP_IMU_POWER_REST_MS / MSEC_PER_SEC &&
+	    atomic_cas(&wanted, IMU_POWER_PERF, IMU_POWER_LOW)) {
+		const struct imu_fifo_frame *last = &batch->frames[batch->count - 1];
+
+		rest_frames = 0;
+		memcpy(last_acc, last->acc, sizeof(last_acc));
+		k_work_submit_to_queue(&imu_work_q, &mode_work);
+	}
+}
+
+void imu_power_activity_report(void)
+{
+	atomic_set(&activity, 1);
+	wake_request(timebase_now_us());
+}
+
+int imu_power_init(const struct device *dev, const struct imu_power_config *cfg)
+{
+	if (!i2c_is_ready_dt(&bus)) {
+		return -ENODEV;
+	}
+
+	config = *cfg;
+	mode_entered = k_uptime_ticks();
+	imu_dev = dev;
+
+	return 0;
+}
+
+enum imu_power_mode imu_power_mode_get(void)
+{
+	return mode;
+}
+
+void imu_power_stats_get(struct imu_power_stats *out)
+{
+	unsigned int key = irq_lock();
+
+	*out = stats;
+	out->time_in_mode_ms[mode] += k_ticks_to_ms_floor32(k_uptime_ticks() - mode_entered);
+
+	irq_unlock(key);
+}
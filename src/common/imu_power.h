@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef IMU_POWER_H_
+#define IMU_POWER_H_
+
+#include <stdint.h>
+
+#include <zephyr/device.h>
+
+#include "imu_fifo.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum imu_power_mode {
+	/** Accelerometer alone at a low rate, gyroscope suspended. */
+	IMU_POWER_LOW,
+	/** Accelerometer and gyroscope at the full rate. */
+	IMU_POWER_PERF,
+
+	IMU_POWER_MODE_COUNT,
+};
+
+/**
+ * @brief Mode change notification.
+ *
+ * Called from the IMU work queue once the sensor runs in @p mode.
+ */
+typedef void (*imu_power_mode_t)(enum imu_power_mode mode);
+
+struct imu_power_config {
+	/** Accelerometer counts per g. */
+	float acc_lsb_per_g;
+	/** Gyroscope scale in rad/s per count. */
+	float gyr_scale;
+	imu_power_mode_t changed;
+};
+
+struct imu_power_stats {
+	/** Time spent in each mode, including the current one. */
+	uint32_t time_in_mode_ms[IMU_POWER_MODE_COUNT];
+	/** Switches to the low power mode. */
+	uint32_t sleeps;
+	/** Switches to the performance mode. */
+	uint32_t wakeups;
+	/**
+	 * Time from the first active sample to the gyroscope running, for
+	 * the last and the slowest wakeup.
+	 */
+	uint32_t wake_latency_us;
+	uint32_t wake_latency_max_us;
+};
+
+/**
+ * @brief Start the mode controller.
+ *
+ * The sensor must already run in the performance mode with the FIFO
+ * started.
+ */
+int imu_power_init(const struct device *dev, const struct imu_power_config *cfg);
+
+/**
+ * @brief Look for activity or rest in a batch of FIFO frames.
+ *
+ * A mode change is scheduled on the IMU work queue.
+ */
+void imu_power_batch(const struct imu_fifo_batch *batch);
+
+/**
+ * @brief Report activity seen by another sensor, such as the sole
+ *        pressure pads.
+ *
+ * Wakes the IMU and restarts the rest timeout. Can be called from any
+ * context.
+ */
+void imu_power_activity_report(void);
+
+enum imu_power_mode imu_power_mode_get(void);
+
+void imu_power_stats_get(struct imu_power_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* IMU_POWER_H_ */
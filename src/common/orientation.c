@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <math.h>
+
+#include <zephyr/kernel.h>
+
+#include "orientation.h"
+
+/* atan(a) ~ pi/4 a + a (1 - a) (0.2447 + 0.0663 a) on [0, 1], within
+ * 0.0015 rad. The coefficients are scaled to degrees.
+ */
+#define ATAN_C0 45.0f
+#define ATAN_C1 14.0203f
+#define ATAN_C2 3.7987f
+
+/* atan2(y, x) in degrees for x >= 0, which is all the tilt needs. */
+static inline float atan2_pos_deg(float y, float x)
+{
+	float ay = fabsf(y);
+	float hi = ay > x ? ay : x;
+	float lo = ay > x ? x : ay;
+	float a = hi > 0.0f ? lo / hi : 0.0f;
+	float deg = a * (ATAN_C0 + (1.0f - a) * (ATAN_C1 + ATAN_C2 * a));
+
+	if (ay > x) {
+		deg = 90.0f - deg;
+	}
+
+	return y < 0.0f ? -deg : deg;
+}
+
+static inline int16_t centideg(float deg)
+{
+	return (int16_t)(deg * 100.0f + (deg < 0.0f ? -0.5f : 0.5f));
+}
+
+static inline void tilt_compute(int16_t ax, int16_t ay, int16_t az, struct orientation_tilt *out)
+{
+	/* 16-bit counts convert exactly, but their squares need up to 30
+	 * bits and are rounded above 4096 counts. The relative error of
+	 * 2^-24 is far below the centidegree output.
+	 */
+	float x = ax;
+	float y = ay;
+	float z = az;
+	float xz = x * x + z * z;
+	float yz = y * y + z * z;
+
+	out->pitch = centideg(atan2_pos_deg(y, xz * orientation_rsqrt(xz)));
+	out->roll = centideg(atan2_pos_deg(-x, yz * orientation_rsqrt(yz)));
+}
+
+void orientation_tilt_get(const int16_t acc[3], struct orientation_tilt *out)
+{
+	tilt_compute(acc[0], acc[1], acc[2], out);
+}
+
+void orientation_tilt_batch(const struct imu_fifo_frame *frames, size_t count,
+			    struct orientation_tilt *out)
+{
+	for (size_t i = 0; i < count; i++) {
+		tilt_compute(frames[i].acc[0], frames[i].acc[1], frames[i].acc[2], &out[i]);
+	}
+}
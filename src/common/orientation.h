@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef ORIENTATION_H_
+#define ORIENTATION_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "imu_fifo.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Tilt of the board from the gravity vector, in hundredths of a degree.
+ *
+ * Both angles are within +-90 degrees. Pitch turns around the x axis and
+ * roll around the y axis, like the original polled loop.
+ */
+struct orientation_tilt {
+	int16_t pitch;
+	int16_t roll;
+};
+
+/**
+ * @brief Fast inverse square root.
+ *
+ * Initial guess from the exponent bits, refined by one Newton step. The
+ * relative error stays below 0.18 %, and 0 maps to a finite value so that
+ * x * orientation_rsqrt(x) is 0.
+ */
+static inline float orientation_rsqrt(float x)
+{
+	float y;
+	uint32_t i;
+
+	memcpy(&i, &x, sizeof(i));
+	i = 0x5f375a86 - (i >> 1);
+	memcpy(&y, &i, sizeof(y));
+
+	return y * (1.5f - 0.5f * x * y * y);
+}
+
+/**
+ * @brief Tilt of one accelerometer sample.
+ *
+ * The angles only depend on the direction of the vector, so the sample
+ * can be in raw counts of any range, or in any other unit that fits in
+ * 16 bits.
+ *
+ * @param acc Acceleration along x, y and z.
+ * @param out Resulting tilt.
+ */
+void orientation_tilt_get(const int16_t acc[3], struct orientation_tilt *out);
+
+/**
+ * @brief Tilt of every frame of a FIFO batch.
+ *
+ * @param frames Frames with raw accelerometer counts.
+ * @param count  Number of frames.
+ * @param out    Array of @p count results.
+ */
+void orientation_tilt_batch(const struct imu_fifo_frame *frames, size_t count,
+			    struct orientation_tilt *out);
+
+#if defined(CONFIG_APP_IMU_ORIENTATION_BENCH)
+/**
+ * @brief Compare the cycles per sample of the kernel with the double
+ *        precision sensor_value path it replaces, and print the result.
+ *
+ * With the fusion enabled, the cost of the filter per frame is printed
+ * as well.
+ */
+void orientation_bench_run(void);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ORIENTATION_H_ */
@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <zephyr/kernel.h>
+
+#if defined(CONFIG_APP_TIMEBASE_CAPTURE)
+#include <nrfx_timer.h>
+#include <helpers/nrfx_gppi.h>
+#endif
+
+#include "timebase.h"
+
+/* A latch further off than this is a gap, not jitter. */
+#define RESYNC_US 5000
+
+/* Sensor oscillators are trimmed to a few percent at worst. */
+#define RATE_LIMIT 0.05f
+
+/* Loop gains as shifts. Early latches are closer to the real sample time,
+ * late ones carry interrupt latency, so the offset follows early latches
+ * faster.
+ */
+#define OFFSET_EARLY_SHIFT 2
+#define OFFSET_LATE_SHIFT  5
+#define RATE_SHIFT         7
+
+void timebase_sync_init(struct timebase_sync *sync, uint32_t hz, uint8_t bits)
+{
+	*sync = (struct timebase_sync){
+		.shift = 32 - bits,
+		.us_per_count = (float)USEC_PER_SEC / hz,
+		.nominal_us_per_count = (float)USEC_PER_SEC / hz,
+	};
+}
+
+static int32_t count_delta(const struct timebase_sync *sync, uint32_t count)
+{
+	return (int32_t)((count - sync->ref_count) << sync->shift) >> sync->shift;
+}
+
+void timebase_sync_update(struct timebase_sync *sync, uint32_t count, int64_t latched_us)
+{
+	int32_t delta = count_delta(sync, count);
+
+	if (sync->valid && delta <= 0) {
+		return;
+	}
+
+	float elapsed = delta * sync->us_per_count;
+	int64_t err = latched_us - (sync->ref_us + (int64_t)elapsed);
+
+	if (!sync->valid || err > RESYNC_US || err < -RESYNC_US) {
+		if (sync->valid) {
+			sync->resyncs++;
+		}
+		sync->ref_us = latched_us;
+		sync->ref_count = count;
+		sync->valid = true;
+		return;
+	}
+
+	float rate = sync->us_per_count * (1.0f + (float)err / elapsed / (1 << RATE_SHIFT));
+	float low = sync->nominal_us_per_count * (1.0f - RATE_LIMIT);
+	float high = sync->nominal_us_per_count * (1.0f + RATE_LIMIT);
+
+	sync->us_per_count = CLAMP(rate, low, high);
+	sync->ref_us += (int64_t)elapsed +
+			(err < 0 ? err >> OFFSET_EARLY_SHIFT : err >> OFFSET_LATE_SHIFT);
+	sync->ref_count = count;
+}
+
+int64_t timebase_sync_us(const struct timebase_sync *sync, uint32_t count)
+{
+	return sync->ref_us + (int64_t)(count_delta(sync, count) * sync->us_per_count);
+}
+
+uint32_t timebase_sync_period_ns(const struct timebase_sync *sync)
+{
+	return (uint32_t)(sync->us_per_count * NSEC_PER_USEC);
+}
+
+#if defined(CONFIG_APP_TIMEBASE_CAPTURE)
+
+/* TIMER0 belongs to the radio (MPSL), TIMER2 clocks the SAADC. */
+static const nrfx_timer_t capture_timer = NRFX_TIMER_INSTANCE(3);
+
+/* CC0 latches the counter from software, the others the events. */
+#define CAPTURE_NOW   NRF_TIMER_CC_CHANNEL0
+#define CAPTURE_SLOTS (TIMER3_CC_NUM - 1)
+#define CAPTURE_CC(slot) ((nrf_timer_cc_channel_t)(NRF_TIMER_CC_CHANNEL1 + (slot)))
+
+/* Well inside the half of the 32-bit range that timebase_sync maps. */
+#define CAPTURE_GAP_US (1LL << 30)
+
+static struct {
+	uint8_t ppi_channel;
+	bool used;
+} capture_slots[CAPTURE_SLOTS];
+static uint8_t capture_users;
+
+/* Timer counts to the common timebase, nudged by every read. */
+static struct timebase_sync capture_sync;
+static int64_t capture_synced_us;
+
+static void capture_timer_handler(nrf_timer_event_t event_type, void *p_context)
+{
+	/* Only captures, no compare interrupt is enabled. */
+	ARG_UNUSED(event_type);
+	ARG_UNUSED(p_context);
+}
+
+static int capture_timer_start(void)
+{
+	nrfx_timer_config_t timer_config = NRFX_TIMER_DEFAULT_CONFIG(1000000);
+	nrfx_err_t err;
+
+	timer_config.bit_width = NRF_TIMER_BIT_WIDTH_32;
+
+	err = nrfx_timer_init(&capture_timer, &timer_config, capture_timer_handler);
+	if (err != NRFX_SUCCESS) {
+		printk("Capture timer init failed (err 0x%08x)\n", err);
+		return -EIO;
+	}
+
+	timebase_sync_init(&capture_sync, USEC_PER_SEC, 32);
+	nrfx_timer_enable(&capture_timer);
+
+	return 0;
+}
+
+int timebase_capture_attach(uint32_t event_address, uint8_t *slot)
+{
+	uint8_t i;
+	int err;
+
+	for (i = 0; i < CAPTURE_SLOTS && capture_slots[i].used; i++) {
+	}
+
+	if (i == CAPTURE_SLOTS) {
+		return -ENOMEM;
+	}
+
+	if (capture_users == 0) {
+		err = capture_timer_start();
+		if (err) {
+			return err;
+		}
+	}
+
+	if (nrfx_gppi_channel_alloc(&capture_slots[i].ppi_channel) != NRFX_SUCCESS) {
+		printk("No free PPI channel for the capture timer\n");
+		if (capture_users == 0) {
+			nrfx_timer_uninit(&capture_timer);
+		}
+		return -EIO;
+	}
+
+	nrfx_gppi_channel_endpoints_setup(
+		capture_slots[i].ppi_channel, event_address,
+		nrfx_timer_capture_task_address_get(&capture_timer, CAPTURE_CC(i)));
+	nrfx_gppi_channels_enable(BIT(capture_slots[i].ppi_channel));
+
+	capture_slots[i].used = true;
+	capture_users++;
+	*slot = i;
+
+	return 0;
+}
+
+void timebase_capture_detach(uint8_t slot)
+{
+	if (slot >= CAPTURE_SLOTS || !capture_slots[slot].used) {
+		return;
+	}
+
+	nrfx_gppi_channels_disable(BIT(capture_slots[slot].ppi_channel));
+	nrfx_gppi_channel_free(capture_slots[slot].ppi_channel);
+	capture_slots[slot].used = false;
+
+	if (--capture_users == 0) {
+		nrfx_timer_disable(&capture_timer);
+		nrfx_timer_uninit(&capture_timer);
+	}
+}
+
+int64_t timebase_capture_us(uint8_t slot)
+{
+	unsigned int key = irq_lock();
+	uint32_t now = nrfx_timer_capture(&capture_timer, CAPTURE_NOW);
+	int64_t now_us = timebase_now_us();
+	uint32_t event = nrfx_timer_capture_get(&capture_timer, CAPTURE_CC(slot));
+	int64_t event_us;
+
+	/* After a long gap the counter may have wrapped past the range
+	 * the mapping can tell apart, start it over.
+	 */
+	if (now_us - capture_synced_us > CAPTURE_GAP_US) {
+		timebase_sync_init(&capture_sync, USEC_PER_SEC, 32);
+	}
+
+	timebase_sync_update(&capture_sync, now, now_us);
+	capture_synced_us = now_us;
+	event_us = timebase_sync_us(&capture_sync, event);
+
+	irq_unlock(key);
+
+	return event_us;
+}
+
+#endif /* CONFIG_APP_TIMEBASE_CAPTURE */
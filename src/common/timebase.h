@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef TIMEBASE_H_
+#define TIMEBASE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <zephyr/kernel.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Convert system ticks to the common timebase.
+ *
+ * All sensors are timestamped in microseconds of uptime. The system timer
+ * runs from the 32 kHz RTC, which keeps counting in System ON sleep.
+ */
+static inline int64_t timebase_ticks_to_us(int64_t ticks)
+{
+	return k_ticks_to_us_floor64(ticks);
+}
+
+/**
+ * @brief Latch the common timebase, cheap enough for interrupt handlers.
+ */
+static inline int64_t timebase_now_us(void)
+{
+	return timebase_ticks_to_us(k_uptime_ticks());
+}
+
+/**
+ * Mapping of a sensor sample counter onto the common timebase.
+ *
+ * The counter is the sample clock of the sensor, such as the BMI270
+ * sensor time or the index of an SAADC scan. Each latch of the common
+ * timebase taken when a known count was reached nudges the offset and
+ * the rate of the mapping. The latches are late by the interrupt
+ * latency, the mapping is not, so samples inside a batch get evenly
+ * spaced timestamps without the jitter of the latches.
+ */
+struct timebase_sync {
+	int64_t ref_us;
+	uint32_t ref_count;
+	/** 32 minus the width of the counter, to sign-extend deltas. */
+	uint8_t shift;
+	float us_per_count;
+	float nominal_us_per_count;
+	bool valid;
+	/** Latches too far off the mapping, which restarted it. */
+	uint32_t resyncs;
+};
+
+/**
+ * @brief Prepare a mapping.
+ *
+ * @param sync Mapping.
+ * @param hz   Nominal counter rate.
+ * @param bits Counter width, the counter wraps at 2^bits.
+ */
+void timebase_sync_init(struct timebase_sync *sync, uint32_t hz, uint8_t bits);
+
+/**
+ * @brief Feed a latch of the common timebase.
+ *
+ * @param sync       Mapping.
+ * @param count      Counter value of the latched sample.
+ * @param latched_us Common time at which the sample was seen.
+ */
+void timebase_sync_update(struct timebase_sync *sync, uint32_t count, int64_t latched_us);
+
+/**
+ * @brief Common time of a counter value.
+ *
+ * Counter values up to half the counter range away from the last latch
+ * are mapped, in both directions.
+ */
+int64_t timebase_sync_us(const struct timebase_sync *sync, uint32_t count);
+
+/**
+ * @brief Current sample period in nanoseconds.
+ */
+uint32_t timebase_sync_period_ns(const struct timebase_sync *sync);
+
+#if defined(CONFIG_APP_TIMEBASE_CAPTURE)
+
+/*
+ * Hardware latches of the common timebase.
+ *
+ * A free-running 1 MHz TIMER is captured over PPI by a peripheral event,
+ * so a latch is taken at the event itself, not when its interrupt handler
+ * gets to run. Each read also maps the timer onto the common timebase
+ * with a timebase_sync, which averages out the 30 us steps of the system
+ * timer. The timer only runs while an event is attached.
+ */
+
+/**
+ * @brief Capture the timer on every @p event_address event.
+ *
+ * @param event_address Address of the peripheral event.
+ * @param slot          Set to the capture slot to read.
+ *
+ * @retval 0       Success.
+ * @retval -ENOMEM All capture slots are in use.
+ * @retval -EIO    No timer or PPI channel.
+ */
+int timebase_capture_attach(uint32_t event_address, uint8_t *slot);
+
+/**
+ * @brief Stop capturing on a slot, and the timer with the last one.
+ */
+void timebase_capture_detach(uint8_t slot);
+
+/**
+ * @brief Common time of the last event of a slot.
+ *
+ * Cheap enough for interrupt handlers. Call it before the event can
+ * happen again, the next one overwrites the capture.
+ */
+int64_t timebase_capture_us(uint8_t slot);
+
+#endif /* CONFIG_APP_TIMEBASE_CAPTURE */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TIMEBASE_H_ */
@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <math.h>
+
+#include <zephyr/kernel.h>
+
+#include "zupt.h"
+
+#define GRAVITY 9.80665f
+
+#define TRACE_PERIOD 0.01f
+
+#define GYR_STILL_RAD_S (CONFIG_APP_ZUPT_GYR_STILL_DPS * 3.14159265f / 180.0f)
+#define ACC_STILL       (CONFIG_APP_ZUPT_ACC_STILL_MG / 1000.0f)
+#define STILL_TIME      (CONFIG_APP_ZUPT_STILL_MS / 1000.0f)
+#define SWING_MIN       (CONFIG_APP_ZUPT_SWING_MIN_MS / 1000.0f)
+#define STRIDE_MAX      (CONFIG_APP_ZUPT_STRIDE_MAX_MS / 1000.0f)
+
+void zupt_init(struct zupt *z, zupt_stride_t stride)
+{
+	*z = (struct zupt){
+		.stride = stride,
+		.stance = true,
+	};
+}
+
+void zupt_pressure_set(struct zupt *z, bool loaded)
+{
+	z->pressure_used = true;
+	z->pressure_loaded = loaded;
+}
+
+static bool frame_still(const struct zupt *z, const struct fusion *f,
+			const struct imu_fifo_frame *frame)
+{
+	float gx = frame->gyr[0] * f->cfg.gyr_scale;
+	float gy = frame->gyr[1] * f->cfg.gyr_scale;
+	float gz = frame->gyr[2] * f->cfg.gyr_scale;
+	float ax = frame->acc[0];
+	float ay = frame->acc[1];
+	float az = frame->acc[2];
+	float g2 = f->cfg.acc_lsb_per_g * f->cfg.acc_lsb_per_g;
+
+	if (z->pressure_used && !z->pressure_loaded) {
+		return false;
+	}
+
+	return gx * gx + gy * gy + gz * gz < GYR_STILL_RAD_S * GYR_STILL_RAD_S &&
+	       fabsf(ax * ax + ay * ay + az * az - g2) < 2.0f * ACC_STILL * g2;
+}
+
+static void swing_integrate(struct zupt *z, const struct fusion *f,
+			    const struct imu_fifo_frame *frame)
+{
+	const struct fusion_quat *q = &f->q;
+	float scale = GRAVITY / f->cfg.acc_lsb_per_g;
+	float ax = frame->acc[0] * scale;
+	float ay = frame->acc[1] * scale;
+	float az = frame->acc[2] * scale;
+	float dt = f->dt;
+
+	/* Sensor to earth frame, the rows of the rotation matrix of q. */
+	float ex = (1.0f - 2.0f * (q->y * q->y + q->z * q->z)) * ax +
+		   2.0f * (q->x * q->y - q->w * q->z) * ay + 2.0f * (q->x * q->z + q->w * q->y) * az;
+	float ey = 2.0f * (q->x * q->y + q->w * q->z) * ax +
+		   (1.0f - 2.0f * (q->x * q->x + q->z * q->z)) * ay +
+		   2.0f * (q->y * q->z - q->w * q->x) * az;
+	float ez = 2.0f * (q->x * q->z - q->w * q->y) * ax + 2.0f * (q->y * q->z + q->w * q->x) * ay +
+		   (1.0f - 2.0f * (q->x * q->x + q->y * q->y)) * az - GRAVITY;
+
+	/* Trapezoidal position, rectangular velocity. */
+	z->pos[0] += (z->vel[0] + 0.5f * ex * dt) * dt;
+	z->pos[1] += (z->vel[1] + 0.5f * ey * dt) * dt;
+	z->pos[2] += (z->vel[2] + 0.5f * ez * dt) * dt;
+	z->vel[0] += ex * dt;
+	z->vel[1] += ey * dt;
+	z->vel[2] += ez * dt;
+
+	z->swing_time += dt;
+	z->trace_acc += dt;
+
+	if (z->trace_acc >= TRACE_PERIOD && z->trace_len < ZUPT_TRACE_LEN) {
+		z->trace_acc -= TRACE_PERIOD;
+		z->trace_z[z->trace_len] = z->pos[2];
+		z->trace_t[z->trace_len] = z->swing_time;
+		z->trace_len++;
+	}
+}
+
+static void stride_finish(struct zupt *z, uint32_t sensortime)
+{
+	float t = z->swing_time;
+	float clearance = 0.0f;
+
+	/* The velocity error grew linearly from 0 over the swing, so the
+	 * position error at time s is v s^2 / (2 t), t / 2 at the end.
+	 */
+	float dx = z->pos[0] - z->vel[0] * t * 0.5f;
+	float dy = z->pos[1] - z->vel[1] * t * 0.5f;
+
+	for (uint16_t i = 0; i < z->trace_len; i++) {
+		float s = z->trace_t[i];
+		float height = z->trace_z[i] - z->vel[2] * s * s / (2.0f * t);
+
+		clearance = MAX(clearance, height);
+	}
+
+	float length = sqrtf(dx * dx + dy * dy);
+	float duration = z->stride_time;
+
+	struct zupt_stride stride = {
+		.sensortime = sensortime,
+		.length_mm = (uint16_t)MIN(length * 1000.0f, UINT16_MAX),
+		.speed_mm_s = (uint16_t)MIN(length * 1000.0f / duration, UINT16_MAX),
+		.clearance_mm = (uint16_t)MIN(clearance * 1000.0f, UINT16_MAX),
+		.duration_ms = (uint16_t)MIN(duration * 1000.0f, UINT16_MAX),
+	};
+
+	if (z->stride) {
+		z->stride(&stride);
+	}
+}
+
+static void zupt_frame(struct zupt *z, const struct fusion *f, const struct imu_fifo_frame *frame)
+{
+	bool still = frame_still(z, f, frame);
+
+	z->still_frames = still ? MIN(z->still_frames + 1, UINT16_MAX) : 0;
+	z->stride_time += f->dt;
+
+	if (z->stance) {
+		if (still) {
+			return;
+		}
+
+		/* Lift-off, integrate from rest. */
+		z->stance = false;
+		z->swing_time = 0.0f;
+		z->trace_acc = 0.0f;
+		z->trace_len = 0;
+		for (size_t i = 0; i < 3; i++) {
+			z->vel[i] = 0.0f;
+			z->pos[i] = 0.0f;
+		}
+	}
+
+	swing_integrate(z, f, frame);
+
+	if (z->still_frames * f->dt < STILL_TIME) {
+		return;
+	}
+
+	/* Foot-flat. A short swing is a shuffle rather than a step, and
+	 * the first stride or one after a long pause has no start.
+	 */
+	z->stance = true;
+
+	if (z->swing_time >= SWING_MIN && z->has_stride && z->stride_time <= STRIDE_MAX) {
+		stride_finish(z, frame->sensortime);
+	}
+
+	z->has_stride = true;
+	z->stride_time = 0.0f;
+}
+
+void zupt_update(struct zupt *z, struct fusion *f, const struct imu_fifo_frame *frames,
+		 size_t count)
+{
+	for (size_t i = 0; i < count; i++) {
+		fusion_step(f, &frames[i]);
+		zupt_frame(z, f, &frames[i]);
+	}
+}
@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef ZUPT_H_
+#define ZUPT_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fusion.h"
+#include "imu_fifo.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Trace of the swing phase kept for the clearance, at 100 Hz. */
+#define ZUPT_TRACE_LEN 128
+
+/** One stride, from the start of a foot-flat phase to the next. */
+struct zupt_stride {
+	/** Sensor time at the start of the foot-flat phase ending the stride. */
+	uint32_t sensortime;
+	/** Horizontal distance covered by the foot. */
+	uint16_t length_mm;
+	/** Length over the duration of the whole stride. */
+	uint16_t speed_mm_s;
+	/** Highest point of the foot above the previous foot-flat position. */
+	uint16_t clearance_mm;
+	uint16_t duration_ms;
+};
+
+/**
+ * @brief Consumer of strides.
+ *
+ * Called from zupt_update() when a foot-flat phase starts.
+ */
+typedef void (*zupt_stride_t)(const struct zupt_stride *stride);
+
+/**
+ * Strapdown integration of one foot, reset on every foot-flat phase.
+ *
+ * During the swing, the accelerometer is rotated into the earth frame
+ * with the fused orientation and integrated twice. The foot is at rest
+ * while flat on the ground, so any velocity left at that point is drift,
+ * and it is removed from the stride assuming it grew linearly.
+ */
+struct zupt {
+	zupt_stride_t stride;
+	float vel[3];
+	float pos[3];
+	/** Time since the end of the last foot-flat phase, in seconds. */
+	float swing_time;
+	/** Time since the start of the last foot-flat phase, in seconds. */
+	float stride_time;
+	float trace_z[ZUPT_TRACE_LEN];
+	float trace_t[ZUPT_TRACE_LEN];
+	float trace_acc;
+	uint16_t trace_len;
+	uint16_t still_frames;
+	bool stance;
+	bool has_stride;
+	/** Set once a pressure signal is fed, then it gates the detection. */
+	bool pressure_used;
+	bool pressure_loaded;
+};
+
+/**
+ * @brief Reset the dead reckoning, the foot is assumed to be flat.
+ */
+void zupt_init(struct zupt *z, zupt_stride_t stride);
+
+/**
+ * @brief Report whether the sole pressure sensors see the foot loaded.
+ *
+ * Applies to the frames of the next zupt_update() calls, so the loading
+ * must be known at their time. Without a pressure signal, foot-flat is
+ * detected from the gyroscope alone.
+ */
+void zupt_pressure_set(struct zupt *z, bool loaded);
+
+/**
+ * @brief Run the orientation filter and the dead reckoning over a batch.
+ *
+ * @param z      Dead reckoning state.
+ * @param f      Orientation filter of the same IMU.
+ * @param frames FIFO frames.
+ * @param count  Number of frames.
+ */
+void zupt_update(struct zupt *z, struct fusion *f, const struct imu_fifo_frame *frames,
+		 size_t count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ZUPT_H_ */
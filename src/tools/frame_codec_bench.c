@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * Host benchmark of the frame codec in src/common.
+ *
+ * Encodes one second of the gait stream aggregate (50 frames of three
+ * acceleration, three rotation and two pressure channels) and compares
+ * the size against raw int16 and the printk text of the IMU application,
+ * then measures the encode and decode throughput. Build and run with:
+ *
+ *   cc -O2 -I src/common src/tools/frame_codec_bench.c src/common/frame_codec.c -lm \
+ *      -o frame_codec_bench && ./frame_codec_bench
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "frame_codec.h"
+
+#define RATE_HZ  50
+#define CHANNELS 8
+#define ROUNDS   20000
+
+/* The ranges the batteryless application runs the BMI270 at. */
+#define ACC_RANGE_G   16
+#define GYR_RANGE_DPS 2000
+
+/* One notification with the 498 byte MTU. */
+#define PACKET_SIZE 495
+
+static int16_t window[RATE_HZ][CHANNELS];
+static int16_t decoded[RATE_HZ][CHANNELS];
+static uint8_t encoded[RATE_HZ * FRAME_CODEC_SAMPLE_MAX_SIZE(CHANNELS) + FRAME_CODEC_HEADER_MAX_SIZE];
+
+static int16_t clamp16(double v)
+{
+	return v > INT16_MAX ? INT16_MAX : v < INT16_MIN ? INT16_MIN : (int16_t)lround(v);
+}
+
+static double noise(double amplitude)
+{
+	return amplitude * ((double)rand() / RAND_MAX - 0.5);
+}
+
+/* Walking at one stride per second: gravity plus the swing on the
+ * accelerometer, the swing on the gyroscope and a heel and a forefoot
+ * pressure pulse during stance.
+ */
+static void window_generate(void)
+{
+	const double acc_lsb = 32768.0 / ACC_RANGE_G;
+	const double gyr_lsb = 32768.0 / GYR_RANGE_DPS;
+
+	for (int i = 0; i < RATE_HZ; i++) {
+		double phase = 2.0 * M_PI * i / RATE_HZ;
+		double stance = i < RATE_HZ * 6 / 10 ? sin(M_PI * i / (RATE_HZ * 0.6)) : 0.0;
+
+		window[i][0] = clamp16(acc_lsb * (0.6 * sin(phase)) + noise(40));
+		window[i][1] = clamp16(acc_lsb * (0.1 * cos(phase)) + noise(40));
+		window[i][2] = clamp16(acc_lsb * (1.0 + 0.8 * sin(2 * phase)) + noise(40));
+		window[i][3] = clamp16(gyr_lsb * (20 * sin(phase)) + noise(20));
+		window[i][4] = clamp16(gyr_lsb * (250 * sin(phase + 0.3)) + noise(20));
+		window[i][5] = clamp16(gyr_lsb * (15 * cos(phase)) + noise(20));
+		window[i][6] = clamp16(20000 * stance * (i < RATE_HZ / 4) + noise(30));
+		window[i][7] = clamp16(20000 * stance * (i >= RATE_HZ / 4) + noise(30));
+	}
+}
+
+static void header_init(struct frame_codec_header *hdr)
+{
+	*hdr = (struct frame_codec_header){
+		.channels = CHANNELS,
+		.timestamp_us = 1234567890,
+		.period_ns = 1000000000 / RATE_HZ,
+		.scale_count = 3,
+		.scales = {
+			{.channels = 3, .scale = (float)ACC_RANGE_G / 32768.0f},
+			{.channels = 3, .scale = (float)GYR_RANGE_DPS / 32768.0f},
+			{.channels = 2, .scale = 1.0f / 32768.0f},
+		},
+	};
+}
+
+/* What the IMU application prints per sample, plus the two pads. */
+static size_t text_size(void)
+{
+	char line[256];
+	size_t total = 0;
+
+	for (int i = 0; i < RATE_HZ; i++) {
+		total += snprintf(line, sizeof(line),
+				  "Acceleration (m/s^2): AX: %.6f; AY: %.6f; AZ: %.6f; \n"
+				  "Rotational velocity (deg/s): GX: %.6f; GY: %.6f; GZ: %.6f\n"
+				  "Pressure: %d %d\n",
+				  window[i][0] * 9.80665 * ACC_RANGE_G / 32768,
+				  window[i][1] * 9.80665 * ACC_RANGE_G / 32768,
+				  window[i][2] * 9.80665 * ACC_RANGE_G / 32768,
+				  window[i][3] * (double)GYR_RANGE_DPS / 32768,
+				  window[i][4] * (double)GYR_RANGE_DPS / 32768,
+				  window[i][5] * (double)GYR_RANGE_DPS / 32768, window[i][6],
+				  window[i][7]);
+	}
+
+	return total;
+}
+
+/* Split into notifications the way the gait service does. */
+static size_t packets_size(size_t *packets)
+{
+	uint8_t packet[PACKET_SIZE];
+	size_t total = 0;
+
+	*packets = 0;
+	for (size_t first = 0; first < RATE_HZ;) {
+		struct frame_codec_header hdr;
+
+		header_init(&hdr);
+		total += frame_codec_encode(&hdr, &window[first][0], RATE_HZ - first, packet,
+					    sizeof(packet));
+		first += hdr.count;
+		(*packets)++;
+	}
+
+	return total;
+}
+
+static double seconds_since(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(void)
+{
+	struct frame_codec_header hdr;
+	struct timespec start;
+	size_t raw = sizeof(window);
+	size_t text;
+	size_t len;
+	size_t packets;
+	size_t split;
+	double encode_s;
+	double decode_s;
+	int err;
+
+	srand(1);
+	window_generate();
+	text = text_size();
+
+	header_init(&hdr);
+	len = frame_codec_encode(&hdr, &window[0][0], RATE_HZ, encoded, sizeof(encoded));
+	err = frame_codec_decode(encoded, len, &hdr, &decoded[0][0], RATE_HZ);
+	if (err != (int)len || hdr.count != RATE_HZ || memcmp(window, decoded, raw) != 0) {
+		printf("Round trip failed (%d)\n", err);
+		return 1;
+	}
+	split = packets_size(&packets);
+
+	printf("One second at %d Hz, %d channels:\n", RATE_HZ, CHANNELS);
+	printf("  text     %6zu B\n", text);
+	printf("  int16    %6zu B  %5.1fx smaller than text\n", raw, (double)text / raw);
+	printf("  encoded  %6zu B  %5.1fx smaller than text, %.2fx than int16\n", len,
+	       (double)text / len, (double)raw / len);
+	printf("  %zu B in %zu notifications of up to %d B\n", split, packets, PACKET_SIZE);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int r = 0; r < ROUNDS; r++) {
+		header_init(&hdr);
+		len = frame_codec_encode(&hdr, &window[0][0], RATE_HZ, encoded, sizeof(encoded));
+	}
+	encode_s = seconds_since(&start);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int r = 0; r < ROUNDS; r++) {
+		err = frame_codec_decode(encoded, len, &hdr, &decoded[0][0], RATE_HZ);
+	}
+	decode_s = seconds_since(&start);
+
+	if (err < 0) {
+		printf("Decode failed (%d)\n", err);
+		return 1;
+	}
+
+	printf("Encode %.1f MB/s of int16, %.0f ns per sample\n", raw * ROUNDS / encode_s / 1e6,
+	       encode_s * 1e9 / ROUNDS / RATE_HZ);
+	printf("Decode %.1f MB/s of int16, %.0f ns per sample\n", raw * ROUNDS / decode_s / 1e6,
+	       decode_s * 1e9 / ROUNDS / RATE_HZ);
+
+	return 0;
+}
@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2024 Batteryless Gadgets
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * Host decoder of the gait records in src/common/gait.cddl.
+ *
+ * Reads the notifications of the records characteristic as hex, one per
+ * line as a central logs them, and prints every message. Records of the
+ * bulk channel are read the same way, without their 8 byte header. Lines
+ * starting with # are skipped. The decoders are generated from the schema
+ * with zcbor, which copies its C library next to them. Build and run with:
+ *
+ *   zcbor code --cddl src/common/gait.cddl --decode --copy-sources \
+ *     --entry-types gait-msg-header gait-msg-stride gait-msg-event gait-msg-activity \
+ *     --output-c gait_cbor/gait_cbor_decode.c --output-h gait_cbor/gait_cbor_decode.h \
+ *     --output-h-types gait_cbor/gait_cbor_types.h
+ *   cc -O2 -I gait_cbor src/tools/gait_cbor_dump.c gait_cbor/gait_cbor_decode.c \
+ *      gait_cbor/zcbor_decode.c gait_cbor/zcbor_common.c -o gait_cbor_dump
+ *   ./gait_cbor_dump < notifications.txt
+ *
+ * src/tools/gait_cbor_records.txt holds one reference message of every
+ * kind with the expected output, run it after every schema change.
+ */
+
+#include <ctype.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "gait_cbor_decode.h"
+
+/* Longest notification with the 498 byte MTU. */
+#define RECORD_MAX 495
+
+static const char *const event_names[] = {"heel strike", "toe off", "peak pressure"};
+static const char *const activity_names[] = {"still", "walking", "running", "unknown"};
+
+/* Hex digits in pairs, anything else separates them. */
+static size_t hex_parse(const char *line, uint8_t *buf, size_t size)
+{
+	size_t len = 0;
+	int high = -1;
+
+	for (; *line && len < size; line++) {
+		int digit;
+
+		if (!isxdigit((unsigned char)*line)) {
+			high = -1;
+			continue;
+		}
+
+		digit = isdigit((unsigned char)*line) ? *line - '0' : tolower(*line) - 'a' + 10;
+		if (high < 0) {
+			high = digit;
+		} else {
+			buf[len++] = (uint8_t)(high << 4 | digit);
+			high = -1;
+		}
+	}
+
+	return len;
+}
+
+/* Every message starts with its kind, so only one decoder accepts it. */
+static int record_print(const uint8_t *buf, size_t len)
+{
+	struct gait_msg_header header;
+	struct gait_msg_stride stride;
+	struct gait_msg_event event;
+	struct gait_msg_activity activity;
+	size_t used;
+
+	if (cbor_decode_gait_msg_header(buf, len, &header, &used) == ZCBOR_SUCCESS) {
+		printf("header: schema %" PRIu32 ", %" PRIu32 " Hz, %" PRIu32 " g, %" PRIu32
+		       " deg/s\n",
+		       header.schema, header.rate_hz, header.acc_range_g, header.gyr_range_dps);
+	} else if (cbor_decode_gait_msg_stride(buf, len, &stride, &used) == ZCBOR_SUCCESS) {
+		printf("%" PRIu64 " us stride: %" PRIu32 " mm in %" PRIu32 " ms, %" PRIu32
+		       " mm/s, clearance %" PRIu32 " mm\n",
+		       stride.timestamp_us, stride.length_mm, stride.duration_ms,
+		       stride.speed_mm_s, stride.clearance_mm);
+	} else if (cbor_decode_gait_msg_event(buf, len, &event, &used) == ZCBOR_SUCCESS) {
+		printf("%" PRIu64 " us %s: %" PRId32 " mV\n", event.timestamp_us,
+		       event_names[event.event], event.value_mv);
+	} else if (cbor_decode_gait_msg_activity(buf, len, &activity, &used) == ZCBOR_SUCCESS) {
+		printf("%" PRIu64 " us activity: %" PRIu32 " steps, %s\n", activity.timestamp_us,
+		       activity.steps, activity_names[activity.activity]);
+	} else {
+		return -1;
+	}
+
+	if (used != len) {
+		printf("  %zu trailing bytes\n", len - used);
+	}
+
+	return 0;
+}
+
+int main(void)
+{
+	char line[4 * RECORD_MAX];
+	uint8_t buf[RECORD_MAX];
+	unsigned int failed = 0;
+
+	while (fgets(line, sizeof(line), stdin)) {
+		size_t len;
+
+		if (line[0] == '#') {
+			continue;
+		}
+
+		len = hex_parse(line, buf, sizeof(buf));
+		if (len == 0) {
+			continue;
+		}
+
+		if (record_print(buf, len)) {
+			printf("undecodable: %s", line);
+			failed++;
+		}
+	}
+
+	return failed ? 1 : 0;
+}